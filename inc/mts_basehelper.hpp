@@ -226,6 +226,19 @@ public://----------------------- PUBLIC METHODS --------------------------
         static string
             strip(string str);
 
+        /* Returns a monotonic time in nanoseconds */
+        static uint64
+            monotonicNs();
+
+        /*
+         * Returns the modification time of a file in nanoseconds since the
+         * epoch, or -1 if it can't be found
+         *
+         * path - the file
+         */
+        static int64_t
+            modificationTime(const string &path);
+
         /*
          * A Helper method to easily read lines from a file
          *
@@ -7,6 +7,7 @@
 
 #include "mts_basehelper.hpp"
 #include "mts_config.hpp"
+#include "mts_quantiletable.hpp"
 
 using std::string;
 using std::vector;
@@ -32,6 +33,14 @@ class MTS_BackgroundHelper {
         beta_distribution<> texture_distribution;
         variate_generator<mt19937, beta_distribution<> > texture_distrib_gen;
 
+        /* Lookup tables standing in for the two generators above when
+         * sampler_tables is set (empty otherwise) */
+        MTS_QuantileTable bias_var_table;
+        MTS_QuantileTable texture_table;
+
+        /* Builds the tables if sampler_tables is set, else empties them */
+        void buildTables();
+
   
         /*
          * Makes a thicker line behind the original that is a different 
@@ -384,6 +393,17 @@ class MTS_BackgroundHelper {
         //Destructor
         ~MTS_BackgroundHelper();
 
+        /* Reseeds the engines of the distribution generators from helper */
+        void
+            reseed();
+
+        /*
+         * Re-reads the distribution parameters from config after it was
+         * reloaded; the engines carry on as they were
+         */
+        void
+            updateParams();
+
         /*
          * Generate bg features that will be drawn on current image
          * basing on the probabilities the user gives
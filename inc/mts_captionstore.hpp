@@ -0,0 +1,119 @@
+#ifndef MTS_CAPTION_STORE_HPP
+#define MTS_CAPTION_STORE_HPP
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using std::string;
+using std::vector;
+
+/*
+ * Layout of a caption store file (built by mts-captions from caption list
+ * files):
+ *
+ *   MTS_CaptionHeader     (padded to MTS_CAPTIONS_HEADER_SIZE bytes)
+ *   MTS_CaptionEntry[count]
+ *   text region           (text_size bytes of utf-8, no terminators; a
+ *                          caption listed more than once is stored once
+ *                          and every entry for it points there)
+ */
+#define MTS_CAPTIONS_MAGIC "MTSCAPS1"
+#define MTS_CAPTIONS_VERSION 1
+#define MTS_CAPTIONS_HEADER_SIZE 64
+
+struct MTS_CaptionHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t pad;
+        uint64_t count;      // number of entries (duplicates included)
+        uint64_t text_size;  // size of the text region in bytes
+        uint64_t key;        // identifies what the store was built from
+                             // (0 for stores built by mts-captions)
+};
+
+struct MTS_CaptionEntry {
+        uint64_t offset;     // from the start of the text region
+        uint32_t length;     // in bytes
+        uint32_t chars;      // in characters
+};
+
+/*
+ * A read-only, memory-mapped list of captions. Looking a caption up is
+ * one table read; nothing is copied until the caller asks for a string,
+ * and processes mapping the same file share its pages.
+ */
+class MTS_CaptionStore {
+
+    private://---------------------- PRIVATE FIELDS ---------------------------
+
+        int fd;
+        size_t map_size;
+        char *map;
+        const MTS_CaptionHeader *header;
+        const MTS_CaptionEntry *entries;
+        const char *text;
+
+    public://----------------------- PUBLIC METHODS --------------------------
+
+        /*
+         * Maps a caption store file. Exits if it can't be read, isn't a
+         * caption store, or has an entry outside of the file.
+         *
+         * path - the file to map
+         */
+        MTS_CaptionStore(string path);
+
+        /* Destructor, unmaps the file */
+        ~MTS_CaptionStore();
+
+        /* Returns true if path names a caption store file */
+        static bool
+            isStore(string path);
+
+        /*
+         * Writes a caption store file holding the given captions, in
+         * order. The file is written next to path and renamed into place,
+         * so processes mapping the old file are unaffected. Returns the
+         * number of distinct captions, or -1 if the file couldn't be
+         * written.
+         *
+         * path - the file to write
+         * captions - the captions, duplicates allowed
+         * key - recorded in the header for key()
+         */
+        static int64_t
+            build(string path, const vector<string> &captions,
+                    uint64_t key = 0);
+
+        /* Returns the number of captions */
+        uint64_t
+            size() const;
+
+        /* Returns the size of the text region in bytes */
+        uint64_t
+            textSize() const;
+
+        /* Returns the key the store was built with */
+        uint64_t
+            key() const;
+
+        /*
+         * Returns a pointer to caption index (not terminated)
+         *
+         * index - which caption, less than size()
+         * length - the output length in bytes
+         */
+        const char *
+            get(uint64_t index, uint32_t &length) const;
+
+        /*
+         * Returns the number of characters in caption index
+         *
+         * index - which caption, less than size()
+         */
+        uint32_t
+            charCount(uint64_t index) const;
+};
+
+#endif
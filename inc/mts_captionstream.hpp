@@ -0,0 +1,124 @@
+#ifndef MTS_CAPTION_STREAM_HPP
+#define MTS_CAPTION_STREAM_HPP
+
+#include <string>
+#include <vector>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+using std::string;
+using std::vector;
+
+/*
+ * Captions streamed from text files too big to load, one caption per
+ * line. A background thread reads the files round and round (through
+ * gzip -dc or zstd -dc for .gz and .zst files) into a bounded reservoir:
+ * lines fill it first, then each new line replaces a random one. Captions
+ * are drawn from the reservoir, and every draw lets the reader replace
+ * `turnover` more lines, so reading keeps pace with synthesis rather than
+ * spinning through the corpus.
+ *
+ * Which lines are in the reservoir depends on thread timing, so streamed
+ * captions are not reproducible from a seed.
+ */
+class MTS_CaptionStream {
+
+    private://---------------------- PRIVATE FIELDS ---------------------------
+
+        vector<string> files_;
+        size_t capacity_;
+        double turnover_;
+        std::function<bool(const string&)> accept_;
+
+        /* Guards everything below */
+        std::mutex mutex_;
+        std::condition_variable changed_;
+
+        vector<string> reservoir_;
+        /* Lines the reader may still put in a full reservoir */
+        double credit_;
+        /* Set under the mutex, but also read without it by the reader
+         * between lines */
+        std::atomic<bool> stop_;
+        /* Set if a whole pass over the files gave no usable line */
+        bool empty_;
+
+        /* The decompressor of the file being read, if any */
+        pid_t child_;
+
+        std::mt19937 rng_;
+        std::thread reader_;
+
+    private://---------------------- PRIVATE METHODS --------------------------
+
+        /* Body of the reader thread */
+        void
+            run();
+
+        /*
+         * Opens a file for reading, through a decompressor if its name
+         * ends in .gz, .zst or .zstd (setting child_). Returns NULL if
+         * that fails.
+         */
+        FILE *
+            openFile(const string &path);
+
+        /* Closes a file opened by openFile */
+        void
+            closeFile(FILE *file);
+
+        /*
+         * Puts a line into the reservoir, waiting for credit if it is
+         * full. Returns false once stopping.
+         */
+        bool
+            insert(string &line);
+
+    public://----------------------- PUBLIC METHODS --------------------------
+
+        /*
+         * Starts reading. Exits if a file does not exist.
+         *
+         * files - the text files, plain or compressed
+         * capacity - the number of lines kept in the reservoir
+         * turnover - new lines read per caption drawn
+         * accept - the lines to keep (e.g. the charset filter)
+         * seed - seeds the choice of lines to replace
+         */
+        MTS_CaptionStream(const vector<string> &files, size_t capacity,
+                double turnover, std::function<bool(const string&)> accept,
+                uint64_t seed);
+
+        /* Destructor, stops the reader */
+        ~MTS_CaptionStream();
+
+        /*
+         * Copies a random caption out of the reservoir, waiting for the
+         * first one to arrive. Exits if the files hold no usable line.
+         *
+         * r - a random number choosing the caption
+         * caption - the output caption
+         */
+        void
+            draw(uint64_t r, string &caption);
+
+        /*
+         * Like draw, but prefers captions of about the given length: the
+         * closest of a few random candidates is picked.
+         *
+         * r - a random number choosing the candidates
+         * length - the wanted length in characters
+         * caption - the output caption
+         */
+        void
+            drawNear(uint64_t r, int length, string &caption);
+};
+
+#endif
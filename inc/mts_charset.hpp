@@ -0,0 +1,64 @@
+#ifndef MTS_CHARSET_HPP
+#define MTS_CHARSET_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+
+using std::string;
+using std::vector;
+
+/*
+ * The output characters of a recognition model, used to turn captions
+ * into label index vectors. A charset file is utf-8 text; every character
+ * in it except line breaks is one class, numbered in order of appearance
+ * from 0 (so "ab\ncd" gives a=0, b=1, c=2, d=3).
+ */
+class MTS_Charset {
+
+    private://---------------------- PRIVATE FIELDS ---------------------------
+
+        /* Class index of each code point */
+        std::unordered_map<uint32_t, int32_t> index_;
+
+    public://----------------------- PUBLIC METHODS --------------------------
+
+        /*
+         * Reads a charset file. Exits if it can't be read, isn't valid
+         * utf-8 or lists a character twice.
+         *
+         * charset_file - the file to read
+         */
+        MTS_Charset(string charset_file);
+
+        /* Returns the number of classes */
+        size_t
+            size() const;
+
+        /*
+         * Returns the next code point of utf-8 text, or -1 on a malformed
+         * sequence.
+         *
+         * text - the text
+         * pos - where to start, moved past the code point read
+         */
+        static int64_t
+            decode(const string &text, size_t &pos);
+
+        /*
+         * Turns text into class indices. Returns false if some character
+         * isn't in the charset (label then holds the indices before it).
+         *
+         * text - utf-8 text
+         * label - output, one index per character
+         */
+        bool
+            encode(const string &text, vector<int32_t> &label) const;
+
+        /* Returns whether every character of text is in the charset */
+        bool
+            covers(const string &text) const;
+};
+
+#endif
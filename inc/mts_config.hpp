@@ -15,11 +15,15 @@ class MTSConfig {
         /*
          * Parses a text file for variable names and values, using '='
          * as the delimeter, and places the data into parameter_map.
+         * Returns false (with a message) if the file can't be read or
+         * has a line without a delimeter.
          *
          * filename - the name of the file to parse for values
+         * parameter_map - output, the parameters
          */
-        std::unordered_map<std::string,std::string>
-        parseConfig(std::string filename);
+        bool
+        parseConfig(std::string filename,
+                std::unordered_map<std::string,std::string> &parameter_map);
 
         std::unordered_map<std::string, std::string> params;
         std::unordered_map<std::string, int> paramsInt;
@@ -35,6 +39,31 @@ class MTSConfig {
    */
         MTSConfig(std::string filename);
 
+  /*
+   * Constructor for an empty config, to be filled by read.
+   */
+        MTSConfig();
+
+  /*
+   * Replaces all parameters with those of a config file. Returns false,
+   * leaving the parameters unchanged, if the file can't be parsed.
+   *
+   * filename - the name of the file from which to parse parameters from
+   */
+        bool read(std::string filename);
+
+  /*
+   * Exchanges all parameters with those of another config.
+   *
+   * other - the other config
+   */
+        void swap(MTSConfig &other);
+
+  /*
+   * Returns the names of all parameters in the params map.
+   */
+        std::vector<std::string> getKeys();
+
   /*
    * Finds if the user configured parameter is in the params map.
    * Returns true if it is, otherwise false.
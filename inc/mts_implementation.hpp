@@ -16,9 +16,12 @@
 #include "mts_config.hpp"
 #include "mts_texthelper.hpp"
 #include "mts_bghelper.hpp"
+#include "mts_samplestore.hpp"
+#include "mts_quantiletable.hpp"
 
 using std::string;
 using std::shared_ptr;
+using std::vector;
 using cv::Mat;
 using boost::random::mt19937;
 using boost::random::gamma_distribution;
@@ -43,22 +46,73 @@ protected://-------------PROTECTED METHODS AND FIELDS------------------------
         /* Adds Gaussian noise to out
          *
          * out - the input and output image
+         * sigma - standard deviation of the noise
          */
-        void addGaussianNoise(Mat& out);
+        void addGaussianNoise(Mat& out, double sigma);
 
   
         /* Adds Gaussian blur to out
          *
          * out - the input and output image
+         * ker_size - the (odd) kernel size
          */
-        void addGaussianBlur(Mat& out);
+        void addGaussianBlur(Mat& out, int ker_size);
 
         /* Adds jpeg compression artifacts to img
          *
          * out - the input and output image
+         * quality - the jpeg quality to compress with
          * Adapted from Anguelos's code: https://github.com/anguelos/opencv_contrib/blob/gsoc_final_submission/modules/text/src/text_synthesizer.cpp
          */
-        void addCompressionArtifacts(Mat& out);
+        void addCompressionArtifacts(Mat& out, int quality);
+
+        /*
+         * Synthesize a fresh sample: plan then render (see generateSample)
+         *
+         * caption - the text displayed in the image
+         * sample - the opencv matrix that actually contains the image data
+         * actual_height - the actual height of sample in pixels.
+         */
+        void synthesizeSample(string &caption, Mat &sample,
+                              int &actual_height);
+
+        /*
+         * Draw a planned sample as 8 bit grayscale (see render)
+         *
+         * plan - a plan from plan()
+         * caption - the text displayed in the image
+         * sample - the opencv matrix that actually contains the image data
+         * actual_height - the actual height of sample in pixels.
+         */
+        void renderSample(const MTSPlan &plan, string &caption, Mat &sample,
+                          int &actual_height);
+
+        /*
+         * Apply the output_float normalization to a finished sample
+         *
+         * sample - the input and output image
+         */
+        void finishSample(Mat &sample);
+
+        /*
+         * Reseed all generators from seed, without touching the recipe
+         * stream (see setSeed)
+         *
+         * seed - the new seed
+         */
+        void reseedGenerators(uint64_t seed);
+
+        /*
+         * Synthesize a fresh sample from its own seed and describe it
+         *
+         * seed - the seed of the sample
+         * caption - the text displayed in the image
+         * sample - the opencv matrix that actually contains the image data
+         * actual_height - the actual height of sample in pixels.
+         * recipe - output description (seed is left untouched)
+         */
+        void renderRecipe(uint64_t seed, string &caption, Mat &sample,
+                          int &actual_height, MTSRecipe &recipe);
 
         shared_ptr<MTSConfig> config;
         shared_ptr<MTS_BaseHelper> helper;
@@ -69,16 +123,76 @@ protected://-------------PROTECTED METHODS AND FIELDS------------------------
         gamma_distribution<> noise_dist;
         variate_generator<mt19937, gamma_distribution<> > noise_gen;
 
+        /* Lookup table for noise_gen when sampler_tables is set */
+        MTS_QuantileTable noise_table;
+
+        /* Store of past samples for replay (null unless replay_file is
+         * set), and the fraction of samples served from it */
+        shared_ptr<MTS_SampleStore> store;
+        double replay_fraction;
+
+        /* Background features of the last synthesized sample, as bits */
+        uint32_t bg_feature_bits;
+
+        /* Width bucket boundaries; when set, every generated sample is
+         * steered into a random bucket [width_buckets[i], width_buckets[i+1]) */
+        vector<int> width_buckets;
+
+        /* How many captions plan() tries to land in a width bucket */
+        int bucket_attempts;
+
+        /* Height of every output sample in pixels (0 keeps the drawn
+         * height); whether to render at it directly instead of resampling */
+        int output_height;
+        bool output_direct;
+
+        /* Output CV_32FC1 samples of (pixel/255 - output_mean) * output_scale
+         * instead of 8 bit ones */
+        bool output_float;
+        double output_mean;
+        double output_scale;
+
+        /* Recipe samples are seeded from recipe_base and their counter */
+        uint64_t recipe_base;
+        uint64_t recipe_counter;
+
+        /* The config file, checked for changes every config_reload_s
+         * seconds (0: never); its modification time when last read, and
+         * when to check next (monotonic ns) */
+        string config_file_;
+        double config_reload_s;
+        int64_t config_mtime_ns;
+        uint64_t config_check_ns;
+
+        /* Re-reads the settings cached from config after a reload */
+        void updateParams();
+
+        /* Reloads the config file if it has changed and is due a check */
+        void checkConfigFile();
+
+        /* The width of a planned sample as output: measured at
+         * plan.height, then scaled to output_height if it is resized */
+        int outputWidth(const MTSPlan &plan);
+
 public://-----------------PUBLIC METHODS AND FIELDS------------------------
 
-        /* Constructor */
-        MTSImplementation(string config_file);
+        /*
+         * Constructor
+         *
+         * config_file - the config file
+         * share - another profile of the same mixture (or NULL), whose
+         *         font map and captions are shared when they match
+         */
+        MTSImplementation(string config_file,
+                const MTSImplementation *share = NULL);
 
         /* Destructor */
         ~MTSImplementation();
 
         /*
-         * Generate a sample image
+         * Generate a sample image. With a replay store configured, a
+         * replay_fraction of samples are copies of earlier samples read
+         * from the store; all others are synthesized and appended to it.
          *
          * caption - the text displayed in the image
          * sample - the opencv matrix that actually contains the image data
@@ -87,6 +201,127 @@ public://-----------------PUBLIC METHODS AND FIELDS------------------------
         void generateSample(string &caption, Mat &sample,
                             int &actual_height);
 
+        /*
+         * Generate a sample image from its own seed, and describe it
+         *
+         * caption - the text displayed in the image
+         * sample - the opencv matrix that actually contains the image data
+         * actual_height - the actual height of sample in pixels.
+         * recipe - output description of the sample
+         */
+        void generateSample(string &caption, Mat &sample,
+                            int &actual_height, MTSRecipe &recipe);
+
+        /*
+         * Make every random choice for the next sample, drawing nothing
+         *
+         * plan - the output scene description
+         */
+        void plan(MTSPlan &plan);
+
+        /*
+         * Plan the next sample so that its width lands in
+         * [min_width, max_width], choosing caption length and stretch to
+         * fit (best effort: the closest plan tried is kept)
+         *
+         * plan - the output scene description
+         * min_width - the smallest wanted width in pixels
+         * max_width - the largest wanted width in pixels
+         */
+        void plan(MTSPlan &plan, int min_width, int max_width);
+
+        /*
+         * Generate a sample image whose width is in [min_width, max_width]
+         * (see plan). These are never replayed.
+         *
+         * caption - the text displayed in the image
+         * sample - the opencv matrix that actually contains the image data
+         * actual_height - the actual height of sample in pixels.
+         * min_width - the smallest wanted width in pixels
+         * max_width - the largest wanted width in pixels
+         */
+        void generateSample(string &caption, Mat &sample,
+                            int &actual_height, int min_width,
+                            int max_width);
+
+        /*
+         * Draw a planned sample
+         *
+         * plan - a plan from plan()
+         * caption - the text displayed in the image
+         * sample - the opencv matrix that actually contains the image data
+         * actual_height - the actual height of sample in pixels.
+         */
+        void render(const MTSPlan &plan, string &caption, Mat &sample,
+                    int &actual_height);
+
+        /*
+         * Per-font render times, slowest first (see
+         * MTS_TextHelper::fontCostReport)
+         */
+        string fontCostReport();
+
+        /*
+         * Encode caption with the configured charset (see
+         * MapTextSynthesizer::encodeCaption)
+         *
+         * caption - the text displayed in the image
+         * label - output, one class index per character
+         */
+        bool encodeCaption(const string &caption, vector<int32_t> &label);
+
+        /*
+         * Re-render the sample described by recipe; false if it came out
+         * different from what the recipe records
+         *
+         * recipe - a recipe from generateSample
+         * caption - the text displayed in the image
+         * sample - the opencv matrix that actually contains the image data
+         * actual_height - the actual height of sample in pixels.
+         */
+        bool regenerate(const MTSRecipe &recipe, string &caption,
+                        Mat &sample, int &actual_height);
+
+        /*
+         * Reseed all generators (base helper, text, background and noise)
+         * and restart the recipe stream from seed
+         *
+         * seed - the new seed
+         */
+        void setSeed(uint64_t seed);
+
+        /* Split the epoch order between workers (see MapTextSynthesizer) */
+        void setEpochShard(uint32_t shard, uint32_t shards);
+
+        /*
+         * A single profile only accepts one positive weight (see
+         * MapTextSynthesizer::setProfileWeights)
+         *
+         * weights - the profile weights
+         */
+        bool setProfileWeights(const vector<double> &weights);
+
+        /*
+         * Swap in the parameters of a config file between two samples
+         * (see MapTextSynthesizer::reloadConfig)
+         *
+         * config_file - the config file
+         */
+        bool reloadConfig(const string &config_file);
+
+        /*
+         * Generate the sample of a given seed and describe it, as
+         * generateSample does with a seed from the recipe stream
+         *
+         * seed - the seed of the sample
+         * caption - the text displayed in the image
+         * sample - the opencv matrix that actually contains the image data
+         * actual_height - the actual height of sample in pixels.
+         * recipe - output description (seed and counter are left untouched)
+         */
+        void generateSeeded(uint64_t seed, string &caption, Mat &sample,
+                            int &actual_height, MTSRecipe &recipe);
+
 };
 
 #endif
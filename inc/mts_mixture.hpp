@@ -0,0 +1,164 @@
+#ifndef MTS_MIXTURE_HPP
+#define MTS_MIXTURE_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+
+// opencv includes
+#include <opencv2/core.hpp>      //cv::RNG
+#include <opencv2/core/mat.hpp>  //cv::Mat
+
+// local files
+#include "mtsynth/map_text_synthesizer.hpp"
+#include "mts_implementation.hpp"
+
+using std::string;
+using std::shared_ptr;
+using std::vector;
+using cv::Mat;
+
+/*
+ * A synthesizer made of several config profiles (e.g. clean, textured and
+ * rotated styles), each an MTSImplementation, one of which is picked at
+ * random for every sample. The later profiles share the first one's font
+ * map and captions when their settings match.
+ */
+class MTSMixture: public MapTextSynthesizer{
+
+private://-----------------PRIVATE METHODS AND FIELDS-----------------------
+
+        /* The profiles, and the running sums of their weights */
+        vector<shared_ptr<MTSImplementation> > profiles_;
+        vector<double> cumulative_;
+
+        /* Picks the profile of samples that aren't made from a seed */
+        cv::RNG rng_;
+
+        /* Recipe samples are seeded from recipe_base and their counter */
+        uint64_t recipe_base;
+        uint64_t recipe_counter;
+
+        /* The config file with the profiles parameter (empty if made from
+         * a list of files), the profile files it last listed, how often to
+         * check them all for changes in seconds (0: never), their
+         * modification times when last read, and when to check next
+         * (monotonic ns) */
+        string config_file_;
+        vector<string> profile_files_;
+        double config_reload_s;
+        vector<int64_t> config_mtimes_ns;
+        uint64_t config_check_ns;
+
+        /* Returns the modification times of config_file_ and the profile
+         * files, in that order */
+        vector<int64_t> configMtimes();
+
+        /* Reloads the mixture if its config file or a profile file has
+         * changed and is due a check */
+        void checkConfigFiles();
+
+        /* Draws a profile index according to the weights */
+        int pickProfile();
+
+        /*
+         * Returns the profile of the recipe sample of a given seed, so
+         * that regenerate finds it again
+         *
+         * seed - the sample's seed
+         */
+        int profileOfSeed(uint64_t seed);
+
+public://-----------------PUBLIC METHODS AND FIELDS------------------------
+
+        /*
+         * Constructor. Exits if there are no profiles or the weights
+         * don't fit them.
+         *
+         * config_files - one config file per profile
+         * weights - the share of samples of each profile
+         * seed - the seed (0 for one from the pid and time)
+         * config_file - the file with the profiles parameter they came
+         *         from, if any; with config_reload_s set in it, the
+         *         mixture watches it and every profile file
+         */
+        MTSMixture(const vector<string> &config_files,
+                const vector<double> &weights, uint64_t seed,
+                const string &config_file = "");
+
+        /* Destructor */
+        ~MTSMixture();
+
+        /* Generate a sample with a profile picked by weight */
+        void generateSample(string &caption, Mat &sample,
+                            int &actual_height);
+
+        /* Generate a width bucketed sample with a profile picked by weight */
+        void generateSample(string &caption, Mat &sample,
+                            int &actual_height, int min_width,
+                            int max_width);
+
+        /*
+         * Generate a sample from the recipe stream; its profile follows
+         * from its seed
+         */
+        void generateSample(string &caption, Mat &sample,
+                            int &actual_height, MTSRecipe &recipe);
+
+        /* Plan with a profile picked by weight (sets plan.profile) */
+        void plan(MTSPlan &plan);
+        void plan(MTSPlan &plan, int min_width, int max_width);
+
+        /* Render a plan with the profile that planned it */
+        void render(const MTSPlan &plan, string &caption, Mat &sample,
+                    int &actual_height);
+
+        /* Encode caption with the first profile's charset */
+        bool encodeCaption(const string &caption, vector<int32_t> &label);
+
+        /* The font cost report of every profile, one after the other */
+        string fontCostReport();
+
+        /* Re-render a recipe sample with the profile of its seed */
+        bool regenerate(const MTSRecipe &recipe, string &caption,
+                        Mat &sample, int &actual_height);
+
+        /*
+         * Reseed the profile choice and every profile (each from its own
+         * seed derived from seed), and restart the recipe stream
+         *
+         * seed - the new seed
+         */
+        void setSeed(uint64_t seed);
+
+        /* Split the epoch order of every profile between workers (see
+         * MapTextSynthesizer) */
+        void setEpochShard(uint32_t shard, uint32_t shards);
+
+        /* Change the profile weights (see MapTextSynthesizer) */
+        bool setProfileWeights(const vector<double> &weights);
+
+        /*
+         * Reload every profile from the files listed by the profiles
+         * parameter of config_file, and take its weights. Returns false if
+         * the list has another length or a profile fails to reload (the
+         * others are reloaded all the same).
+         *
+         * config_file - a config file with a profiles parameter
+         */
+        bool reloadConfig(const string &config_file);
+
+        /*
+         * Splits a profiles parameter, "a.txt: 0.5, b.txt: 0.3, c.txt"
+         * (weight 1 if not given). Returns false if a weight is invalid.
+         *
+         * list - the parameter value
+         * files - output, the config files
+         * weights - output, their weights
+         */
+        static bool parseProfiles(const string &list, vector<string> &files,
+                vector<double> &weights);
+};
+
+#endif
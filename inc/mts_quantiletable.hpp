@@ -0,0 +1,100 @@
+#ifndef MTS_QUANTILE_TABLE_HPP
+#define MTS_QUANTILE_TABLE_HPP
+
+#include <vector>
+#include <stdint.h>
+
+// boost includes
+#include <boost/random/beta_distribution.hpp>
+#include <boost/random/gamma_distribution.hpp>
+
+using std::vector;
+
+/*
+ * An inverse-CDF lookup table for a beta or gamma distribution: the
+ * quantiles at 1/N, 2/N, ..., (N-1)/N, computed once from the
+ * distribution's parameters. A draw takes one 32 bit number from the
+ * engine, picks its bin and interpolates linearly between the two
+ * quantiles around it, instead of the two gamma variates (logs,
+ * exponentials and a rejection loop) a boost beta draw costs. In the
+ * first and last bins, where the quantile function may be far from
+ * linear (and is unbounded above for gamma), the exact quantile is
+ * computed instead, so the tails are exact.
+ *
+ * An empty table draws from the exact generator it is given, which is
+ * how the sampler_tables parameter switches tables off.
+ */
+class MTS_QuantileTable {
+
+    private://---------------------- PRIVATE FIELDS ---------------------------
+
+        enum Kind { NONE, BETA, GAMMA };
+
+        Kind kind_;
+        double a_;
+        double b_;
+
+        /* quantiles_[k] is the quantile at k/N for 0 < k < N; the first
+         * and last entries are unused */
+        vector<double> quantiles_;
+
+    private://---------------------- PRIVATE METHODS --------------------------
+
+        /* The exact quantile of the distribution at u */
+        double
+            quantile(double u) const;
+
+        /* Fills quantiles_ from kind_, a_ and b_ */
+        void
+            fill();
+
+        /* Turns a 32 bit number into a draw */
+        double
+            lookup(uint32_t x) const;
+
+    public://----------------------- PUBLIC METHODS --------------------------
+
+        /* Constructor, of an empty table */
+        MTS_QuantileTable();
+
+        /*
+         * Tabulates a beta distribution
+         *
+         * dist - the distribution
+         */
+        void
+            build(const boost::random::beta_distribution<> &dist);
+
+        /*
+         * Tabulates a gamma distribution (shape alpha, scale beta)
+         *
+         * dist - the distribution
+         */
+        void
+            build(const boost::random::gamma_distribution<> &dist);
+
+        /* Empties the table */
+        void
+            clear();
+
+        /* Whether the table is empty */
+        bool
+            empty() const;
+
+        /*
+         * Draws a value: from the table with the generator's engine, or
+         * from the generator itself if the table is empty
+         *
+         * gen - a boost variate_generator of the tabulated distribution
+         */
+        template<class Generator>
+        double
+            draw(Generator &gen) const {
+                if (quantiles_.empty()) {
+                    return gen();
+                }
+                return lookup((uint32_t)gen.engine()());
+            }
+};
+
+#endif
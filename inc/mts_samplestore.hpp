@@ -0,0 +1,109 @@
+#ifndef MTS_SAMPLE_STORE_HPP
+#define MTS_SAMPLE_STORE_HPP
+
+#include <string>
+#include <stdint.h>
+
+#include <opencv2/core/mat.hpp> //cv::Mat
+
+using std::string;
+using cv::Mat;
+
+/*
+ * Layout of a sample store file:
+ *
+ *   MTS_StoreHeader    (padded to MTS_STORE_HEADER_SIZE bytes)
+ *   MTS_StoreEntry[capacity]
+ *   data region        (data_size bytes: caption, then rows*cols pixels,
+ *                       for every sample, back to back)
+ */
+#define MTS_STORE_MAGIC "MTSSTORE"
+#define MTS_STORE_VERSION 1
+#define MTS_STORE_HEADER_SIZE 4096
+
+struct MTS_StoreHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t pad;
+        uint64_t capacity;   // number of entries in the offset table
+        uint64_t data_size;  // size of the data region in bytes
+        uint64_t reserved;   // entries claimed so far (may exceed capacity)
+        uint64_t data_end;   // bytes of the data region claimed so far
+};
+
+struct MTS_StoreEntry {
+        uint64_t offset;     // of the caption, from the start of the data region
+        uint32_t rows;
+        uint32_t cols;
+        uint32_t actual_height;
+        uint32_t caption_len;
+        uint32_t ready;      // set last, once the sample is fully written
+        uint32_t pad;
+};
+
+/*
+ * A memory-mapped, append-only store of generated samples. Several
+ * processes may map the same file and append concurrently; slots are
+ * claimed atomically and only read once marked ready. Once the offset
+ * table or the data region is full, appends are silently dropped.
+ */
+class MTS_SampleStore {
+
+    private://---------------------- PRIVATE FIELDS ---------------------------
+
+        int fd;
+        size_t map_size;
+        char *map;
+        MTS_StoreHeader *header;
+        MTS_StoreEntry *entries;
+        char *data;
+
+    public://----------------------- PUBLIC METHODS --------------------------
+
+        /*
+         * Opens (or creates) a store file and maps it. An existing file
+         * is reused as it is; its capacity and data size take precedence
+         * over the arguments.
+         *
+         * path - the file to map
+         * capacity - the maximum number of samples kept
+         * data_size - the size of the data region in bytes
+         */
+        MTS_SampleStore(string path, uint64_t capacity, uint64_t data_size);
+
+        /* Destructor, unmaps the file */
+        ~MTS_SampleStore();
+
+        /*
+         * Returns the number of samples that can currently be read
+         * (some of them may still be in the middle of being written).
+         */
+        uint64_t
+            size();
+
+        /*
+         * Copies a sample into the store. Does nothing if it is full.
+         *
+         * caption - the text displayed in the image
+         * sample - a CV_8UC1 image
+         * actual_height - the actual height of the text area of sample
+         */
+        void
+            append(const string &caption, const Mat &sample,
+                    int actual_height);
+
+        /*
+         * Copies sample index out of the store. Returns false if that
+         * sample hasn't been completely written yet.
+         *
+         * index - which sample, less than size()
+         * caption - the output caption
+         * sample - the output image
+         * actual_height - the output actual height
+         */
+        bool
+            read(uint64_t index, string &caption, Mat &sample,
+                    int &actual_height);
+};
+
+#endif
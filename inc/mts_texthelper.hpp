@@ -4,20 +4,74 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <pango/pangocairo.h>
+#include <fontconfig/fontconfig.h>
 
+#include "mtsynth/map_text_synthesizer.hpp" // MTSTextPlan
 #include "mts_basehelper.hpp"
 #include "mts_config.hpp"
+#include "mts_charset.hpp"
+#include "mts_captionstore.hpp"
+#include "mts_captionstream.hpp"
+#include "mts_quantiletable.hpp"
 
 using std::string;
 using std::vector;
 using std::shared_ptr;
+using std::unordered_map;
+using std::unordered_set;
 
 using boost::random::beta_distribution;
 using boost::random::gamma_distribution;
 using boost::random::variate_generator;
 
+/* First line of a font cache file */
+#define FONT_CACHE_MAGIC "MTSFONTS2"
+
+/* Time spent rendering the main text in one font */
+struct MTS_FontCost {
+        uint64_t samples;
+        double layout_ms;   // totals over all samples
+        double raster_ms;
+        double max_ms;      // slowest single sample
+        bool excluded;      // dropped for going over font_max_ms
+
+        MTS_FontCost() : samples(0), layout_ms(0), raster_ms(0), max_ms(0),
+            excluded(false) {}
+};
+
+/*
+ * The text of the captions, shared by the text helpers of profiles with
+ * the same caption settings
+ */
+struct MTS_CaptionTable {
+        /* The captions of the text lists */
+        vector<string> captions;
+
+        /* Caption store files named in the captions lists */
+        vector<shared_ptr<MTS_CaptionStore> > stores;
+
+        /* Captions drawn in epoch order so far: [0] when the files aren't
+         * weighted, [s + 1] from caption file s. Kept here so that the
+         * profiles of a mixture sharing the captions walk one epoch
+         * between them, not one each */
+        vector<uint64_t> epoch_positions;
+};
+
+/* A run of captions that came from one caption file */
+struct MTS_CaptionSegment {
+        int store;          // index in the table's stores, -1 for captions
+        size_t begin;       // of the run in the table's captions (unused
+                            // for a store)
+        size_t count;
+        size_t first;       // number of its first caption overall
+        double weight;      // its share of draws, if the files are weighted
+};
+
 /*
  * A class to handle text transformation in vector space, and pango
  * text rendering 
@@ -25,14 +79,70 @@ using boost::random::variate_generator;
 class MTS_TextHelper {
 private:// --------------- PRIVATE METHODS AND FIELDS ------------------------
 
-        /* Updates the list of available system fonts by
+        /*
+         * Builds this helper's private fontconfig instance and pango font
+         * map, holding only the files of the given families. The files are
+         * found with a full fontconfig scan the first time and remembered
+         * in the font cache file (font_cache, by default
+         * ~/.cache/mtsynth-fonts.idx) after that. Generic names (Serif,
+         * Sans, Monospace, ...) get the files of the family fontconfig
+         * resolves them to. Exits if a family has no files.
+         *
+         * families - the font family names asked for in the config
+         */
+        void createFontMap(const vector<string> &families);
+
+        /*
+         * Reads the font files of a font cache. Returns false if the cache
+         * is missing, lacks one of families, or names a file that no
+         * longer exists. A family may be cached without files.
+         *
+         * path - the cache file
+         * families - the families that must be present
+         * files - output, the files of each cached family
+         */
+        bool readFontCache(string path, const vector<string> &families,
+                           unordered_map<string, vector<string> > &files);
+
+        /*
+         * Writes a font cache (quietly does nothing if it can't)
+         *
+         * path - the cache file
+         * files - the files of each family
+         */
+        void writeFontCache(string path,
+                            const unordered_map<string, vector<string> > &files);
+
+        /*
+         * Finds the font files of a family with a full fontconfig
+         * instance, resolving generic names first
+         *
+         * system - the fontconfig instance
+         * family - the family name
+         * files - output, the family's files
+         */
+        static void findFontFiles(FcConfig *system, const string &family,
+                                  vector<string> &files);
+
+        /* Creates a pango layout for cr that uses fontmap_ */
+        PangoLayout *createLayout(cairo_t *cr);
+
+        /* The private fontconfig instance and the font map built on it
+         * (possibly shared with other profiles' text helpers) */
+        FcConfig *fcconfig_;
+        PangoFontMap *fontmap_;
+
+        /* The families fontmap_ was built for */
+        vector<string> font_families_;
+
+        /* Updates the list of font families in fontmap_ by
          * clearing and reloading font_list
          *
          * font_list - the output
          * Base of this method from Ben K. Bullock at
          * url: https://www.lemoda.net/pango/list-fonts/index.html
          */
-        void updateFontNameList(vector<string>& font_list);
+        void updateFontNameList(unordered_set<string>& font_list);
 
 
         /* Adds a list of fonts to fonts*/
@@ -40,19 +150,132 @@ private:// --------------- PRIVATE METHODS AND FIELDS ------------------------
         void addFontlist(string font_file);
 
 
-        /* Adds a list of captions to captions*/
-        void addCaptionlist(vector<string>& words);
-        void addCaptionlist(string caption_file);
+        /* Adds a list of captions to captions (leaving out those that
+         * are too long or use characters outside the charset), drawn
+         * with the given weight if the caption files are weighted. A
+         * caption file that is a caption store is mapped rather than
+         * read. */
+        void addCaptionlist(vector<string>& words, double weight = 1);
+        void addCaptionlist(string caption_file, double weight = 1);
 
 
-        /* The list of available system font names. */
-        vector<string> availableFonts_ = vector<string>();
+        /* The names of the font families in fontmap_. */
+        unordered_set<string> availableFonts_;
 
         /* A list of fonts */
         vector<string> fonts_;
 
-        /* A list of captions */
-        vector<string> captions_;
+        /* Draw weight of each font (from "name: weight" lines, default 1),
+         * their running sums, and whether they are all 1 */
+        vector<double> font_weights_;
+        vector<double> font_cumulative_;
+        bool fonts_uniform_;
+
+        /* Render time of each font */
+        vector<MTS_FontCost> font_costs_;
+
+        /* Fonts averaging more than this many ms are excluded (0: never),
+         * once they have been used font_cost_min_samples times */
+        double font_max_ms;
+        uint64_t font_cost_min_samples;
+
+        /*
+         * Splits a font list line, "Family Name" or "Family Name: weight"
+         * (also used for "file: weight" entries of the captions parameter)
+         *
+         * line - the line
+         * name - output, the family name
+         * weight - output, the weight (1 if not given)
+         */
+        static void parseFontLine(const string &line, string &name,
+                                  double &weight);
+
+        /* Recomputes font_cumulative_ from font_weights_ */
+        void updateFontCumulative();
+
+        /* Draws a font index according to the weights */
+        int pickFont();
+
+        /* Returns the resident memory of this process in MB */
+        static double residentMb();
+
+        /*
+         * Loads every font with a nonzero weight and lays out and draws
+         * every character the captions use, at each style that can be
+         * drawn and warmup_sizes heights, so that the first samples don't
+         * pay for loading faces, shaping data and glyphs. Stops early once
+         * memory grew by warmup_max_mb (if set). Called at the end of the
+         * constructor when warmup is set; processes forked afterwards
+         * (ipc_synth producers) share the warm caches.
+         */
+        void warmup();
+
+        /*
+         * Lays out and draws alphabet at the font sizes samples of the
+         * given height are drawn at: the size each of the captions gets
+         * once its ink is fit to the height, as in generateTextPatch
+         *
+         * plan - font_index, italic and weight are used
+         * alphabet - pango markup of the characters to draw
+         * captions - pango markup of a few captions to fit the size with
+         * height - the sample height to size the font for
+         */
+        void warmupFont(const MTSTextPlan &plan, const string &alphabet,
+                        const vector<string> &captions, int height);
+
+        /* Returns a monotonic time in nanoseconds */
+        static uint64_t nowNs();
+
+        /*
+         * Adds one sample's render time to a font's cost, and applies
+         * font_max_ms
+         *
+         * index - the font index
+         * layout_ns - time spent laying the text out
+         * raster_ns - time spent drawing it
+         */
+        void recordFontCost(int index, uint64_t layout_ns, uint64_t raster_ns);
+
+        /* The caption text (shared with the profile it was adopted from) */
+        shared_ptr<MTS_CaptionTable> caption_table_;
+
+        /* The caption settings of the config, charset and
+         * caption_max_bytes included, to tell whether another profile's
+         * captions (and caption stream, with its filter) can be adopted */
+        string caption_source_;
+
+        /* Where captions come from instead, when caption_stream is set */
+        shared_ptr<MTS_CaptionStream> caption_stream_;
+
+        /* The caption files, in the order their captions are numbered,
+         * and the running sums of their weights */
+        vector<MTS_CaptionSegment> caption_segments_;
+        vector<double> segment_cumulative_;
+
+        /* Whether draws go by caption file weights (set when any file in
+         * the captions parameter has one) and whether captions are drawn
+         * in epoch order rather than at random (caption_order) */
+        bool captions_weighted_;
+        bool caption_epochs_;
+
+        /* Keys the epoch permutations (the config's seed, so that every
+         * worker of a config walks the same ones; a profile adopting
+         * captions takes the key that goes with them) */
+        uint64_t caption_key_;
+
+        /* The k-th caption drawn in epoch order takes position
+         * k * caption_shards_ + caption_shard_ (see setEpochShard) */
+        uint64_t caption_shard_;
+        uint64_t caption_shards_;
+
+        /* What epoch order draws return instead of taking a position
+         * while it is not -1 (see replayCaption) */
+        int caption_replay_;
+
+        /* Caption numbers by caption length in characters, one map per
+         * caption file if they are weighted, else one in all (built on
+         * first use by planCaptionNear) */
+        vector<std::map<int, vector<int> > > captions_by_length_;
 
         /* Generator for the spacing degree */
         beta_distribution<> spacing_dist;
@@ -66,6 +289,15 @@ private:// --------------- PRIVATE METHODS AND FIELDS ------------------------
         gamma_distribution<> digit_len_dist;
         variate_generator<mt19937, gamma_distribution<> > digit_len_gen;
 
+        /* Lookup tables standing in for the three generators above when
+         * sampler_tables is set (empty otherwise) */
+        MTS_QuantileTable spacing_table;
+        MTS_QuantileTable stretch_table;
+        MTS_QuantileTable digit_len_table;
+
+        /* Builds the tables if sampler_tables is set, else empties them */
+        void buildTables();
+
         /*
          * Returns a random latin character or numeral or punctuation
          */
@@ -101,24 +333,17 @@ private:// --------------- PRIVATE METHODS AND FIELDS ------------------------
             generateFont(char *font, int fontsize);
 
         /*
-         * Generates the text features and pass back to outputs
+         * Turns the text attributes of a plan into pango terms for a
+         * canvas of the given height
          *
-         * rotate_angle - the angle to rotate
-         * curved - whether to curve or not
-         * stretch_deg - the horizontal text scaling factor
-         * spacing- the spacing between characters (in point)
-         * x_pad - padding in x-direction
-         * y_pad - padding in y-direction
-         * scale - scaling factor of the entire text
-         * desc - the pango font description
+         * plan - the planned text attributes
+         * spacing - output, the spacing between characters (in point)
+         * desc - output, the pango font description
          * height - height of canvas
          */
         void
-            generateFeatures(double &rotated_angle, bool &curved, 
-                             double &spacing_deg, double &spacing, 
-                             double &stretch_deg, int &x_pad, int &y_pad,
-                             double &scale, PangoFontDescription *&desc,
-                             int height);
+            applyTextPlan(const MTSTextPlan &plan, double &spacing,
+                          PangoFontDescription *&desc, int height);
 
         /*
          * Creates a curved text whose shape will not be deformed according
@@ -197,11 +422,25 @@ private:// --------------- PRIVATE METHODS AND FIELDS ------------------------
             getTextExtents(PangoLayout *layout, PangoFontDescription *desc,
                            int &x, int &y, int &w, int &h, int &size);
 
+        /*
+         * Rescales the font so that the ink of the layout is height pixels
+         * tall, then gets the extents again, as getTextExtents
+         *
+         * layout - the pango layout, with desc and its markup set
+         * desc - the pango font description, resized in place
+         * height - the ink height to fit, in pixels
+         */
+        void
+            fitTextExtents(PangoLayout *layout, PangoFontDescription *desc,
+                           int height, int &x, int &y, int &w, int &h,
+                           int &size);
+
         /*
          * Generates a text image without background
          *
          * text_surface - surface to draw the text on
          * caption - the text to draw
+         * plan - the text attributes
          * height - the height of the canvas
          * width - output to store the width of the generated image
          * text_color - color of text
@@ -209,7 +448,8 @@ private:// --------------- PRIVATE METHODS AND FIELDS ------------------------
          */
         void
             generateTextPatch(cairo_surface_t *&text_surface,
-                              string caption,int height,int &width,
+                              string caption, const MTSTextPlan &plan,
+                              int height, int &width,
                               int text_color, bool distract);
 
 
@@ -221,16 +461,243 @@ public:// --------------------- PUBLIC METHODS -------------------------------
         /* An MTSConfig instance to get parameters from. */
         MTSConfig* config;
 
-        /* Constructor */
-        MTS_TextHelper(shared_ptr<MTS_BaseHelper> h, shared_ptr<MTSConfig> c);
+        /*
+         * Constructor
+         *
+         * h - the base helper
+         * c - the config
+         * share - the text helper of another profile of the same
+         *         synthesizer (or NULL); its font map and captions are used
+         *         rather than loaded again when the settings are the same
+         */
+        MTS_TextHelper(shared_ptr<MTS_BaseHelper> h, shared_ptr<MTSConfig> c,
+                const MTS_TextHelper *share = NULL);
 
         /* Destructor */
         ~MTS_TextHelper();
 
+        /* Reseeds the engines of the distribution generators from helper */
+        void
+            reseed();
+
+        /*
+         * Re-reads the distribution parameters and font cost limits from
+         * config after it was reloaded; the engines carry on as they were
+         */
+        void
+            updateParams();
+
+        /*
+         * Makes epoch order draws take only positions shard, shard +
+         * shards, ..., and restarts the epochs. Exits if shard isn't
+         * less than shards.
+         *
+         * shard - this worker's number
+         * shards - the number of workers sharing the epochs
+         */
+        void
+            setEpochShard(uint32_t shard, uint32_t shards);
+
+        /*
+         * Makes epoch order draws return the given caption, without
+         * taking a position, until called again with -1; this redraws a
+         * recorded sample without moving the epochs on
+         *
+         * index - the caption number, or -1
+         */
+        void
+            replayCaption(int index);
+
+        /* The model charset captions must fit in (null if none is set) */
+        shared_ptr<MTS_Charset> charset;
+
+        /* Captions longer than this many bytes are dropped (0: no limit) */
+        size_t caption_max_bytes;
+
+        /* Index in the caption list of the last sample's caption (-1 if
+         * it was generated digits or the default caption,
+         * MTS_CAPTION_STREAMED if it came from the caption stream) */
+        int caption_index;
+
+        /* Index in the font list of the last rendered sample's main font */
+        int font_index;
+
         
         /*
-         * Provides the randomly rendered text 
+         * Returns a table of the fonts used so far, slowest first: samples,
+         * mean layout, raster and total ms, max ms, weight and name
+         */
+        string
+            fontCostReport();
+
+        /*
+         * Picks the caption of a sample (sets caption_index)
+         *
+         * caption - output, the string which will be rendered.
+         */
+        void
+            planCaption(string &caption);
+
+        /*
+         * Picks a caption of about the given length (sets caption_index).
+         * Digit captions keep their usual probability. In epoch order the
+         * caption is left as planned.
+         *
+         * caption - output, the string which will be rendered.
+         * length - the wanted length in characters
+         */
+        void
+            planCaptionNear(string &caption, double length);
+
+        /* Returns the number of captions, from lists and stores */
+        size_t
+            numCaptions() const;
+
+        /*
+         * Copies caption index out of the caption table
+         *
+         * index - which caption, less than numCaptions()
+         * caption - the output caption
+         */
+        void
+            captionAt(size_t index, string &caption) const;
+
+        /*
+         * Returns the number of characters in caption index
+         *
+         * index - which caption, less than numCaptions()
+         */
+        int
+            captionChars(size_t index) const;
+
+        /*
+         * Maps a caption store file and adds all of its captions, which
+         * are indexed in the mapping directly
+         *
+         * store_file - the store, as written by mts-captions
+         * weight - its weight, if the caption files are weighted
+         */
+        void
+            addCaptionStore(string store_file, double weight = 1);
+
+        /*
+         * Returns a key of a caption file (path, size and modification
+         * time) and of the charset and length filters, which changes
+         * whenever what the file holds after filtering may change
+         *
+         * caption_file - a text list or caption store
+         */
+        uint64_t
+            captionSourceKey(const string &caption_file);
+
+        /*
+         * Adds the captions of caption_file that pass the charset and
+         * length filters through the caption store at path. The first
+         * process to get there reads and filters the file into the store;
+         * the others, and later runs with the same file and filters, only
+         * map it.
+         *
+         * caption_file - a text list or caption store
+         * path - where the filtered store is kept
+         * weight - its weight, if the caption files are weighted
+         */
+        void
+            addFilteredStore(const string &caption_file, const string &path,
+                    double weight);
+
+        /*
+         * Adds the captions of the caption_files through caption stores
+         * in shared memory (/dev/shm/shm_name-<i> for the i-th file), with
+         * addFilteredStore. Caption stores among the files are mapped
+         * directly when there are no filters.
+         *
+         * caption_files - the files of the captions parameter
+         * weights - their weights
+         * shm_name - the prefix of the shared memory objects
+         */
+        void
+            addSharedCaptionlists(const vector<string> &caption_files,
+                    const vector<double> &weights, string shm_name);
+
+        /*
+         * Appends a caption segment of count captions (nothing if count
+         * is 0)
+         *
+         * store - index in the table's stores, -1 for its captions
+         * begin - start of the run in the table's captions
+         * count - the number of captions
+         * weight - its weight, if the caption files are weighted
+         */
+        void
+            addCaptionSegment(int store, size_t begin, size_t count,
+                    double weight);
+
+        /* Returns the segment caption number index falls in */
+        const MTS_CaptionSegment &
+            segmentOf(size_t index) const;
+
+        /* Draws a caption segment according to the weights */
+        size_t
+            pickSegment();
+
+        /* Draws a caption number, at random or in epoch order */
+        size_t
+            pickCaption();
+
+        /*
+         * Returns the caption of a draw in epoch order: position n*e+i
+         * gives entry i of epoch e's permutation of the n captions
+         *
+         * key - picks the permutations (caption_key_)
+         * position - the draw's place in the order all workers share
+         * n - the number of captions
+         * stream - which caption segment (0 when not weighted)
+         */
+        static size_t
+            epochIndex(uint64_t key, uint64_t position, size_t n,
+                    uint64_t stream);
+
+        /*
+         * A keyed bijection of [0, n): a four round Feistel network on
+         * the smallest even number of bits covering n, cycle-walked until
+         * the result falls below n. Needs no memory beyond the key.
+         *
+         * index - less than n
+         * n - the size of the domain
+         * key - picks the permutation
+         */
+        static uint64_t
+            permuteIndex(uint64_t index, uint64_t n, uint64_t key);
+
+        /* Returns the number of characters (not bytes) in utf-8 text */
+        static int
+            charCount(const string &text);
+
+        /*
+         * Returns the width planned text will have when rendered at the
+         * given height, by laying it out without drawing it. Exact for
+         * straight and rotated text, an estimate for curved text.
+         *
+         * plan - the text attributes
+         * caption - the string which will be rendered.
+         * height - height of the surface
+         */
+        int
+            measureText(const MTSTextPlan &plan, const string &caption,
+                        int height);
+
+        /*
+         * Picks the text attributes of a sample (font, transforms, ...)
+         *
+         * plan - output, the text attributes
+         */
+        void
+            planText(MTSTextPlan &plan);
+
+        /*
+         * Renders planned text
          *
+         * plan - the text attributes
          * caption - the string which will be rendered. 
          * text_surface - an out variable containing a 32FC3 matrix with the 
          *                rendered text including border and shadow.
@@ -240,7 +707,7 @@ public:// --------------------- PUBLIC METHODS -------------------------------
          * distract - flag that dictates whether distractor text will be present
          */
         void 
-            generateTextSample(string &caption,
+            generateTextSample(const MTSTextPlan &plan, const string &caption,
                                cairo_surface_t *&text_surface, int height,
                                int &width, int text_color, bool distract);
 
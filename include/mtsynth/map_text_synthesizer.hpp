@@ -1,10 +1,76 @@
 #ifndef MAP_TEXT_SYNTHESIZER_HPP
 #define MAP_TEXT_SYNTHESIZER_HPP
 
+#include <stdint.h>
 #include <string>
+#include <vector>
 #include <memory>
 #include <opencv2/core/mat.hpp> //cv::Mat
 
+/* caption_index of a caption taken from the caption stream, which can't
+ * be drawn again from a seed */
+#define MTS_CAPTION_STREAMED -2
+
+/*
+ * A compact description of one sample. Given the same config file, fonts
+ * and library build, MapTextSynthesizer::regenerate reproduces the sample
+ * bit for bit from seed alone; the other fields describe what was drawn
+ * (so recipes can be inspected or filtered without rendering) and are
+ * used to check that regeneration matched.
+ */
+struct MTSRecipe {
+        uint64_t seed;          // the sample's own seed
+        uint64_t counter;       // position in the synthesizer's recipe stream
+        int32_t caption_index;  // line in the caption list (-1: digits/default,
+                                // MTS_CAPTION_STREAMED: caption stream)
+        int32_t font_index;     // entry in the font list
+        uint32_t bg_features;   // bit i set if background feature i was drawn
+        uint16_t height;        // of the image
+        uint16_t width;
+};
+
+/*
+ * The text attributes of a plan. None of them depend on the image height,
+ * so a plan can be rendered at several sizes.
+ */
+struct MTSTextPlan {
+        int32_t font_index;     // entry in the font list
+        bool italic;
+        int32_t weight;         // 0 light, 1 normal, 2 bold
+        double rotated_angle;   // radians
+        bool curved;
+        double spacing_deg;     // letter spacing, in multiples of font size
+        double stretch_deg;     // horizontal stretch factor
+        int32_t x_pad;
+        int32_t y_pad;
+        double scale;
+};
+
+/*
+ * A scene description: every choice made for a sample before anything is
+ * drawn (see MapTextSynthesizer::plan). The positions and shapes within
+ * background features and distractor text are drawn while rendering,
+ * from seed.
+ */
+struct MTSPlan {
+        uint64_t seed;          // for the details drawn while rendering
+        std::string caption;
+        int32_t caption_index;  // line in the caption list (-1: digits/default,
+                                // MTS_CAPTION_STREAMED: caption stream)
+        MTSTextPlan text;
+        int32_t height;         // of the text area, in pixels
+        int32_t bg_brightness;
+        int32_t text_color;
+        std::vector<int32_t> bg_features;  // background features, in order
+        bool blend;             // blend the text with blend_alpha
+        double blend_alpha;
+        double noise_sigma;     // Gaussian noise
+        int32_t blur_kernel;    // Gaussian blur kernel size (odd)
+        int32_t jpeg_quality;   // 0 for no JPEG artifacts
+        int32_t profile;        // config profile that planned it (0 unless
+                                // created from several)
+};
+
 /*
  * Class that renders synthetic text images for training a CNN 
  * on word recognition in historical maps
@@ -22,6 +88,8 @@ class MapTextSynthesizer{
         /*
          * Generates a random bounded map-like text sample given a string
          * This is the principal function of the text synthesizer
+         * Samples are 8 bit grayscale (CV_8UC1) unless output_float is set
+         * in the config, in which case they are normalized CV_32FC1.
          *
          * caption - the label of the image. 
          * sample - the resulting text sample.
@@ -31,13 +99,188 @@ class MapTextSynthesizer{
             generateSample (std::string &caption, cv::Mat &sample, 
                     int &actual_height) = 0;
 
+        /*
+         * Makes every random choice for the next sample without drawing
+         * anything (cheap). generateSample is plan followed by render.
+         *
+         * plan - the output scene description
+         */
+        virtual void
+            plan (MTSPlan &plan) = 0;
+
+        /*
+         * Like plan, but steers caption choice and stretch so that the
+         * rendered width lands in [min_width, max_width]. Lays the text
+         * out a few times without drawing it; when no tried plan fits,
+         * the closest one is returned.
+         *
+         * plan - the output scene description
+         * min_width - the smallest wanted width in pixels
+         * max_width - the largest wanted width in pixels
+         */
+        virtual void
+            plan (MTSPlan &plan, int min_width, int max_width) = 0;
+
+        /*
+         * Generates a sample whose width is in [min_width, max_width],
+         * for filling a width bucket without padding (see plan)
+         *
+         * caption - the label of the image.
+         * sample - the resulting text sample.
+         * actual_height - the actual height of sample.
+         * min_width - the smallest wanted width in pixels
+         * max_width - the largest wanted width in pixels
+         */
+        virtual void
+            generateSample (std::string &caption, cv::Mat &sample,
+                    int &actual_height, int min_width, int max_width) = 0;
+
+        /*
+         * Draws a planned sample (the expensive part). The same plan
+         * always renders to the same image; its fields may be edited
+         * first, e.g. height to render it at another size. plan and render
+         * share generators, so an instance must not run both at once;
+         * use one instance per thread instead.
+         *
+         * plan - a plan from plan()
+         * caption - the label of the image.
+         * sample - the resulting text sample.
+         * actual_height - the actual height of sample.
+         */
+        virtual void
+            render (const MTSPlan &plan, std::string &caption,
+                    cv::Mat &sample, int &actual_height) = 0;
+
+        /*
+         * Turns a caption into the label indices of the model charset
+         * named by the config's charset parameter. Returns false if no
+         * charset is set or a character is missing from it (which can't
+         * happen for captions of this synthesizer, as those are filtered
+         * when the caption lists load).
+         *
+         * caption - a caption from generateSample
+         * label - output, one class index per character
+         */
+        virtual bool
+            encodeCaption (const std::string &caption,
+                    std::vector<int32_t> &label) = 0;
+
+        /*
+         * Returns a report of the time spent rendering text in each font
+         * used so far, slowest first (tab separated, one font per line)
+         */
+        virtual std::string
+            fontCostReport () = 0;
+
+        /*
+         * Generates a sample like generateSample, and also describes it
+         * in recipe. Each such sample is drawn from its own seed, derived
+         * from the synthesizer's seed and a counter, and never replayed
+         * from a replay store.
+         *
+         * caption - the label of the image.
+         * sample - the resulting text sample.
+         * actual_height - the actual height of sample.
+         * recipe - output description of the sample
+         */
+        virtual void
+            generateSample (std::string &caption, cv::Mat &sample,
+                    int &actual_height, MTSRecipe &recipe) = 0;
+
+        /*
+         * Re-renders the sample described by recipe. Returns false if the
+         * result doesn't match the recipe (i.e. the config, caption or
+         * font files differ from when the recipe was made), or if its
+         * caption came from the caption stream.
+         *
+         * recipe - a recipe from generateSample
+         * caption - the label of the image.
+         * sample - the resulting text sample.
+         * actual_height - the actual height of sample.
+         */
+        virtual bool
+            regenerate (const MTSRecipe &recipe, std::string &caption,
+                    cv::Mat &sample, int &actual_height) = 0;
+
+        /*
+         * Reseeds every random number generator the synthesizer draws from,
+         * so that copies of one instance (e.g. in forked processes) produce
+         * different streams without being rebuilt.
+         *
+         * seed - the new seed (must not be 0)
+         */
+        virtual void
+            setSeed(uint64_t seed) = 0;
+
+        /*
+         * Splits the epoch order (caption_order = epoch) between workers
+         * that draw from copies of one config: every worker walks the same
+         * permutations (keyed by the config's seed, not by setSeed), and
+         * this one only takes positions shard, shard + shards, ..., so
+         * that together they draw each caption once per epoch. Restarts
+         * the epochs. Without it a synthesizer takes every position.
+         *
+         * shard - this worker's number, less than shards
+         * shards - the number of workers
+         */
+        virtual void
+            setEpochShard(uint32_t shard, uint32_t shards) = 0;
+
+        /*
+         * Changes the share of samples drawn from each config profile of
+         * a synthesizer created from several (they need not sum to 1).
+         * Returns false, changing nothing, if the number of weights isn't
+         * the number of profiles, one is negative or all are 0. Recipes
+         * only regenerate under the weights they were made with.
+         *
+         * weights - one weight per profile, in creation order
+         */
+        virtual bool
+            setProfileWeights(const std::vector<double> &weights) = 0;
+
+        /*
+         * Swaps in the parameters of a config file (usually the edited
+         * one the synthesizer was created from) for the samples that
+         * follow, keeping the loaded fonts and captions and the random
+         * number generators' state. Returns false, changing nothing, if
+         * the file can't be read, lacks a parameter of the current
+         * config, has invalid distribution parameters or changes one of
+         * the parameters that shaped what was loaded (fonts, captions,
+         * charset, seed, replay store, width buckets, output format).
+         * For a synthesizer created with profiles, the profiles listed in
+         * the file are reloaded in order and their weights updated. With
+         * config_reload_s set, the synthesizer also checks its config
+         * file that often and reloads it when it changes; a synthesizer
+         * created with profiles checks that file and every profile file,
+         * and reloads them all when any of them changes.
+         *
+         * config_file - the config file
+         */
+        virtual bool
+            reloadConfig(const std::string &config_file) = 0;
+
         /*
          * A wrapper for the protected MapTextSynthesizer constructor.
-         * Use this method to create a MTS object.
+         * Use this method to create a MTS object. If the config file has
+         * a profiles parameter ("a.txt: 0.5, b.txt: 0.5"), the synthesizer
+         * mixes those config files as below.
          */
         static cv::Ptr<MapTextSynthesizer> 
             create(std::string config_file);
 
+        /*
+         * Creates a synthesizer that picks one of several config profiles
+         * for every sample. Profiles with the same fonts share one font
+         * map, and those with the same caption settings share the loaded
+         * captions, with the first profile.
+         *
+         * config_files - one config file per profile
+         * weights - the share of samples of each profile
+         */
+        static cv::Ptr<MapTextSynthesizer>
+            create(const std::vector<std::string> &config_files,
+                    const std::vector<double> &weights);
+
         /*
          * The destructor for the MapTextSynthesizer class 
          */ 
@@ -0,0 +1,68 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Converts caption list files into a memory-mapped caption store.           *
+ *                                                                            *
+ * This program is free software: you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * **/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// private header of the synthesizer library, for the store format
+#include "mts_captionstore.hpp"
+
+using namespace std;
+
+/*
+ * Reads caption list files (one caption per line, as the captions
+ * parameter takes them) and writes them, in order, to one caption store.
+ * The store can then be named in the captions parameter in place of the
+ * lists; it is mapped instead of read, so it loads in constant time and
+ * is shared between synthesizer processes.
+ *
+ * Example usage :
+ * ./mts-captions iowa.mtsc IA/Cities.txt IA/Counties.txt
+ */
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        cerr << "usage: mts-captions store_file caption_file..." << endl;
+        return 1;
+    }
+    string store_file = argv[1];
+
+    vector<string> captions;
+    for (int i = 2; i < argc; i++) {
+        ifstream infile(argv[i]);
+        if (!infile.is_open()) {
+            cerr << "Could not open " << argv[i] << endl;
+            return 1;
+        }
+        string line;
+        while (getline(infile, line)) {
+            captions.push_back(line);
+        }
+    }
+
+    int64_t distinct = MTS_CaptionStore::build(store_file, captions);
+    if (distinct < 0) {
+        cerr << "Could not write " << store_file << endl;
+        return 1;
+    }
+
+    MTS_CaptionStore store(store_file);
+    cout << store_file << ": " << store.size() << " captions, " << distinct
+        << " distinct, " << store.textSize() << " bytes of text" << endl;
+    return 0;
+}
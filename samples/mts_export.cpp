@@ -0,0 +1,446 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Exports a fixed dataset from the MapTextSynthesizer as sharded files.      *
+ *                                                                            *
+ * This program is free software: you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * **/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <opencv2/core/mat.hpp>
+#include <opencv2/imgcodecs.hpp> // for imencode
+
+// header to include for using the synthesizer
+#include "mtsynth/map_text_synthesizer.hpp"
+
+using namespace std;
+using namespace cv;
+
+#define DEFAULT_SHARD_SIZE 10000
+#define DEFAULT_SEED 1
+
+// Trailer of a raw shard (see write_raw_trailer)
+#define RAW_MAGIC "MTSRAW01"
+
+// Header of a recipe shard, followed by MTSRecipe structs
+#define RECIPE_MAGIC "MTSRCP01"
+
+enum Format { TFRECORD, RAW, RECIPE };
+
+const char *extensions[] = { "tfrecord", "raw", "mtsr" };
+
+/*
+ * CRC-32C (Castagnoli), as used for TFRecord framing.
+ */
+uint32_t crc32c(const char* data, size_t len) {
+    static uint32_t table[256];
+    static bool ready = false;
+    if (!ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0x82F63B78 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        ready = true;
+    }
+
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+/* The CRC as stored in a TFRecord */
+uint32_t masked_crc(const char* data, size_t len) {
+    uint32_t crc = crc32c(data, len);
+    return ((crc >> 15) | (crc << 17)) + 0xA282EAD8;
+}
+
+/*
+ * Minimal protobuf encoding, just enough for a tf.train.Example.
+ */
+void put_varint(string &out, uint64_t v) {
+    while (v >= 0x80) {
+        out += (char)((v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    out += (char)v;
+}
+
+/* A length-delimited field (wire type 2) */
+void put_bytes(string &out, int field, const string &bytes) {
+    put_varint(out, (field << 3) | 2);
+    put_varint(out, bytes.size());
+    out += bytes;
+}
+
+/* Feature { bytes_list: BytesList { value: bytes } } */
+string bytes_feature(const string &bytes) {
+    string list, feature;
+    put_bytes(list, 1, bytes);
+    put_bytes(feature, 1, list);
+    return feature;
+}
+
+/* Feature { int64_list: Int64List { value: [v] } } (packed) */
+string int64_feature(int64_t v) {
+    string packed, list, feature;
+    put_varint(packed, (uint64_t)v);
+    put_bytes(list, 1, packed);
+    put_bytes(feature, 3, list);
+    return feature;
+}
+
+/* One entry of Features.feature (a map<string, Feature>) */
+void put_feature(string &features, const string &key, const string &feature) {
+    string entry;
+    put_bytes(entry, 1, key);
+    put_bytes(entry, 2, feature);
+    put_bytes(features, 1, entry);
+}
+
+/* Example { features: { image/encoded, text, width } } */
+string make_example(const vector<uchar> &png, const string &caption,
+        int width) {
+    string features, example;
+    put_feature(features, "image/encoded",
+            bytes_feature(string(png.begin(), png.end())));
+    put_feature(features, "text", bytes_feature(caption));
+    put_feature(features, "width", int64_feature(width));
+    put_bytes(example, 1, features);
+    return example;
+}
+
+/* Append one TFRecord (length, crc, data, crc) */
+void write_tfrecord(ofstream &out, const string &data) {
+    uint64_t len = data.size();
+    uint32_t len_crc = masked_crc((const char*)&len, sizeof(len));
+    uint32_t data_crc = masked_crc(data.data(), data.size());
+    out.write((const char*)&len, sizeof(len));
+    out.write((const char*)&len_crc, sizeof(len_crc));
+    out.write(data.data(), data.size());
+    out.write((const char*)&data_crc, sizeof(data_crc));
+}
+
+/*
+ * Raw shard record: uint32 height, uint32 width, uint32 caption length,
+ * caption bytes, then height*width grayscale pixels (row major).
+ */
+void write_raw_record(ofstream &out, const Mat &image,
+        const string &caption) {
+    uint32_t header[3] = { (uint32_t)image.rows, (uint32_t)image.cols,
+        (uint32_t)caption.size() };
+    out.write((const char*)header, sizeof(header));
+    out.write(caption.data(), caption.size());
+    for (int row = 0; row < image.rows; row++) {
+        out.write((const char*)image.ptr<uchar>(row), image.cols);
+    }
+}
+
+/*
+ * Raw shard trailer: uint64 offset of every record, uint64 record count,
+ * then the 8 byte RAW_MAGIC. Readers seek to the last 16 bytes.
+ */
+void write_raw_trailer(ofstream &out, const vector<uint64_t> &offsets) {
+    uint64_t count = offsets.size();
+    out.write((const char*)offsets.data(), count * sizeof(uint64_t));
+    out.write((const char*)&count, sizeof(count));
+    out.write(RAW_MAGIC, 8);
+}
+
+/*
+ * Deterministic name of a shard: the seed and the total shard count are
+ * part of it, so exports with different settings never mix.
+ */
+string shard_name(const string &dir, uint64_t seed, long shard,
+        long num_shards, Format format) {
+    char name[128];
+    snprintf(name, sizeof(name), "mts-%016llx-%05ld-of-%05ld.%s",
+            (unsigned long long)seed, shard, num_shards, extensions[format]);
+    return dir + "/" + name;
+}
+
+/* Every shard is synthesized from its own seed, so a shard's contents
+ * don't depend on which worker makes it or on what was exported before */
+uint64_t shard_seed(uint64_t seed, long shard) {
+    uint64_t z = seed + (uint64_t)(shard + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return z ? z : 1;
+}
+
+/* Reads the recipes of a recipe shard */
+vector<MTSRecipe> read_recipes(const string &path) {
+    ifstream in(path.c_str(), ios::binary);
+    char magic[8];
+    if (!in.read(magic, 8) || memcmp(magic, RECIPE_MAGIC, 8) != 0) {
+        cerr << path << " is not a recipe shard" << endl;
+        exit(1);
+    }
+    vector<MTSRecipe> recipes;
+    MTSRecipe recipe;
+    while (in.read((char*)&recipe, sizeof(recipe))) {
+        recipes.push_back(recipe);
+    }
+    return recipes;
+}
+
+/*
+ * Writes one shard to a temporary file and renames it into place once it
+ * is complete, so a finished shard name always means a finished shard.
+ * The samples are count fresh ones drawn from seed, taking shard's turns
+ * of num_shards through the caption epochs, or, if recipes is given, the
+ * samples it describes (re-rendered).
+ */
+void export_shard(Ptr<MapTextSynthesizer> mts, const string &path,
+        long shard, long num_shards, uint64_t seed, long count, Format format,
+        const vector<MTSRecipe> *recipes = NULL) {
+    string tmp = path + ".tmp";
+    ofstream out(tmp.c_str(), ios::binary | ios::trunc);
+    if (!out) {
+        cerr << "Could not open " << tmp << endl;
+        exit(1);
+    }
+
+    // both restart for every shard, so a shard doesn't depend on what its
+    // worker exported before, and in epoch order the shards draw disjoint
+    // positions of the same epochs
+    mts->setSeed(seed);
+    mts->setEpochShard((uint32_t)shard, (uint32_t)num_shards);
+
+    string label;
+    Mat image;
+    int height;
+    MTSRecipe recipe;
+    vector<uchar> png;
+    vector<uint64_t> offsets;
+    long mismatched = 0;
+
+    if (recipes) {
+        count = recipes->size();
+    }
+    if (format == RECIPE) {
+        out.write(RECIPE_MAGIC, 8);
+    }
+
+    for (long k = 0; k < count; k++) {
+        if (recipes) {
+            if (!mts->regenerate((*recipes)[k], label, image, height)) {
+                mismatched++;
+            }
+        } else if (format == RECIPE) {
+            mts->generateSample(label, image, height, recipe);
+        } else {
+            mts->generateSample(label, image, height);
+        }
+        if (image.type() != CV_8UC1) {
+            cerr << "Exports need 8 bit samples (unset output_float)" << endl;
+            exit(1);
+        }
+
+        if (format == TFRECORD) {
+            if (!imencode(".png", image, png)) {
+                cerr << "Could not encode sample as PNG" << endl;
+                exit(1);
+            }
+            write_tfrecord(out, make_example(png, label, image.cols));
+        } else if (format == RAW) {
+            offsets.push_back(out.tellp());
+            write_raw_record(out, image, label);
+        } else {
+            out.write((const char*)&recipe, sizeof(recipe));
+        }
+    }
+    if (format == RAW) {
+        write_raw_trailer(out, offsets);
+    }
+
+    out.close();
+    if (out.fail()) {
+        cerr << "Failed writing " << tmp << endl;
+        exit(1);
+    }
+    if (mismatched) {
+        // Leave the .tmp for inspection, but don't pass it off as good
+        cerr << mismatched << " of " << count << " samples in " << path
+             << " did not match their recipes (different config, captions "
+             << "or fonts?)" << endl;
+        exit(1);
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        perror("rename");
+        exit(1);
+    }
+}
+
+/* Does the file exist? (finished shards are skipped when resuming) */
+bool exists(const string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+void usage() {
+    cerr << "usage: mts-export [-f tfrecord|raw|recipe] [-j jobs] "
+         << "[-n shard_size] [-s seed] [-c config_file] num_samples out_dir"
+         << endl
+         << "       mts-export -R recipe_shard [-f tfrecord|raw] "
+         << "[-c config_file] out_dir" << endl;
+    exit(1);
+}
+
+/* Rasterizes a recipe shard into a shard of the same name and format */
+int rasterize(const string &recipe_path, const string &out_dir,
+        const string &config_file, Format format) {
+    vector<MTSRecipe> recipes = read_recipes(recipe_path);
+
+    string name = recipe_path.substr(recipe_path.rfind('/') + 1);
+    name = name.substr(0, name.rfind('.') + 1) + extensions[format];
+    string path = out_dir + "/" + name;
+
+    auto mts = MapTextSynthesizer::create(config_file);
+    export_shard(mts, path, 0, 1, DEFAULT_SEED, 0, format, &recipes);
+    cout << path << endl;
+    return 0;
+}
+
+/*
+ * Generates num_samples samples into shards of shard_size samples each
+ * (the last one may be smaller), using one process per job. Shards that
+ * already exist are skipped, so an interrupted export is continued by
+ * running the same command again.
+ *
+ * Example usage :
+ * ./mts-export 1000000 out/                 (100 TFRecord shards)
+ * ./mts-export -f raw -j 8 -s 42 5000000 out/
+ * ./mts-export -f recipe 100000000 recipes/  (32 bytes per sample)
+ * ./mts-export -R recipes/mts-0000000000000001-00042-of-10000.mtsr out/
+ */
+int main(int argc, char **argv) {
+    Format format = TFRECORD;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    long shard_size = DEFAULT_SHARD_SIZE;
+    uint64_t seed = DEFAULT_SEED;
+    string config_file = "config.txt";
+    string recipe_path;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:j:n:s:c:R:")) != -1) {
+        switch (opt) {
+            case 'f':
+                if (string(optarg) == "tfrecord") format = TFRECORD;
+                else if (string(optarg) == "raw") format = RAW;
+                else if (string(optarg) == "recipe") format = RECIPE;
+                else usage();
+                break;
+            case 'R': recipe_path = optarg; break;
+            case 'j': jobs = atol(optarg); break;
+            case 'n': shard_size = atol(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 0); break;
+            case 'c': config_file = optarg; break;
+            default: usage();
+        }
+    }
+    if (!recipe_path.empty()) {
+        if (argc - optind != 1 || format == RECIPE) {
+            usage();
+        }
+        if (mkdir(argv[optind], 0755) != 0 && !exists(argv[optind])) {
+            perror("mkdir");
+            exit(1);
+        }
+        return rasterize(recipe_path, argv[optind], config_file, format);
+    }
+    if (argc - optind != 2 || jobs < 1 || shard_size < 1) {
+        usage();
+    }
+    long num_samples = atol(argv[optind]);
+    string out_dir = argv[optind + 1];
+    if (num_samples < 1) {
+        usage();
+    }
+
+    if (mkdir(out_dir.c_str(), 0755) != 0 && !exists(out_dir)) {
+        perror("mkdir");
+        exit(1);
+    }
+
+    long num_shards = (num_samples + shard_size - 1) / shard_size;
+    vector<long> todo;
+    for (long s = 0; s < num_shards; s++) {
+        if (!exists(shard_name(out_dir, seed, s, num_shards, format))) {
+            todo.push_back(s);
+        }
+    }
+    cout << num_shards - (long)todo.size() << " of " << num_shards
+         << " shards already done" << endl;
+    if (todo.empty()) {
+        return 0;
+    }
+    if (jobs > (long)todo.size()) {
+        jobs = todo.size();
+    }
+
+    int start = time(NULL);
+
+    // Each worker builds its own synthesizer and takes every jobs'th shard
+    for (long w = 0; w < jobs; w++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            auto mts = MapTextSynthesizer::create(config_file);
+            for (size_t i = w; i < todo.size(); i += jobs) {
+                long s = todo[i];
+                long count = s == num_shards - 1 ?
+                    num_samples - s * shard_size : shard_size;
+                string path = shard_name(out_dir, seed, s, num_shards, format);
+                export_shard(mts, path, s, num_shards, shard_seed(seed, s),
+                        count, format);
+                cout << path << endl;
+            }
+            exit(0);
+        }
+    }
+
+    int failed = 0, status;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed++;
+        }
+    }
+    if (failed) {
+        cerr << failed << " worker(s) failed; run again to resume" << endl;
+        return 1;
+    }
+
+    int end = time(NULL);
+    cout << "Exported " << todo.size() << " shards in " << end - start
+         << " seconds" << endl;
+    return 0;
+}
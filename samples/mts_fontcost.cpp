@@ -0,0 +1,61 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Profiles how long the MapTextSynthesizer takes to render text per font.    *
+ *                                                                            *
+ * This program is free software: you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * **/
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <opencv2/core/mat.hpp>
+
+// header to include for using the synthesizer
+#include "mtsynth/map_text_synthesizer.hpp"
+
+using namespace std;
+using namespace cv;
+
+#define DEFAULT_SAMPLES 20000
+
+/*
+ * Generates samples and prints the per-font render cost report, slowest
+ * font first. Fonts at the top are candidates for a lower weight in the
+ * font list files ("Family Name: 0.2") or for the font_max_ms cap.
+ *
+ * Example usage :
+ * ./mts-fontcost                   (20000 samples using config.txt)
+ * ./mts-fontcost 100000 config.txt > fontcost.tsv
+ */
+int main(int argc, char **argv) {
+    long samples = argc > 1 ? atol(argv[1]) : DEFAULT_SAMPLES;
+    string config_file = argc > 2 ? argv[2] : "config.txt";
+
+    if (argc > 3 || samples <= 0) {
+        cerr << "usage: mts-fontcost [samples [config_file]]" << endl;
+        return 1;
+    }
+
+    auto mts = MapTextSynthesizer::create(config_file);
+
+    string label;
+    Mat image;
+    int height;
+
+    for (long k = 0; k < samples; k++) {
+        mts->generateSample(label, image, height);
+    }
+
+    cout << mts->fontCostReport();
+    return 0;
+}
@@ -0,0 +1,161 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Checks the tabulated beta and gamma samplers against the exact ones.       *
+ *                                                                            *
+ * This program is free software: you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * **/
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+#include <ctime>
+#include <algorithm>
+
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/variate_generator.hpp>
+#include <boost/math/distributions/beta.hpp>
+#include <boost/math/distributions/gamma.hpp>
+
+// private headers of the synthesizer library, for the samplers it uses
+#include "mts_config.hpp"
+#include "mts_quantiletable.hpp"
+
+using namespace std;
+using boost::random::mt19937;
+using boost::random::variate_generator;
+
+#define DEFAULT_DRAWS 1000000
+
+// Kolmogorov-Smirnov critical value at the 0.1% level is this over sqrt(n)
+#define KS_CRITICAL 1.95
+
+/* Monotonic time in seconds */
+double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Largest distance between the empirical CDF of draws and the exact CDF */
+template<class Dist>
+double ks_distance(vector<double> &draws, const Dist &exact) {
+    sort(draws.begin(), draws.end());
+    double n = draws.size();
+    double distance = 0;
+    for (size_t i = 0; i < draws.size(); i++) {
+        double c = cdf(exact, draws[i]);
+        distance = max(distance, max(fabs(c - i / n), fabs((i + 1) / n - c)));
+    }
+    return distance;
+}
+
+/*
+ * Draws n values from the table and n from the exact generator of one
+ * distribution, prints the time per draw and the KS distance of each to
+ * the exact CDF, and returns false if the table's distance is over the
+ * critical value.
+ */
+template<class RandomDist, class MathDist>
+bool check(const string &name, const RandomDist &dist, const MathDist &exact,
+        size_t n) {
+    MTS_QuantileTable table;
+    double start = now_s();
+    table.build(dist);
+    double build_ms = (now_s() - start) * 1000;
+
+    variate_generator<mt19937, RandomDist> table_gen(mt19937(1), dist);
+    variate_generator<mt19937, RandomDist> exact_gen(mt19937(2), dist);
+    vector<double> table_draws(n), exact_draws(n);
+
+    start = now_s();
+    for (size_t i = 0; i < n; i++) {
+        table_draws[i] = table.draw(table_gen);
+    }
+    double table_ns = (now_s() - start) * 1e9 / n;
+
+    start = now_s();
+    for (size_t i = 0; i < n; i++) {
+        exact_draws[i] = exact_gen();
+    }
+    double exact_ns = (now_s() - start) * 1e9 / n;
+
+    double table_ks = ks_distance(table_draws, exact);
+    double exact_ks = ks_distance(exact_draws, exact);
+    double critical = KS_CRITICAL / sqrt((double)n);
+    bool ok = table_ks <= critical;
+
+    cout << left << setw(14) << name << right << fixed
+        << setprecision(1) << setw(8) << build_ms << " ms"
+        << setw(8) << table_ns << " ns" << setw(8) << exact_ns << " ns"
+        << setprecision(5) << setw(10) << table_ks << setw(10) << exact_ks
+        << (ok ? "" : "  FAILED") << endl;
+    return ok;
+}
+
+/*
+ * Builds the quantile tables of the beta and gamma distributions a config
+ * file sets up (sampler_tables = 1), and compares each against the exact
+ * boost generator it replaces: time per draw, and the Kolmogorov-Smirnov
+ * distance of a large number of draws to the exact CDF. Exits with status
+ * 1 if a table's draws don't pass the KS test at the 0.1% level.
+ *
+ * Example usage :
+ * ./mts-samplers [config_file [draws]]
+ */
+int main(int argc, char **argv) {
+    string config_file = argc > 1 ? argv[1] : "config.txt";
+    size_t n = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_DRAWS;
+    if (n == 0) {
+        cerr << "usage: mts-samplers [config_file [draws]]" << endl;
+        return 1;
+    }
+
+    MTSConfig config;
+    if (!config.read(config_file)) {
+        return 1;
+    }
+
+    cout << n << " draws each; KS critical value "
+        << KS_CRITICAL / sqrt((double)n) << endl;
+    cout << left << setw(14) << "sampler" << right << setw(11) << "build"
+        << setw(11) << "table" << setw(11) << "exact" << setw(10)
+        << "KS table" << setw(10) << "KS exact" << endl;
+
+    const char *beta_params[] = { "spacing", "stretch", "texture_width" };
+    const char *gamma_params[] = { "digit_len", "bias_std", "noise_sigma" };
+
+    bool ok = true;
+    for (size_t i = 0; i < 3; i++) {
+        string name = beta_params[i];
+        double a = config.getParamDouble(name + "_alpha");
+        double b = config.getParamDouble(name + "_beta");
+        ok = check(name, boost::random::beta_distribution<>(a, b),
+                boost::math::beta_distribution<>(a, b), n) && ok;
+    }
+    for (size_t i = 0; i < 3; i++) {
+        string name = gamma_params[i];
+        double a = config.getParamDouble(name + "_alpha");
+        double b = config.getParamDouble(name + "_beta");
+        ok = check(name, boost::random::gamma_distribution<>(a, b),
+                boost::math::gamma_distribution<>(a, b), n) && ok;
+    }
+
+    if (!ok) {
+        cerr << "A sampler table doesn't match its distribution!" << endl;
+        return 1;
+    }
+    return 0;
+}
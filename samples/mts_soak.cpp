@@ -0,0 +1,108 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * A soak test that checks the MapTextSynthesizer does not leak memory.       *
+ *                                                                            *
+ * This program is free software: you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * **/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+#include <opencv2/core/mat.hpp>
+
+// header to include for using the synthesizer
+#include "mtsynth/map_text_synthesizer.hpp"
+
+using namespace std;
+using namespace cv;
+
+#define DEFAULT_ROUNDS 2000000
+
+// Samples generated before the baseline RSS is taken (font and glyph
+// caches, pixman/cairo pools etc. are allowed to fill up in this time)
+#define WARMUP_ROUNDS 50000
+
+// How often RSS is sampled
+#define CHECK_EVERY 10000
+
+// Default allowed growth over the baseline, in MB
+#define DEFAULT_TOLERANCE_MB 32
+
+/* Resident set size of this process in MB (from /proc/self/statm) */
+double rss_mb() {
+    ifstream statm("/proc/self/statm");
+    long pages_total, pages_resident;
+    if (!(statm >> pages_total >> pages_resident)) {
+        cerr << "Could not read /proc/self/statm" << endl;
+        exit(1);
+    }
+    return pages_resident * (double)sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+/*
+ * Generates a large number of samples and checks that the resident memory
+ * stays flat after a warmup period. Exits with status 1 if RSS grows by
+ * more than the tolerance at any check.
+ *
+ * Example usage :
+ * ./mts_soak                       (2M samples using config.txt)
+ * ./mts_soak 5000000 config.txt 16
+ */
+int main(int argc, char **argv) {
+    long rounds = argc > 1 ? atol(argv[1]) : DEFAULT_ROUNDS;
+    string config_file = argc > 2 ? argv[2] : "config.txt";
+    double tolerance = argc > 3 ? atof(argv[3]) : DEFAULT_TOLERANCE_MB;
+
+    if (argc > 4 || rounds <= WARMUP_ROUNDS || tolerance <= 0) {
+        cerr << "usage: mts_soak [rounds (> " << WARMUP_ROUNDS << ") "
+             << "[config_file [tolerance_mb]]]" << endl;
+        return 1;
+    }
+
+    auto mts = MapTextSynthesizer::create(config_file);
+
+    string label;
+    Mat image;
+    int height;
+    double baseline = 0, peak = 0;
+    int start = time(NULL);
+
+    cout << "samples\trss_mb\tgrowth_mb" << endl;
+    for (long k = 1; k <= rounds; k++) {
+        mts->generateSample(label, image, height);
+
+        if (k == WARMUP_ROUNDS) {
+            baseline = peak = rss_mb();
+            cout << k << "\t" << baseline << "\t(baseline)" << endl;
+        } else if (k > WARMUP_ROUNDS && k % CHECK_EVERY == 0) {
+            double rss = rss_mb();
+            if (rss > peak) peak = rss;
+            cout << k << "\t" << rss << "\t" << rss - baseline << endl;
+
+            if (rss - baseline > tolerance) {
+                cerr << "FAILED: RSS grew by " << rss - baseline
+                     << " MB after " << k << " samples (tolerance "
+                     << tolerance << " MB)" << endl;
+                return 1;
+            }
+        }
+    }
+
+    int end = time(NULL);
+    cout << "PASSED: " << rounds << " samples in " << end - start
+         << " seconds, peak growth " << peak - baseline << " MB" << endl;
+    return 0;
+}
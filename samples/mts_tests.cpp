@@ -0,0 +1,352 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Checks of the parts of the synthesizer library that need no fonts.        *
+ *                                                                            *
+ * This program is free software: you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * **/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <iterator>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <boost/math/distributions/beta.hpp>
+#include <boost/math/distributions/gamma.hpp>
+
+// private headers of the synthesizer library, for the parts under test
+#include "mts_charset.hpp"
+#include "mts_captionstore.hpp"
+#include "mts_texthelper.hpp"
+#include "mts_mixture.hpp"
+#include "mts_quantiletable.hpp"
+
+using namespace std;
+
+int g_failures = 0;
+
+// Counts and reports a failed check, and carries on
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        cerr << __FILE__ << ":" << __LINE__ << ": FAILED: " #cond << endl; \
+        g_failures++; \
+    } \
+} while (0)
+
+/* Writes contents to a new temporary file and returns its path */
+string temp_file(const string &contents) {
+    char path[] = "/tmp/mts-tests-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        cerr << "Could not create a temporary file" << endl;
+        exit(1);
+    }
+    close(fd);
+    ofstream out(path, ios::binary);
+    out << contents;
+    return path;
+}
+
+/* MTS_Charset: utf-8 decoding and class numbering */
+void test_charset() {
+    // a, b, c, e acute, euro sign, and a four byte emoji
+    string path = temp_file("ab\nc\xC3\xA9\xE2\x82\xAC\r\n\xF0\x9F\x98\x80");
+    MTS_Charset charset(path);
+    unlink(path.c_str());
+
+    CHECK(charset.size() == 6);
+
+    vector<int32_t> label;
+    CHECK(charset.encode("ab\xC3\xA9", label));
+    CHECK(label.size() == 3 && label[0] == 0 && label[1] == 1
+            && label[2] == 3);
+    CHECK(charset.encode("\xF0\x9F\x98\x80\xE2\x82\xAC", label));
+    CHECK(label.size() == 2 && label[0] == 5 && label[1] == 4);
+    CHECK(charset.encode("", label) && label.empty());
+
+    // stops at the first character it lacks
+    CHECK(!charset.encode("cax", label));
+    CHECK(label.size() == 2 && label[0] == 2 && label[1] == 0);
+
+    // line breaks aren't classes, and malformed text never encodes
+    CHECK(!charset.covers("a\nb"));
+    CHECK(!charset.covers("\xC3"));
+    CHECK(!charset.covers("\xE2\x82"));
+    CHECK(!charset.covers("\xA9"));
+    CHECK(charset.covers("cab"));
+
+    // decode moves past exactly one code point
+    string text = "a\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80";
+    size_t pos = 0;
+    CHECK(MTS_Charset::decode(text, pos) == 'a' && pos == 1);
+    CHECK(MTS_Charset::decode(text, pos) == 0xE9 && pos == 3);
+    CHECK(MTS_Charset::decode(text, pos) == 0x20AC && pos == 6);
+    CHECK(MTS_Charset::decode(text, pos) == 0x1F600 && pos == 10);
+}
+
+/* Whether mapping path as a caption store makes the process exit */
+bool store_refused(const string &path) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        // the child's complaint is expected, keep it out of the output
+        freopen("/dev/null", "w", stderr);
+        MTS_CaptionStore store(path);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) != 0;
+}
+
+/* MTS_CaptionStore: build, map and read back, and refuse corrupt files */
+void test_caption_store() {
+    vector<string> captions;
+    captions.push_back("Ames");
+    captions.push_back("Des Moines");
+    captions.push_back("Ames");
+    captions.push_back("");
+    captions.push_back("Caf\xC3\xA9");
+
+    string path = temp_file("");
+    CHECK(MTS_CaptionStore::build(path, captions, 42) == 4);
+    CHECK(MTS_CaptionStore::isStore(path));
+
+    {
+        MTS_CaptionStore store(path);
+        CHECK(store.size() == captions.size());
+        CHECK(store.key() == 42);
+        // duplicates are stored once
+        CHECK(store.textSize() == strlen("AmesDes MoinesCaf\xC3\xA9"));
+        for (size_t i = 0; i < captions.size(); i++) {
+            uint32_t length;
+            const char *text = store.get(i, length);
+            CHECK(string(text, length) == captions[i]);
+        }
+        CHECK(store.charCount(1) == 10);
+        CHECK(store.charCount(3) == 0);
+        CHECK(store.charCount(4) == 4);
+    }
+
+    // a text list isn't a store
+    string list = temp_file("Ames\nDes Moines\n");
+    CHECK(!MTS_CaptionStore::isStore(list));
+    CHECK(store_refused(list));
+    unlink(list.c_str());
+
+    std::ifstream in(path.c_str(), ios::binary);
+    string bytes((std::istreambuf_iterator<char>(in)),
+            std::istreambuf_iterator<char>());
+    MTS_CaptionHeader header;
+    memcpy(&header, bytes.data(), sizeof(header));
+
+    // cut short
+    string cut = temp_file(bytes.substr(0, bytes.size() - 1));
+    CHECK(store_refused(cut));
+    unlink(cut.c_str());
+
+    // a count too large for the file, even if the sizes overflow
+    string huge = bytes;
+    MTS_CaptionHeader *bad = (MTS_CaptionHeader *)&huge[0];
+    bad->count = (uint64_t)1 << 61;
+    string huge_file = temp_file(huge);
+    CHECK(store_refused(huge_file));
+    unlink(huge_file.c_str());
+
+    // an entry pointing past the text
+    string past = bytes;
+    MTS_CaptionEntry *entry =
+        (MTS_CaptionEntry *)&past[MTS_CAPTIONS_HEADER_SIZE];
+    entry[1].offset = header.text_size - 2;
+    string past_file = temp_file(past);
+    CHECK(store_refused(past_file));
+    unlink(past_file.c_str());
+
+    unlink(path.c_str());
+}
+
+/* MTS_TextHelper::epochIndex: every epoch is a permutation of the
+ * captions, and shards of it together draw each caption once */
+void test_epoch_order() {
+    const size_t sizes[] = { 1, 2, 3, 5, 64, 100, 1000, 1025 };
+    const uint64_t keys[] = { 0, 42, 0xFFFFFFFFFFFFFFFFULL };
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t n = sizes[s];
+        for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+            for (uint64_t stream = 0; stream < 3; stream++) {
+                for (uint64_t epoch = 0; epoch < 3; epoch++) {
+                    vector<bool> seen(n, false);
+                    bool bijective = true;
+                    for (size_t i = 0; i < n; i++) {
+                        size_t index = MTS_TextHelper::epochIndex(keys[k],
+                                epoch * n + i, n, stream);
+                        bijective = bijective && index < n && !seen[index];
+                        if (index < n) seen[index] = true;
+                    }
+                    CHECK(bijective);
+                }
+            }
+        }
+    }
+
+    // epochs, keys and streams each get an order of their own
+    size_t n = 1000;
+    vector<size_t> first(n), next_epoch(n), other_key(n), other_stream(n);
+    for (size_t i = 0; i < n; i++) {
+        first[i] = MTS_TextHelper::epochIndex(42, i, n, 0);
+        next_epoch[i] = MTS_TextHelper::epochIndex(42, n + i, n, 0);
+        other_key[i] = MTS_TextHelper::epochIndex(43, i, n, 0);
+        other_stream[i] = MTS_TextHelper::epochIndex(42, i, n, 1);
+    }
+    CHECK(first != next_epoch);
+    CHECK(first != other_key);
+    CHECK(first != other_stream);
+
+    // shard p of 3 takes positions p, p + 3, ... (as pickCaption does);
+    // each drawing its share of an epoch, they draw every caption once
+    uint64_t shards = 3;
+    vector<int> drawn(n, 0);
+    for (uint64_t shard = 0; shard < shards; shard++) {
+        for (uint64_t k = 0; k * shards + shard < n; k++) {
+            drawn[MTS_TextHelper::epochIndex(42, k * shards + shard, n, 0)]++;
+        }
+    }
+    bool once = true;
+    for (size_t i = 0; i < n; i++) {
+        once = once && drawn[i] == 1;
+    }
+    CHECK(once);
+}
+
+/* MTSMixture::parseProfiles: the profiles parameter */
+void test_parse_profiles() {
+    vector<string> files;
+    vector<double> weights;
+
+    CHECK(MTSMixture::parseProfiles("a.txt: 0.5, b.txt:0.3,c.txt", files,
+                weights));
+    CHECK(files.size() == 3 && files[0] == "a.txt" && files[1] == "b.txt"
+            && files[2] == "c.txt");
+    CHECK(weights.size() == 3 && weights[0] == 0.5 && weights[1] == 0.3
+            && weights[2] == 1);
+
+    // empty entries are skipped, and a zero weight is allowed
+    CHECK(MTSMixture::parseProfiles(" a.txt , , b.txt : 0 ,", files,
+                weights));
+    CHECK(files.size() == 2 && files[0] == "a.txt" && files[1] == "b.txt");
+    CHECK(weights.size() == 2 && weights[0] == 1 && weights[1] == 0);
+
+    CHECK(MTSMixture::parseProfiles("", files, weights));
+    CHECK(files.empty() && weights.empty());
+
+    // a weight that isn't a number of its own, or is negative
+    cerr << "(four bad weight messages expected)" << endl;
+    CHECK(!MTSMixture::parseProfiles("a.txt: x", files, weights));
+    CHECK(!MTSMixture::parseProfiles("a.txt:", files, weights));
+    CHECK(!MTSMixture::parseProfiles("a.txt: 2x", files, weights));
+    CHECK(!MTSMixture::parseProfiles("a.txt, b.txt: -1", files, weights));
+}
+
+/* Stands in for a variate_generator: its engine returns a chosen number,
+ * and drawing from it directly returns a marker */
+struct FixedEngine {
+    uint32_t x;
+    uint32_t operator()() { return x; }
+};
+struct FixedGenerator {
+    FixedEngine engine_;
+    FixedEngine &engine() { return engine_; }
+    double operator()() { return -1; }
+};
+
+/* Whether a table follows the quantile function of exact over the whole
+ * range of engine numbers, is monotonic, and is exact in the tails */
+template<class Dist>
+bool table_follows(const MTS_QuantileTable &table, const Dist &exact,
+        double tolerance) {
+    FixedGenerator gen;
+    double last = -1;
+    bool ok = true;
+    for (uint64_t x = 0; x <= 0xFFFFFFFFULL; x += 0x10001ULL * 97) {
+        gen.engine_.x = (uint32_t)x;
+        double draw = table.draw(gen);
+        double want = quantile(exact, (x + 0.5) / 4294967296.0);
+        ok = ok && fabs(draw - want) <= tolerance * (1 + fabs(want))
+            && draw >= last;
+        last = draw;
+    }
+    const uint32_t tails[] = { 0, 1, 0xFFFFFFFEu, 0xFFFFFFFFu };
+    for (size_t i = 0; i < 4; i++) {
+        gen.engine_.x = tails[i];
+        ok = ok && table.draw(gen)
+            == quantile(exact, (tails[i] + 0.5) / 4294967296.0);
+    }
+    return ok;
+}
+
+/* MTS_QuantileTable: lookups against the exact quantile function */
+void test_quantile_table() {
+    MTS_QuantileTable table;
+    FixedGenerator gen;
+    gen.engine_.x = 12345;
+
+    // an empty table draws from the generator itself
+    CHECK(table.empty());
+    CHECK(table.draw(gen) == -1);
+
+    table.build(boost::random::beta_distribution<>(2, 3));
+    CHECK(!table.empty());
+    CHECK(table.draw(gen) != -1);
+    CHECK(table_follows(table, boost::math::beta_distribution<>(2, 3), 1e-4));
+
+    // skewed, as the spacing and stretch defaults are
+    table.build(boost::random::beta_distribution<>(0.2, 5));
+    CHECK(table_follows(table, boost::math::beta_distribution<>(0.2, 5),
+                1e-3));
+
+    // unbounded above, so the next-to-last bins curve the most
+    table.build(boost::random::gamma_distribution<>(3, 0.2));
+    CHECK(table_follows(table, boost::math::gamma_distribution<>(3, 0.2),
+                1e-3));
+
+    table.clear();
+    CHECK(table.empty());
+    CHECK(table.draw(gen) == -1);
+}
+
+/*
+ * Runs the checks of the library's self-contained parts (no fonts,
+ * captions or config are needed) and exits with status 1 if one fails.
+ *
+ * Example usage :
+ * ./mts-tests
+ */
+int main() {
+    test_charset();
+    test_caption_store();
+    test_epoch_order();
+    test_parse_profiles();
+    test_quantile_table();
+
+    if (g_failures > 0) {
+        cerr << g_failures << " check(s) failed" << endl;
+        return 1;
+    }
+    cout << "All checks passed" << endl;
+    return 0;
+}
@@ -21,22 +21,58 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * **/
 
+#include <stdlib.h>
 #include <string>
+#include <vector>
 #include <memory>
+#include <iostream>
 
 #include <opencv2/core/cvstd.hpp>
 
 #include "mtsynth/map_text_synthesizer.hpp"
 #include "mts_implementation.hpp"
+#include "mts_mixture.hpp"
+#include "mts_config.hpp"
 
 //SEE map_text_synthesizer.hpp FOR ALL DOCUMENTATION
 using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
 using cv::Mat;
 using cv::Ptr;
 
 MapTextSynthesizer::MapTextSynthesizer(){}
 
 Ptr<MapTextSynthesizer> MapTextSynthesizer::create(std::string config_file){
-    Ptr<MapTextSynthesizer> mts(new MTSImplementation(config_file));
+    MTSConfig config(config_file);
+    if (!config.findParam("profiles")) {
+        Ptr<MapTextSynthesizer> mts(new MTSImplementation(config_file));
+        return mts;
+    }
+
+    vector<string> files;
+    vector<double> weights;
+    if (!MTSMixture::parseProfiles(config.getParam("profiles"), files,
+                weights)) {
+        exit(1);
+    }
+
+    uint64_t seed = config.findParam("seed")
+        ? (uint64_t)config.getParamDouble("seed") : 0;
+    Ptr<MapTextSynthesizer> mts(new MTSMixture(files, weights, seed,
+                config_file));
+    return mts;
+}
+
+Ptr<MapTextSynthesizer> MapTextSynthesizer::create(
+        const std::vector<std::string> &config_files,
+        const std::vector<double> &weights){
+    // seeded like the first profile would be on its own
+    uint64_t seed = 0;
+    if (!config_files.empty()) {
+        seed = (uint64_t)MTSConfig(config_files[0]).getParamDouble("seed");
+    }
+    Ptr<MapTextSynthesizer> mts(new MTSMixture(config_files, weights, seed));
     return mts;
 }
@@ -31,6 +31,8 @@
 #include <unordered_map>
 #include <memory>
 #include <fstream>
+#include <time.h>
+#include <sys/stat.h>
 
 #include <pango/pangocairo.h>
 
@@ -81,6 +83,22 @@ MTS_BaseHelper::rng(){
     return rng_.next();
 }
 
+uint64
+MTS_BaseHelper::monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int64_t
+MTS_BaseHelper::modificationTime(const string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return -1;
+    }
+    return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
 //strip the spaces in the front and end of the string
 string 
 MTS_BaseHelper::strip(string str) {
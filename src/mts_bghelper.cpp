@@ -59,12 +59,45 @@ MTS_BackgroundHelper::MTS_BackgroundHelper(shared_ptr<MTS_BaseHelper> h,
     texture_distribution(c->getParamDouble("texture_width_alpha"), 
             c->getParamDouble("texture_width_beta")),
     texture_distrib_gen(h->rng2_, texture_distribution)
-{}
+{
+    buildTables();
+}
 
 
 MTS_BackgroundHelper::~MTS_BackgroundHelper(){
 }
 
+void
+MTS_BackgroundHelper::reseed() {
+    bias_var_gen.engine().seed(helper->rng());
+    texture_distrib_gen.engine().seed(helper->rng());
+}
+
+void
+MTS_BackgroundHelper::updateParams() {
+    bias_var_dist = gamma_distribution<>(config->getParamDouble("bias_std_alpha"),
+            config->getParamDouble("bias_std_beta"));
+    bias_var_gen.distribution() = bias_var_dist;
+    texture_distribution = beta_distribution<>(
+            config->getParamDouble("texture_width_alpha"),
+            config->getParamDouble("texture_width_beta"));
+    texture_distrib_gen.distribution() = texture_distribution;
+
+    buildTables();
+}
+
+void
+MTS_BackgroundHelper::buildTables() {
+    if (config->findParam("sampler_tables")
+            && config->getParamInt("sampler_tables") != 0) {
+        bias_var_table.build(bias_var_dist);
+        texture_table.build(texture_distribution);
+    } else {
+        bias_var_table.clear();
+        texture_table.clear();
+    }
+}
+
 void
 MTS_BackgroundHelper::draw_boundary(cairo_t *cr, double linewidth,
         double og_col) {
@@ -264,6 +297,7 @@ MTS_BackgroundHelper::addLines(cairo_t *cr, bool boundary, bool hatched,
         cairo_new_path(cr);
         cairo_translate(cr, x_dis, y_dis);
         cairo_append_path(cr, path_tmp);
+        cairo_path_destroy(path_tmp);
     }
 
     //stroke
@@ -491,7 +525,7 @@ MTS_BackgroundHelper::addTexture(cairo_t *cr, bool curved, double brightness,
     spacing = spacing + helper->rng() % (2*spacing);  
 
     // linewidth range (1/10)width - (1/2)width
-    int linewidth = (1.0 / (2 + texture_distrib_gen() * 8)) * width;
+    int linewidth = (1.0 / (2 + texture_table.draw(texture_distrib_gen) * 8)) * width;
     int texture = helper->rng() % 3; // range 0-2
     //coords start_point;
 
@@ -551,7 +585,7 @@ MTS_BackgroundHelper::addBgBias(cairo_t *cr, int width, int height, int color){
     double std_shift = config->getParamDouble("bias_std_shift");
     double mean = config->getParamDouble("bias_mean");
 
-    double bias_std = round((pow(1/(bias_var_gen() + 0.1), 0.5) 
+    double bias_std = round((pow(1/(bias_var_table.draw(bias_var_gen) + 0.1), 0.5) 
                 * std_scale + std_shift) * 100) / 100;
 
     // set a normal distribution for the bias
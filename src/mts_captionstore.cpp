@@ -0,0 +1,193 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * mts_captionstore.cpp contains the class method definitions for the         *
+ * MTS_CaptionStore class, a memory-mapped list of captions.                  *
+ *                                                                            *
+ * This program is free software: you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mts_captionstore.hpp"
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+// SEE mts_captionstore.hpp FOR ALL DOCUMENTATION
+
+MTS_CaptionStore::MTS_CaptionStore(string path) {
+
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        cerr << "Could not open caption store " << path << "!" << endl;
+        exit(1);
+    }
+
+    MTS_CaptionHeader existing;
+    struct stat st;
+    if (fstat(fd, &st) != 0
+            || (uint64_t)st.st_size < MTS_CAPTIONS_HEADER_SIZE
+            || pread(fd, &existing, sizeof(existing), 0) != sizeof(existing)
+            || memcmp(existing.magic, MTS_CAPTIONS_MAGIC, 8) != 0
+            || existing.version != MTS_CAPTIONS_VERSION) {
+        cerr << "Caption file " << path << " is not a caption store!" << endl;
+        exit(1);
+    }
+
+    // the sizes are checked one at a time so that none can overflow
+    uint64_t rest = st.st_size - MTS_CAPTIONS_HEADER_SIZE;
+    if (existing.count > rest / sizeof(MTS_CaptionEntry)
+            || existing.text_size
+                > rest - existing.count * sizeof(MTS_CaptionEntry)) {
+        cerr << "Caption store " << path << " is truncated!" << endl;
+        exit(1);
+    }
+    map_size = MTS_CAPTIONS_HEADER_SIZE
+        + existing.count * sizeof(MTS_CaptionEntry) + existing.text_size;
+
+    map = (char *)mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        cerr << "Could not map caption store " << path << "!" << endl;
+        exit(1);
+    }
+
+    header = (const MTS_CaptionHeader *)map;
+    entries = (const MTS_CaptionEntry *)(map + MTS_CAPTIONS_HEADER_SIZE);
+    text = (const char *)(entries + header->count);
+
+    // get() trusts the entries, so every one has to lie in the text
+    for (uint64_t i = 0; i < header->count; i++) {
+        if (entries[i].offset > header->text_size
+                || entries[i].length > header->text_size - entries[i].offset) {
+            cerr << "Caption store " << path << " is corrupt: entry " << i
+                << " is outside its text!" << endl;
+            exit(1);
+        }
+    }
+}
+
+MTS_CaptionStore::~MTS_CaptionStore() {
+    munmap(map, map_size);
+    close(fd);
+}
+
+bool
+MTS_CaptionStore::isStore(string path) {
+    char magic[8];
+    int file = open(path.c_str(), O_RDONLY);
+    if (file == -1) {
+        return false;
+    }
+    bool store = pread(file, magic, sizeof(magic), 0) == sizeof(magic)
+        && memcmp(magic, MTS_CAPTIONS_MAGIC, sizeof(magic)) == 0;
+    close(file);
+    return store;
+}
+
+int64_t
+MTS_CaptionStore::build(string path, const vector<string> &captions,
+        uint64_t key) {
+
+    vector<MTS_CaptionEntry> table(captions.size());
+    string text_region;
+    std::unordered_map<string, uint64_t> seen;
+    int64_t distinct = 0;
+
+    for (size_t i = 0; i < captions.size(); i++) {
+        const string &caption = captions[i];
+
+        std::unordered_map<string, uint64_t>::iterator it =
+            seen.find(caption);
+        if (it == seen.end()) {
+            it = seen.insert(std::make_pair(caption,
+                        (uint64_t)text_region.size())).first;
+            text_region += caption;
+            distinct++;
+        }
+
+        // count everything but utf-8 continuation bytes
+        uint32_t chars = 0;
+        for (size_t k = 0; k < caption.size(); k++) {
+            if (((unsigned char)caption[k] & 0xC0) != 0x80) chars++;
+        }
+
+        table[i].offset = it->second;
+        table[i].length = caption.size();
+        table[i].chars = chars;
+    }
+
+    char head[MTS_CAPTIONS_HEADER_SIZE];
+    memset(head, 0, sizeof(head));
+    MTS_CaptionHeader *init = (MTS_CaptionHeader *)head;
+    memcpy(init->magic, MTS_CAPTIONS_MAGIC, sizeof(init->magic));
+    init->version = MTS_CAPTIONS_VERSION;
+    init->count = table.size();
+    init->text_size = text_region.size();
+    init->key = key;
+
+    string tmp = path + ".tmp";
+    FILE *out = fopen(tmp.c_str(), "wb");
+    if (out == NULL) {
+        return -1;
+    }
+    bool ok = fwrite(head, sizeof(head), 1, out) == 1
+        && (table.empty() || fwrite(table.data(), sizeof(MTS_CaptionEntry),
+                    table.size(), out) == table.size())
+        && (text_region.empty() || fwrite(text_region.data(),
+                    text_region.size(), 1, out) == 1);
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return -1;
+    }
+    return distinct;
+}
+
+uint64_t
+MTS_CaptionStore::size() const {
+    return header->count;
+}
+
+uint64_t
+MTS_CaptionStore::textSize() const {
+    return header->text_size;
+}
+
+uint64_t
+MTS_CaptionStore::key() const {
+    return header->key;
+}
+
+const char *
+MTS_CaptionStore::get(uint64_t index, uint32_t &length) const {
+    const MTS_CaptionEntry &entry = entries[index];
+    length = entry.length;
+    return text + entry.offset;
+}
+
+uint32_t
+MTS_CaptionStore::charCount(uint64_t index) const {
+    return entries[index].chars;
+}
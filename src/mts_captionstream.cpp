@@ -0,0 +1,266 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * mts_captionstream.cpp contains the class method definitions for the        *
+ * MTS_CaptionStream class, captions streamed from large text files.          *
+ *                                                                            *
+ * This program is free software: you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "mts_captionstream.hpp"
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+extern char **environ;
+
+// number of candidates drawNear looks at
+#define NEAR_CANDIDATES 16
+
+// SEE mts_captionstream.hpp FOR ALL DOCUMENTATION
+
+MTS_CaptionStream::MTS_CaptionStream(const vector<string> &files,
+        size_t capacity, double turnover,
+        std::function<bool(const string&)> accept, uint64_t seed)
+    :files_(files),
+    capacity_(capacity > 0 ? capacity : 1),
+    turnover_(turnover),
+    accept_(accept),
+    credit_(0),
+    stop_(false),
+    empty_(false),
+    child_(0),
+    rng_(seed)
+{
+    for (size_t i = 0; i < files_.size(); i++) {
+        struct stat st;
+        if (stat(files_[i].c_str(), &st) != 0) {
+            cerr << "Could not open " << files_[i] << endl;
+            exit(1);
+        }
+    }
+    reservoir_.reserve(capacity_);
+}
+
+MTS_CaptionStream::~MTS_CaptionStream() {
+    if (!reader_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        // don't wait for the decompressor to get to the end of the file
+        if (child_ > 0) {
+            kill(child_, SIGTERM);
+        }
+    }
+    changed_.notify_all();
+    reader_.join();
+}
+
+FILE *
+MTS_CaptionStream::openFile(const string &path) {
+
+    const char *tool = NULL;
+    size_t dot = path.rfind('.');
+    string ext = dot == string::npos ? "" : path.substr(dot);
+    if (ext == ".gz") {
+        tool = "gzip";
+    } else if (ext == ".zst" || ext == ".zstd") {
+        tool = "zstd";
+    } else {
+        return fopen(path.c_str(), "r");
+    }
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        return NULL;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+
+    char *argv[] = { (char *)tool, (char *)"-dc", (char *)"--",
+        (char *)path.c_str(), NULL };
+    pid_t pid;
+    int status = posix_spawnp(&pid, tool, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (status != 0) {
+        close(fds[0]);
+        return NULL;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    child_ = pid;
+    return fdopen(fds[0], "r");
+}
+
+void
+MTS_CaptionStream::closeFile(FILE *file) {
+    fclose(file);
+
+    pid_t pid;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pid = child_;
+        child_ = 0;
+    }
+    if (pid > 0) {
+        int status;
+        waitpid(pid, &status, 0);
+    }
+}
+
+bool
+MTS_CaptionStream::insert(string &line) {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    if (reservoir_.size() < capacity_) {
+        reservoir_.push_back(line);
+        changed_.notify_all();
+        return !stop_;
+    }
+
+    changed_.wait(lock, [this] { return stop_ || credit_ >= 1; });
+    if (stop_) {
+        return false;
+    }
+    credit_ -= 1;
+    // the old line's buffer is reused for the next one
+    reservoir_[rng_() % capacity_].swap(line);
+    return true;
+}
+
+void
+MTS_CaptionStream::run() {
+
+    char *buf = NULL;
+    size_t buf_size = 0;
+    string line;
+
+    while (true) {
+        size_t accepted = 0;
+
+        for (size_t i = 0; i < files_.size(); i++) {
+            FILE *file = openFile(files_[i]);
+            if (file == NULL) {
+                cerr << "Could not read caption stream file " << files_[i]
+                    << endl;
+                continue;
+            }
+
+            bool stopping = false;
+            ssize_t n;
+            while ((n = getline(&buf, &buf_size, file)) != -1) {
+                // lines the filter rejects never get to insert()
+                if (stop_) {
+                    stopping = true;
+                    break;
+                }
+                if (n > 0 && buf[n - 1] == '\n') n--;
+                if (n == 0) continue;
+
+                line.assign(buf, n);
+                if (accept_ && !accept_(line)) continue;
+
+                accepted++;
+                if (!insert(line)) {
+                    stopping = true;
+                    break;
+                }
+            }
+            closeFile(file);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping || stop_) {
+                free(buf);
+                return;
+            }
+        }
+
+        if (accepted == 0) {
+            // let draw() fail rather than wait forever
+            std::lock_guard<std::mutex> lock(mutex_);
+            empty_ = true;
+            changed_.notify_all();
+            free(buf);
+            return;
+        }
+    }
+}
+
+void
+MTS_CaptionStream::draw(uint64_t r, string &caption) {
+    drawNear(r, 0, caption);
+}
+
+void
+MTS_CaptionStream::drawNear(uint64_t r, int length, string &caption) {
+
+    // started here rather than in the constructor, so that a process
+    // forked from one that never drew gets a reader of its own
+    if (!reader_.joinable()) {
+        reader_ = std::thread(&MTS_CaptionStream::run, this);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this] { return !reservoir_.empty() || empty_; });
+    if (reservoir_.empty()) {
+        cerr << "No usable caption in the caption stream files!" << endl;
+        exit(1);
+    }
+
+    size_t best = r % reservoir_.size();
+    if (length > 0) {
+        int best_diff = -1;
+        uint64_t x = r;
+        for (int k = 0; k < NEAR_CANDIDATES; k++) {
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+            size_t candidate = (x >> 33) % reservoir_.size();
+
+            // count everything but utf-8 continuation bytes
+            const string &text = reservoir_[candidate];
+            int chars = 0;
+            for (size_t i = 0; i < text.size(); i++) {
+                if (((unsigned char)text[i] & 0xC0) != 0x80) chars++;
+            }
+            int diff = abs(chars - length);
+            if (best_diff < 0 || diff < best_diff) {
+                best = candidate;
+                best_diff = diff;
+            }
+        }
+    }
+    caption = reservoir_[best];
+
+    // a slow consumer doesn't bank an unbounded backlog of reads
+    credit_ += turnover_;
+    if (credit_ > capacity_) credit_ = capacity_;
+    changed_.notify_all();
+}
@@ -0,0 +1,128 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * mts_charset.cpp contains the class method definitions for the MTS_Charset  *
+ * class, which maps caption characters to the class indices of a model.     *
+ *                                                                            *
+ * This program is free software: you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * **/
+
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+#include "mts_charset.hpp"
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+// SEE mts_charset.hpp FOR ALL DOCUMENTATION
+
+MTS_Charset::MTS_Charset(string charset_file) {
+
+    std::ifstream infile(charset_file);
+    if (! infile.is_open()) {
+        cerr << "Could not open " << charset_file << endl;
+        exit(1);
+    }
+    std::stringstream contents;
+    contents << infile.rdbuf();
+    string text = contents.str();
+
+    size_t pos = 0;
+    while (pos < text.size()) {
+        int64_t c = decode(text, pos);
+        if (c < 0) {
+            cerr << "Charset " << charset_file << " is not valid utf-8!"
+                << endl;
+            exit(1);
+        }
+        if (c == '\n' || c == '\r') {
+            continue;
+        }
+        if (index_.count((uint32_t)c) != 0) {
+            cerr << "Charset " << charset_file << " lists character "
+                << c << " twice!" << endl;
+            exit(1);
+        }
+        int32_t next = index_.size();
+        index_[(uint32_t)c] = next;
+    }
+}
+
+size_t
+MTS_Charset::size() const {
+    return index_.size();
+}
+
+int64_t
+MTS_Charset::decode(const string &text, size_t &pos) {
+
+    unsigned char lead = text[pos++];
+    int extra;
+    uint32_t c;
+
+    // the lead byte tells the length of the sequence
+    if (lead < 0x80) {
+        return lead;
+    } else if ((lead & 0xE0) == 0xC0) {
+        extra = 1;
+        c = lead & 0x1F;
+    } else if ((lead & 0xF0) == 0xE0) {
+        extra = 2;
+        c = lead & 0x0F;
+    } else if ((lead & 0xF8) == 0xF0) {
+        extra = 3;
+        c = lead & 0x07;
+    } else {
+        return -1;
+    }
+
+    for (int i = 0; i < extra; i++) {
+        if (pos >= text.size() || ((unsigned char)text[pos] & 0xC0) != 0x80) {
+            return -1;
+        }
+        c = (c << 6) | ((unsigned char)text[pos++] & 0x3F);
+    }
+    return c;
+}
+
+bool
+MTS_Charset::encode(const string &text, vector<int32_t> &label) const {
+
+    label.clear();
+    size_t pos = 0;
+    while (pos < text.size()) {
+        int64_t c = decode(text, pos);
+        if (c < 0) {
+            return false;
+        }
+        std::unordered_map<uint32_t, int32_t>::const_iterator it =
+            index_.find((uint32_t)c);
+        if (it == index_.end()) {
+            return false;
+        }
+        label.push_back(it->second);
+    }
+    return true;
+}
+
+bool
+MTS_Charset::covers(const string &text) const {
+    vector<int32_t> label;
+    return encode(text, label);
+}
@@ -40,8 +40,9 @@ using std::endl;
 // SEE mts_config.hpp FOR ALL DOCUMENTATION
 
 
-unordered_map<string,string> 
-MTSConfig::parseConfig(string filename) {
+bool
+MTSConfig::parseConfig(string filename,
+        unordered_map<string, string> &parameter_map) {
 
     unordered_map<string, string> params = unordered_map<string, string>();
 
@@ -51,11 +52,11 @@ MTSConfig::parseConfig(string filename) {
     std::ifstream infile(filename);
     if (! infile.is_open()) {
         cerr << "The input config file could not be opened!" << endl;
-        exit(1);
+        return false;
     }
 
     string line, key, value;
-    int line_number;
+    int line_number = 0;
     // parse file line by line
     while (getline(infile, line)) {
         line_number++;
@@ -71,7 +72,7 @@ MTSConfig::parseConfig(string filename) {
         if (pos == line.npos) {
             cerr << "Line " << line_number
                       << " in config file does not contain delimiter!\n";
-            exit(1);
+            return false;
         }
 
         key = MTS_BaseHelper::strip(line.substr(0, pos));
@@ -82,14 +83,47 @@ MTSConfig::parseConfig(string filename) {
     // close file
     infile.close();
 
-    return params;
+    parameter_map.swap(params);
+    return true;
 }
 
 
 MTSConfig::MTSConfig(string filename){
-    params = parseConfig(filename);
-    paramsInt = unordered_map<string, int>();
-    paramsDouble = unordered_map<string, double>();
+    if (!read(filename)) {
+        exit(1);
+    }
+}
+
+MTSConfig::MTSConfig(){}
+
+bool
+MTSConfig::read(string filename) {
+    unordered_map<string, string> parsed;
+    if (!parseConfig(filename, parsed)) {
+        return false;
+    }
+    params.swap(parsed);
+    // the converted values are of the old parameters
+    paramsInt.clear();
+    paramsDouble.clear();
+    return true;
+}
+
+void
+MTSConfig::swap(MTSConfig &other) {
+    params.swap(other.params);
+    paramsInt.swap(other.paramsInt);
+    paramsDouble.swap(other.paramsDouble);
+}
+
+vector<string>
+MTSConfig::getKeys() {
+    vector<string> keys;
+    for (unordered_map<string, string>::iterator it = params.begin();
+            it != params.end(); ++it) {
+        keys.push_back(it->first);
+    }
+    return keys;
 }
 
 bool
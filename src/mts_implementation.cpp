@@ -29,6 +29,7 @@
 #include <cstring>
 #include <ctime>
 #include <errno.h>
+#include <unistd.h> // getpid
 #include <map>
 #include <limits>
 #include <iostream>
@@ -85,13 +86,7 @@ MTSImplementation::cairoToMat(cairo_surface_t *surface,Mat &mat) {
     mat = channels[0];
 }
 
-void MTSImplementation::addGaussianNoise(Mat& out) {
-    // get and use user config parameters to set sigma
-    double scale = config->getParamDouble("noise_sigma_scale");
-    double shift = config->getParamDouble("noise_sigma_shift");
-    double sigma = round((pow(1/(noise_gen() + 0.1),0.5) * scale + shift) * 100)
-        / 100;
-
+void MTSImplementation::addGaussianNoise(Mat& out, double sigma) {
     // create noise matrix
     Mat noise = Mat(out.rows, out.cols, CV_32F);
 
@@ -104,56 +99,462 @@ void MTSImplementation::addGaussianNoise(Mat& out) {
     cv::threshold(out,out,0,1.0,cv::THRESH_TOZERO);
 }
 
-void MTSImplementation::addGaussianBlur(Mat& out) {
-    // get user config parameters for kernel size
-    int size_min = config->getParamInt("blur_kernel_size_min") / 2;
-    int size_max = config->getParamInt("blur_kernel_size_max") / 2;
-    int ker_size = (helper->rndBetween(size_min,size_max)) * 2 + 1;
-
+void MTSImplementation::addGaussianBlur(Mat& out, int ker_size) {
     GaussianBlur(out,out,cv::Size(ker_size,ker_size),0,0,cv::BORDER_REFLECT_101);
 }
 
-void MTSImplementation::addCompressionArtifacts(Mat& out){
-    if(helper->rndProbUnder(config->getParamDouble("jpeg_prob"))){
-        vector<uchar> buffer;
-        vector<int> parameters;
-        parameters.push_back(CV_IMWRITE_JPEG_QUALITY);
-        int quality_min = config->getParamInt("jpeg_quality_min");
-        int quality_max = config->getParamInt("jpeg_quality_max");
-        int quality = helper->rndBetween(quality_min,quality_max);
-        parameters.push_back(quality);
-        Mat ucharImg;
-        out.convertTo(ucharImg,CV_8UC1,255);
-        cv::imencode(".jpg",ucharImg,buffer,parameters);
-        ucharImg=cv::imdecode(buffer,CV_LOAD_IMAGE_GRAYSCALE);
-        ucharImg.convertTo(out,CV_32FC1,1.0/255);
-    }
+void MTSImplementation::addCompressionArtifacts(Mat& out, int quality){
+    vector<uchar> buffer;
+    vector<int> parameters;
+    parameters.push_back(CV_IMWRITE_JPEG_QUALITY);
+    parameters.push_back(quality);
+    Mat ucharImg;
+    out.convertTo(ucharImg,CV_8UC1,255);
+    cv::imencode(".jpg",ucharImg,buffer,parameters);
+    ucharImg=cv::imdecode(buffer,CV_LOAD_IMAGE_GRAYSCALE);
+    ucharImg.convertTo(out,CV_32FC1,1.0/255);
 }
 
 
-MTSImplementation::MTSImplementation(string config_file)
+/* Parameters a reload can't change: they shaped what the constructor
+ * loaded (fonts, captions, stores) or what consumers of the samples
+ * expect (sizes and pixel format) */
+static const char *fixed_params[] = { "fonts", "captions", "caption_order",
+    "caption_shm", "caption_stream", "caption_stream_reservoir",
+    "caption_stream_turnover", "charset", "caption_max_bytes", "seed",
+    "profiles", "replay_file", "replay_capacity", "replay_size_mb",
+    "width_buckets", "output_height", "output_direct", "output_float",
+    "output_mean", "output_scale" };
+
+/* Parameters of the beta and gamma generators, which must be positive */
+static const char *shape_params[] = { "spacing_alpha", "spacing_beta",
+    "stretch_alpha", "stretch_beta", "digit_len_alpha", "digit_len_beta",
+    "bias_std_alpha", "bias_std_beta", "texture_width_alpha",
+    "texture_width_beta", "noise_sigma_alpha", "noise_sigma_beta" };
+
+static bool isNumber(const string &value) {
+    char *end;
+    strtod(value.c_str(), &end);
+    return !value.empty() && *end == '\0';
+}
+
+
+MTSImplementation::MTSImplementation(string config_file,
+        const MTSImplementation *share)
     : MapTextSynthesizer(),  // initialize class fields
     config(make_shared<MTSConfig>(MTSConfig(config_file))),
     helper(make_shared<MTS_BaseHelper>(MTS_BaseHelper(config))),
-    th(helper,config),
+    th(helper,config,share != NULL ? &share->th : NULL),
     bh(helper,config),
     noise_dist(config->getParamDouble("noise_sigma_alpha"),
             config->getParamDouble("noise_sigma_beta")),
-    noise_gen(helper->rng2_, noise_dist)
+    noise_gen(helper->rng2_, noise_dist),
+    replay_fraction(0),
+    bg_feature_bits(0),
+    bucket_attempts(4),
+    output_height(0),
+    output_direct(true),
+    output_float(false),
+    output_mean(0),
+    output_scale(1),
+    config_file_(config_file),
+    config_reload_s(0),
+    config_mtime_ns(0),
+    config_check_ns(0)
 {
-    //initialize rng in BaseHelper
+    //initialize rng in BaseHelper (mix in the pid so that processes
+    //started within the same second don't produce identical samples)
     uint64 seed = (uint64)config->getParamDouble("seed");
-    helper->setSeed(seed != 0 ? seed : time(NULL));
+    setSeed(seed != 0 ? seed : ((uint64)getpid() << 32) ^ (uint64)time(NULL));
+
+    // optional replay store
+    if (config->findParam("replay_file") && config->getParam("replay_file")!="") {
+        replay_fraction = config->getParamDouble("replay_fraction");
+        if (replay_fraction < 0 || replay_fraction >= 1) {
+            cerr << "replay_fraction must be in [0,1)!" << endl;
+            exit(1);
+        }
+        uint64 capacity = (uint64)config->getParamDouble("replay_capacity");
+        uint64 data_size =
+            (uint64)(config->getParamDouble("replay_size_mb") * 1024 * 1024);
+        store = make_shared<MTS_SampleStore>(config->getParam("replay_file"),
+                capacity, data_size);
+    }
+
+    // optional width buckets, e.g. "64,128,192,256"
+    if (config->findParam("width_buckets")
+            && config->getParam("width_buckets")!="") {
+        vector<string> bounds =
+            helper->tokenize(config->getParam("width_buckets"),",");
+        for (size_t i = 0; i < bounds.size(); i++) {
+            width_buckets.push_back(atoi(bounds[i].c_str()));
+            if (i > 0 && width_buckets[i] <= width_buckets[i-1]) {
+                cerr << "width_buckets must be increasing!" << endl;
+                exit(1);
+            }
+        }
+        if (width_buckets.size() < 2) {
+            cerr << "width_buckets needs at least two boundaries!" << endl;
+            exit(1);
+        }
+    }
+    if (config->findParam("width_bucket_attempts")) {
+        bucket_attempts = config->getParamInt("width_bucket_attempts");
+    }
+
+    // optional output shaping, all off unless configured
+    if (config->findParam("output_height")) {
+        output_height = config->getParamInt("output_height");
+    }
+    if (config->findParam("output_direct")) {
+        output_direct = config->getParamInt("output_direct") != 0;
+    }
+    if (config->findParam("output_float")) {
+        output_float = config->getParamInt("output_float") != 0;
+    }
+    if (output_float) {
+        output_mean = config->getParamDouble("output_mean");
+        output_scale = config->getParamDouble("output_scale");
+    }
+
+    // optional lookup table for the noise sigma draw
+    if (config->findParam("sampler_tables")
+            && config->getParamInt("sampler_tables") != 0) {
+        noise_table.build(noise_dist);
+    }
+
+    // optional watch on the config file
+    if (config->findParam("config_reload_s")) {
+        config_reload_s = config->getParamDouble("config_reload_s");
+    }
+    if (config_reload_s > 0) {
+        config_mtime_ns = MTS_BaseHelper::modificationTime(config_file);
+        config_check_ns = MTS_BaseHelper::monotonicNs()
+            + (uint64)(config_reload_s * 1e9);
+    }
+}
+
+bool MTSImplementation::reloadConfig(const string &config_file) {
+
+    MTSConfig fresh;
+    if (!fresh.read(config_file)) {
+        return false;
+    }
+
+    // everything is checked before anything changes, so that a bad
+    // config (or one caught half written) leaves the old one in place
+    vector<string> keys = config->getKeys();
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (!fresh.findParam(keys[i])) {
+            cerr << "Parameter " << keys[i] << " is missing from "
+                << config_file << ", not reloading" << endl;
+            return false;
+        }
+        if (isNumber(config->getParam(keys[i]))
+                && !isNumber(fresh.getParam(keys[i]))) {
+            cerr << "Parameter " << keys[i] << " in " << config_file
+                << " must be a number, not reloading" << endl;
+            return false;
+        }
+    }
+    for (size_t i = 0; i < sizeof(fixed_params) / sizeof(char *); i++) {
+        bool before = config->findParam(fixed_params[i]);
+        if (before != fresh.findParam(fixed_params[i]) || (before
+                    && config->getParam(fixed_params[i])
+                    != fresh.getParam(fixed_params[i]))) {
+            cerr << "Parameter " << fixed_params[i] << " can't change "
+                << "without creating a new synthesizer, not reloading" << endl;
+            return false;
+        }
+    }
+    for (size_t i = 0; i < sizeof(shape_params) / sizeof(char *); i++) {
+        if (!(fresh.getParamDouble(shape_params[i]) > 0)) {
+            cerr << "Parameter " << shape_params[i] << " must be positive, "
+                << "not reloading" << endl;
+            return false;
+        }
+    }
+    if (fresh.getParamInt("bg_color_min") > 255
+            || fresh.getParamInt("text_color_max") < 0
+            || fresh.getParamInt("bg_color_min")
+            <= fresh.getParamInt("text_color_max")) {
+        cerr << "Invalid color input, not reloading" << endl;
+        return false;
+    }
+    if (store && (fresh.getParamDouble("replay_fraction") < 0
+                || fresh.getParamDouble("replay_fraction") >= 1)) {
+        cerr << "replay_fraction must be in [0,1), not reloading" << endl;
+        return false;
+    }
+
+    // the helpers hold on to config itself, so its contents are swapped
+    config->swap(fresh);
+    updateParams();
+    return true;
+}
+
+void MTSImplementation::updateParams() {
+    th.updateParams();
+    bh.updateParams();
+
+    noise_dist = gamma_distribution<>(config->getParamDouble("noise_sigma_alpha"),
+            config->getParamDouble("noise_sigma_beta"));
+    noise_gen.distribution() = noise_dist;
+    if (config->findParam("sampler_tables")
+            && config->getParamInt("sampler_tables") != 0) {
+        noise_table.build(noise_dist);
+    } else {
+        noise_table.clear();
+    }
+
+    if (store) {
+        replay_fraction = config->getParamDouble("replay_fraction");
+    }
+    bucket_attempts = config->findParam("width_bucket_attempts") ?
+        config->getParamInt("width_bucket_attempts") : 4;
+    config_reload_s = config->findParam("config_reload_s") ?
+        config->getParamDouble("config_reload_s") : 0;
+}
+
+void MTSImplementation::checkConfigFile() {
+    if (config_reload_s <= 0) {
+        return;
+    }
+    uint64 now = MTS_BaseHelper::monotonicNs();
+    if (now < config_check_ns) {
+        return;
+    }
+    config_check_ns = now + (uint64)(config_reload_s * 1e9);
+
+    // a failed reload isn't retried until the file changes again
+    int64_t mtime = MTS_BaseHelper::modificationTime(config_file_);
+    if (mtime < 0 || mtime == config_mtime_ns) {
+        return;
+    }
+    config_mtime_ns = mtime;
+    if (reloadConfig(config_file_)) {
+        cerr << "Reloaded " << config_file_ << endl;
+    }
+}
+
+void MTSImplementation::finishSample(Mat &sample) {
+    // pixel / 255 - mean, times scale, in one pass
+    if (output_float) {
+        sample.convertTo(sample, CV_32FC1, output_scale / 255.0,
+                -output_mean * output_scale);
+    }
 }
 
 MTSImplementation::~MTSImplementation() {
 }
 
+void MTSImplementation::setSeed(uint64_t seed) {
+    reseedGenerators(seed);
+    recipe_base = seed;
+    recipe_counter = 0;
+}
+
+void MTSImplementation::setEpochShard(uint32_t shard, uint32_t shards) {
+    th.setEpochShard(shard, shards);
+}
+
+void MTSImplementation::reseedGenerators(uint64_t seed) {
+    helper->setSeed(seed);
+
+    // the distribution generators hold their own copies of the engine,
+    // so each of them has to be reseeded separately
+    helper->rng2_.seed(helper->rng());
+    th.reseed();
+    bh.reseed();
+    noise_gen.engine().seed(helper->rng());
+
+    // cv::randn in addGaussianNoise draws from the global opencv rng
+    cv::theRNG().state = seed;
+}
+
 void MTSImplementation::generateSample(string &caption, Mat &sample, int &actual_height){
 
-    //cout << "start generate sample" << endl;
+    if (store) {
+        uint64 stored = store->size();
+        if (stored > 0 && helper->rndProbUnder(replay_fraction)) {
+            uint64 index = ((uint64)helper->rng() << 32 | helper->rng())
+                % stored;
+            if (store->read(index, caption, sample, actual_height)) {
+                finishSample(sample);
+                return;
+            }
+        }
+    }
+
+    synthesizeSample(caption, sample, actual_height);
+
+    if (store) {
+        store->append(caption, sample, actual_height);
+    }
+    finishSample(sample);
+}
+
+void MTSImplementation::generateSample(string &caption, Mat &sample,
+        int &actual_height, MTSRecipe &recipe) {
+
+    // splitmix64 of (base, counter): neighbouring samples get unrelated
+    // seeds, and any one of them can be recomputed on its own
+    recipe.counter = recipe_counter++;
+    uint64 z = recipe_base + (recipe.counter + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    recipe.seed = z != 0 ? z : 1;
+
+    generateSeeded(recipe.seed, caption, sample, actual_height, recipe);
+}
+
+void MTSImplementation::generateSeeded(uint64_t seed, string &caption,
+        Mat &sample, int &actual_height, MTSRecipe &recipe) {
+    renderRecipe(seed, caption, sample, actual_height, recipe);
+    finishSample(sample);
+}
+
+bool MTSImplementation::setProfileWeights(const vector<double> &weights) {
+    return weights.size() == 1 && weights[0] > 0;
+}
+
+string MTSImplementation::fontCostReport() {
+    return th.fontCostReport();
+}
+
+bool MTSImplementation::encodeCaption(const string &caption,
+        vector<int32_t> &label) {
+    if (!th.charset) {
+        label.clear();
+        return false;
+    }
+    return th.charset->encode(caption, label);
+}
+
+bool MTSImplementation::regenerate(const MTSRecipe &recipe, string &caption,
+        Mat &sample, int &actual_height) {
+
+    // the stream has moved on, the caption is gone
+    if (recipe.caption_index == MTS_CAPTION_STREAMED) {
+        return false;
+    }
+
+    // in epoch order the caption came from where the epochs were then;
+    // take it from the recipe and leave the epochs where they are now
+    MTSRecipe check = recipe;
+    th.replayCaption(recipe.caption_index);
+    renderRecipe(recipe.seed, caption, sample, actual_height, check);
+    th.replayCaption(-1);
+    finishSample(sample);
+
+    return check.caption_index == recipe.caption_index
+        && check.font_index == recipe.font_index
+        && check.bg_features == recipe.bg_features
+        && check.height == recipe.height
+        && check.width == recipe.width;
+}
+
+void MTSImplementation::renderRecipe(uint64_t seed, string &caption,
+        Mat &sample, int &actual_height, MTSRecipe &recipe) {
+
+    // the sample depends on nothing but the generator state it starts from
+    reseedGenerators(seed);
+    synthesizeSample(caption, sample, actual_height);
+
+    recipe.caption_index = th.caption_index;
+    recipe.font_index = th.font_index;
+    recipe.bg_features = bg_feature_bits;
+    recipe.height = sample.rows;
+    recipe.width = sample.cols;
+}
+
+void MTSImplementation::generateSample(string &caption, Mat &sample,
+        int &actual_height, int min_width, int max_width) {
+    MTSPlan p;
+    plan(p, min_width, max_width);
+    render(p, caption, sample, actual_height);
+}
+
+void MTSImplementation::render(const MTSPlan &plan, string &caption,
+        Mat &sample, int &actual_height) {
+    renderSample(plan, caption, sample, actual_height);
+    finishSample(sample);
+}
+
+void MTSImplementation::synthesizeSample(string &caption, Mat &sample, int &actual_height){
+    MTSPlan p;
+    if (width_buckets.empty()) {
+        plan(p);
+    } else {
+        size_t i = helper->rng() % (width_buckets.size() - 1);
+        plan(p, width_buckets[i], width_buckets[i+1] - 1);
+    }
+    renderSample(p, caption, sample, actual_height);
+}
+
+int MTSImplementation::outputWidth(const MTSPlan &plan) {
+    int width = th.measureText(plan.text, plan.caption, plan.height);
+
+    // rounded as renderSample resizes it
+    if (output_height > 0 && plan.height != output_height) {
+        width = std::max(1,
+                (int)round((double)width * output_height / plan.height));
+    }
+    return width;
+}
+
+void MTSImplementation::plan(MTSPlan &plan, int min_width, int max_width) {
+
+    this->plan(plan);
+
+    double target = (min_width + max_width) / 2.0;
+    int width = outputWidth(plan);
+
+    // stretch stays within what the config could have drawn
+    double stretch_lo = config->getParamDouble("stretch_shift");
+    double stretch_hi = stretch_lo + config->getParamDouble("stretch_scale");
+    stretch_lo = std::min(stretch_lo, 1.0);
+    stretch_hi = std::max(stretch_hi, 1.0);
+
+    MTSPlan best = plan;
+    int best_miss = std::max(min_width - width, width - max_width);
+
+    for (int i = 0; i < bucket_attempts && best_miss > 0; i++) {
+
+        // the last layout tells how wide a character of this font,
+        // height and spacing is; pick a caption of the fitting length
+        double per_char = (double)width / std::max(1,
+                MTS_TextHelper::charCount(plan.caption));
+        th.planCaptionNear(plan.caption, target / per_char);
+        plan.caption_index = th.caption_index;
+        width = outputWidth(plan);
+
+        // then close the remaining gap with the stretch
+        if ((width < min_width || width > max_width) && width > 0) {
+            plan.text.stretch_deg = std::min(stretch_hi, std::max(stretch_lo,
+                        plan.text.stretch_deg * target / width));
+            width = outputWidth(plan);
+        }
+
+        int miss = std::max(min_width - width, width - max_width);
+        if (miss < best_miss) {
+            best = plan;
+            best_miss = miss;
+        }
+    }
+
+    plan = best;
+}
+
+void MTSImplementation::plan(MTSPlan &plan) {
+
+    // a new config takes effect between samples
+    checkConfigFile();
+
     vector<BGFeature> bg_features;
     bh.generateBgFeatures(bg_features);
+    plan.bg_features.assign(bg_features.begin(), bg_features.end());
 
     // set bg and text color (brightness) based on user configured parameters
     int bgcolor_min = config->getParamInt("bg_color_min");
@@ -165,35 +566,97 @@ void MTSImplementation::generateSample(string &caption, Mat &sample, int &actual
         exit(1);
     }
 
-    int bg_brightness = helper->rndBetween(bgcolor_min,255);
-    int text_color = helper->rndBetween(0,textcolor_max);
-    int contrast = bg_brightness - text_color;
-
-    cairo_surface_t *text_surface;
-    int height;
-    int width;
+    plan.bg_brightness = helper->rndBetween(bgcolor_min,255);
+    plan.text_color = helper->rndBetween(0,textcolor_max);
 
     // set image height from user configured parameters
     int height_min = config->getParamInt("height_min");
     int height_max = config->getParamInt("height_max");
     if (height_min == height_max) {
-        height = height_min;
+        plan.height = height_min;
     } else {
-        height = helper->rndBetween(height_min,height_max); 
+        plan.height = helper->rndBetween(height_min,height_max); 
     }
 
+    th.planCaption(plan.caption);
+    plan.caption_index = th.caption_index;
+    th.planText(plan.text);
+
+    // set the blend alpha range using user configured parameters
+    double blend_min=config->getParamDouble("blend_alpha_min");
+    double blend_max=config->getParamDouble("blend_alpha_max");
+
+    plan.blend_alpha=helper->rndBetween(blend_min,blend_max);
+
+    // blend with alpha or not based on user set probability
+    plan.blend = helper->rndProbUnder(config->getParamDouble("blend_prob"));
+
+    // get and use user config parameters to set noise sigma
+    double scale = config->getParamDouble("noise_sigma_scale");
+    double shift = config->getParamDouble("noise_sigma_shift");
+    plan.noise_sigma = round((pow(1/(noise_table.draw(noise_gen) + 0.1),0.5) * scale + shift)
+            * 100) / 100;
+
+    // get user config parameters for blur kernel size
+    int size_min = config->getParamInt("blur_kernel_size_min") / 2;
+    int size_max = config->getParamInt("blur_kernel_size_max") / 2;
+    plan.blur_kernel = (helper->rndBetween(size_min,size_max)) * 2 + 1;
+
+    // render straight at the output height rather than downscaling later;
+    // the text and background are all relative to the height, the blur
+    // kernel has to follow it
+    if (output_height > 0 && output_direct && plan.height != output_height) {
+        plan.blur_kernel = (int)round((plan.blur_kernel / 2)
+                * (double)output_height / plan.height) * 2 + 1;
+        plan.height = output_height;
+    }
+
+    // jpeg compression artifacts (quality 0 means none)
+    plan.jpeg_quality = 0;
+    if(helper->rndProbUnder(config->getParamDouble("jpeg_prob"))){
+        int quality_min = config->getParamInt("jpeg_quality_min");
+        int quality_max = config->getParamInt("jpeg_quality_max");
+        plan.jpeg_quality = std::max(1, helper->rndBetween(quality_min,quality_max));
+    }
+
+    // everything else is drawn while rendering, from this
+    plan.seed = (uint64)helper->rng() << 32 | helper->rng();
+    plan.profile = 0;
+}
+
+void MTSImplementation::renderSample(const MTSPlan &plan, string &caption, Mat &sample, int &actual_height){
+
+    // the rest of the randomness comes from the plan's own stream
+    reseedGenerators(plan.seed);
+
+    vector<BGFeature> bg_features;
+    bg_feature_bits = 0;
+    for (size_t i = 0; i < plan.bg_features.size(); i++) {
+        bg_features.push_back((BGFeature)plan.bg_features[i]);
+        bg_feature_bits |= 1u << plan.bg_features[i];
+    }
+
+    int bg_brightness = plan.bg_brightness;
+    int text_color = plan.text_color;
+    int contrast = bg_brightness - text_color;
+
+    cairo_surface_t *text_surface;
+    int height = plan.height;
+    int width;
+
     actual_height = height;
+    caption = plan.caption;
 
     //cout << "text" << endl;
     // use TextHelper instance to generate synthetic text
     if (std::find(bg_features.begin(), bg_features.end(), Distracttext)!=
             bg_features.end()) {
         // generate distractor text
-        th.generateTextSample(caption,text_surface,height,
+        th.generateTextSample(plan.text,caption,text_surface,height,
                 width,text_color,true);
     } else {
         // dont generate distractor text
-        th.generateTextSample(caption,text_surface,height,
+        th.generateTextSample(plan.text,caption,text_surface,height,
                 width,text_color,false);
     }
 
@@ -205,15 +668,9 @@ void MTSImplementation::generateSample(string &caption, Mat &sample, int &actual
     cairo_t *cr = cairo_create(bg_surface);
     cairo_set_source_surface(cr, text_surface, 0, 0);
 
-    // set the blend alpha range using user configured parameters
-    double blend_min=config->getParamDouble("blend_alpha_min");
-    double blend_max=config->getParamDouble("blend_alpha_max");
-
-    double blend_alpha=helper->rndBetween(blend_min,blend_max);
-
-    // blend with alpha or not based on user set probability
-    if(helper->rndProbUnder(config->getParamDouble("blend_prob"))){
-        cairo_paint_with_alpha(cr, blend_alpha);
+    // blend with alpha or not as planned
+    if(plan.blend){
+        cairo_paint_with_alpha(cr, plan.blend_alpha);
     } else { // dont blend
         cairo_paint(cr);
     }
@@ -233,19 +690,35 @@ void MTSImplementation::generateSample(string &caption, Mat &sample, int &actual
     cairo_surface_destroy(bg_surface);
 
     // add image smoothing using blur and noise
-    addGaussianNoise(sample_float);
-    addGaussianBlur(sample_float);
+    addGaussianNoise(sample_float, plan.noise_sigma);
+    addGaussianBlur(sample_float, plan.blur_kernel);
 
-    addCompressionArtifacts(sample_float);
+    if (plan.jpeg_quality > 0) {
+        addCompressionArtifacts(sample_float, plan.jpeg_quality);
+    }
+
+    // resample to the output height, keeping the aspect ratio
+    if (output_height > 0 && height != output_height) {
+        int out_width = std::max(1,
+                (int)round((double)width * output_height / height));
+        Mat resized;
+        cv::resize(sample_float, resized, cv::Size(out_width, output_height),
+                0, 0, output_height < height ? cv::INTER_AREA : cv::INTER_LINEAR);
+        sample_float = resized;
+        height = output_height;
+        width = out_width;
+        actual_height = height;
+    }
 
-    bool zero_padding = true;
+    // all samples have the same height already with output_height set
+    bool zero_padding = output_height == 0;
     if (config->getParamDouble("zero_padding")==0) zero_padding = false;
 
     if (!zero_padding) {
         sample = Mat(height,width,CV_8UC1,cv::Scalar_<uchar>(0,0,0));
     } else {
         int height_max = int(config->getParamDouble("height_max"));
-        sample = Mat(height_max,width,CV_8UC1,cv::Scalar_<uchar>(0,0,0));
+        sample = Mat(std::max(height_max,height),width,CV_8UC1,cv::Scalar_<uchar>(0,0,0));
     }
 
     sample_float.convertTo(sample_uchar, CV_8UC1, 255.0);
@@ -0,0 +1,313 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * mts_mixture.cpp contains the class method definitions for the MTSMixture   *
+ * class, a synthesizer mixing several config profiles.                       *
+ *                                                                            *
+ * This program is free software: you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * **/
+
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <ctime>
+#include <unistd.h> // getpid
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/mat.hpp>
+
+#include "mts_mixture.hpp"
+#include "mts_config.hpp"
+#include "mts_basehelper.hpp"
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+using std::make_shared;
+
+using cv::Mat;
+
+// SEE mts_mixture.hpp FOR ALL DOCUMENTATION
+
+/* splitmix64: turns consecutive numbers into unrelated ones */
+static uint64_t mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+MTSMixture::MTSMixture(const vector<string> &config_files,
+        const vector<double> &weights, uint64_t seed,
+        const string &config_file)
+    : MapTextSynthesizer(),
+    recipe_base(0),
+    recipe_counter(0),
+    config_file_(config_file),
+    profile_files_(config_files),
+    config_reload_s(0),
+    config_check_ns(0)
+{
+    if (config_files.empty()) {
+        cerr << "A mixture needs at least one config profile!" << endl;
+        exit(1);
+    }
+
+    for (size_t i = 0; i < config_files.size(); i++) {
+        // everything that can be is shared with the first profile
+        profiles_.push_back(make_shared<MTSImplementation>(config_files[i],
+                    i > 0 ? profiles_[0].get() : NULL));
+    }
+
+    if (!setProfileWeights(weights)) {
+        cerr << "The profile weights don't fit the config profiles!" << endl;
+        exit(1);
+    }
+
+    setSeed(seed != 0 ? seed : ((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL));
+
+    // optional watch on the mixture's file and its profiles
+    MTSConfig config;
+    if (config_file_ != "" && config.read(config_file_)
+            && config.findParam("config_reload_s")) {
+        config_reload_s = config.getParamDouble("config_reload_s");
+    }
+    if (config_reload_s > 0) {
+        config_mtimes_ns = configMtimes();
+        config_check_ns = MTS_BaseHelper::monotonicNs()
+            + (uint64_t)(config_reload_s * 1e9);
+    }
+}
+
+MTSMixture::~MTSMixture() {}
+
+bool MTSMixture::setProfileWeights(const vector<double> &weights) {
+    if (weights.size() != profiles_.size()) {
+        return false;
+    }
+
+    vector<double> cumulative(weights.size());
+    double total = 0;
+    for (size_t i = 0; i < weights.size(); i++) {
+        if (weights[i] < 0) {
+            return false;
+        }
+        total += weights[i];
+        cumulative[i] = total;
+    }
+    if (total <= 0) {
+        return false;
+    }
+
+    cumulative_.swap(cumulative);
+    return true;
+}
+
+int MTSMixture::pickProfile() {
+    // first profile whose cumulative weight passes a uniform draw
+    double u = rng_.uniform(0.0, cumulative_.back());
+    size_t index = std::upper_bound(cumulative_.begin(), cumulative_.end(),
+            u) - cumulative_.begin();
+    return std::min(index, profiles_.size() - 1);
+}
+
+int MTSMixture::profileOfSeed(uint64_t seed) {
+    // a hash of the seed, not the seed itself, which also seeds the render
+    double u = (mix(seed ^ 0x6D6978747572650AULL) >> 11)
+        * (1.0 / 9007199254740992.0) * cumulative_.back();
+    size_t index = std::upper_bound(cumulative_.begin(), cumulative_.end(),
+            u) - cumulative_.begin();
+    return std::min(index, profiles_.size() - 1);
+}
+
+void MTSMixture::setSeed(uint64_t seed) {
+    rng_.state = seed;
+    recipe_base = seed;
+    recipe_counter = 0;
+    for (size_t i = 0; i < profiles_.size(); i++) {
+        uint64_t profile_seed = mix(seed + (i + 1) * 0x9E3779B97F4A7C15ULL);
+        profiles_[i]->setSeed(profile_seed != 0 ? profile_seed : 1);
+    }
+}
+
+void MTSMixture::setEpochShard(uint32_t shard, uint32_t shards) {
+    for (size_t i = 0; i < profiles_.size(); i++) {
+        profiles_[i]->setEpochShard(shard, shards);
+    }
+}
+
+vector<int64_t> MTSMixture::configMtimes() {
+    vector<int64_t> mtimes(1, MTS_BaseHelper::modificationTime(config_file_));
+    for (size_t i = 0; i < profile_files_.size(); i++) {
+        mtimes.push_back(MTS_BaseHelper::modificationTime(profile_files_[i]));
+    }
+    return mtimes;
+}
+
+void MTSMixture::checkConfigFiles() {
+    if (config_reload_s <= 0) {
+        return;
+    }
+    uint64_t now = MTS_BaseHelper::monotonicNs();
+    if (now < config_check_ns) {
+        return;
+    }
+    config_check_ns = now + (uint64_t)(config_reload_s * 1e9);
+
+    // a failed reload isn't retried until a file changes again
+    vector<int64_t> mtimes = configMtimes();
+    if (mtimes == config_mtimes_ns) {
+        return;
+    }
+    config_mtimes_ns = mtimes;
+    if (reloadConfig(config_file_)) {
+        cerr << "Reloaded " << config_file_ << endl;
+    }
+    // the profiles listed may have changed
+    config_mtimes_ns = configMtimes();
+}
+
+void MTSMixture::generateSample(string &caption, Mat &sample,
+        int &actual_height) {
+    checkConfigFiles();
+    profiles_[pickProfile()]->generateSample(caption, sample, actual_height);
+}
+
+void MTSMixture::generateSample(string &caption, Mat &sample,
+        int &actual_height, int min_width, int max_width) {
+    checkConfigFiles();
+    profiles_[pickProfile()]->generateSample(caption, sample, actual_height,
+            min_width, max_width);
+}
+
+void MTSMixture::generateSample(string &caption, Mat &sample,
+        int &actual_height, MTSRecipe &recipe) {
+    checkConfigFiles();
+
+    // the same seed stream as a single profile's (see MTSImplementation)
+    recipe.counter = recipe_counter++;
+    uint64_t z = mix(recipe_base + (recipe.counter + 1) * 0x9E3779B97F4A7C15ULL);
+    recipe.seed = z != 0 ? z : 1;
+
+    profiles_[profileOfSeed(recipe.seed)]->generateSeeded(recipe.seed,
+            caption, sample, actual_height, recipe);
+}
+
+bool MTSMixture::regenerate(const MTSRecipe &recipe, string &caption,
+        Mat &sample, int &actual_height) {
+    return profiles_[profileOfSeed(recipe.seed)]->regenerate(recipe, caption,
+            sample, actual_height);
+}
+
+void MTSMixture::plan(MTSPlan &plan) {
+    checkConfigFiles();
+    int profile = pickProfile();
+    profiles_[profile]->plan(plan);
+    plan.profile = profile;
+}
+
+void MTSMixture::plan(MTSPlan &plan, int min_width, int max_width) {
+    checkConfigFiles();
+    int profile = pickProfile();
+    profiles_[profile]->plan(plan, min_width, max_width);
+    plan.profile = profile;
+}
+
+void MTSMixture::render(const MTSPlan &plan, string &caption, Mat &sample,
+        int &actual_height) {
+    if (plan.profile < 0 || plan.profile >= (int)profiles_.size()) {
+        cerr << "The plan is of profile " << plan.profile
+            << ", which this synthesizer doesn't have!" << endl;
+        exit(1);
+    }
+    profiles_[plan.profile]->render(plan, caption, sample, actual_height);
+}
+
+bool MTSMixture::encodeCaption(const string &caption,
+        vector<int32_t> &label) {
+    return profiles_[0]->encodeCaption(caption, label);
+}
+
+string MTSMixture::fontCostReport() {
+    std::ostringstream report;
+    for (size_t i = 0; i < profiles_.size(); i++) {
+        report << "# profile " << i << endl << profiles_[i]->fontCostReport();
+    }
+    return report.str();
+}
+
+bool MTSMixture::reloadConfig(const string &config_file) {
+    MTSConfig config;
+    if (!config.read(config_file)) {
+        return false;
+    }
+    if (!config.findParam("profiles")) {
+        cerr << config_file << " has no profiles parameter, not reloading"
+            << endl;
+        return false;
+    }
+
+    vector<string> files;
+    vector<double> weights;
+    if (!parseProfiles(config.getParam("profiles"), files, weights)
+            || files.size() != profiles_.size()) {
+        cerr << "The profiles of " << config_file
+            << " don't fit the synthesizer, not reloading" << endl;
+        return false;
+    }
+
+    bool reloaded = true;
+    for (size_t i = 0; i < profiles_.size(); i++) {
+        reloaded = profiles_[i]->reloadConfig(files[i]) && reloaded;
+    }
+    if (config_file == config_file_) {
+        profile_files_ = files;
+        config_reload_s = config.findParam("config_reload_s") ?
+            config.getParamDouble("config_reload_s") : 0;
+    }
+    return setProfileWeights(weights) && reloaded;
+}
+
+bool MTSMixture::parseProfiles(const string &list, vector<string> &files,
+        vector<double> &weights) {
+    files.clear();
+    weights.clear();
+
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t comma = list.find(',', start);
+        if (comma == string::npos) comma = list.size();
+        string entry = MTS_BaseHelper::strip(list.substr(start, comma - start));
+        start = comma + 1;
+        if (entry.empty()) continue;
+
+        double weight = 1;
+        size_t colon = entry.rfind(':');
+        if (colon != string::npos) {
+            string number = MTS_BaseHelper::strip(entry.substr(colon + 1));
+            char *end;
+            weight = strtod(number.c_str(), &end);
+            if (number.empty() || *end != '\0' || weight < 0) {
+                cerr << "Bad weight for profile " << entry << "!" << endl;
+                return false;
+            }
+            entry = MTS_BaseHelper::strip(entry.substr(0, colon));
+        }
+        files.push_back(entry);
+        weights.push_back(weight);
+    }
+    return true;
+}
@@ -0,0 +1,98 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * mts_quantiletable.cpp contains the class method definitions for the       *
+ * MTS_QuantileTable class, tabulated beta and gamma samplers.                *
+ *                                                                            *
+ * This program is free software: you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * **/
+
+#include <vector>
+#include <stdint.h>
+
+#include <boost/math/distributions/beta.hpp>
+#include <boost/math/distributions/gamma.hpp>
+
+#include "mts_quantiletable.hpp"
+
+using std::vector;
+
+// log2 of the number of bins; 4096 bins are 32KB per table
+#define TABLE_BITS 12
+#define TABLE_SIZE (1 << TABLE_BITS)
+
+// SEE mts_quantiletable.hpp FOR ALL DOCUMENTATION
+
+MTS_QuantileTable::MTS_QuantileTable()
+    :kind_(NONE),
+    a_(0),
+    b_(0)
+{}
+
+void
+MTS_QuantileTable::build(const boost::random::beta_distribution<> &dist) {
+    kind_ = BETA;
+    a_ = dist.alpha();
+    b_ = dist.beta();
+    fill();
+}
+
+void
+MTS_QuantileTable::build(const boost::random::gamma_distribution<> &dist) {
+    kind_ = GAMMA;
+    a_ = dist.alpha();
+    b_ = dist.beta();
+    fill();
+}
+
+void
+MTS_QuantileTable::clear() {
+    kind_ = NONE;
+    vector<double>().swap(quantiles_);
+}
+
+bool
+MTS_QuantileTable::empty() const {
+    return quantiles_.empty();
+}
+
+double
+MTS_QuantileTable::quantile(double u) const {
+    if (kind_ == BETA) {
+        return boost::math::quantile(
+                boost::math::beta_distribution<>(a_, b_), u);
+    }
+    return boost::math::quantile(
+            boost::math::gamma_distribution<>(a_, b_), u);
+}
+
+void
+MTS_QuantileTable::fill() {
+    quantiles_.assign(TABLE_SIZE + 1, 0);
+    for (int k = 1; k < TABLE_SIZE; k++) {
+        quantiles_[k] = quantile((double)k / TABLE_SIZE);
+    }
+}
+
+double
+MTS_QuantileTable::lookup(uint32_t x) const {
+    uint32_t bin = x >> (32 - TABLE_BITS);
+
+    // the tails are drawn exactly, at the same u
+    if (bin == 0 || bin == TABLE_SIZE - 1) {
+        return quantile((x + 0.5) / 4294967296.0);
+    }
+
+    double frac = ((x & ((1u << (32 - TABLE_BITS)) - 1)) + 0.5)
+        / (1u << (32 - TABLE_BITS));
+    return quantiles_[bin] + frac * (quantiles_[bin + 1] - quantiles_[bin]);
+}
@@ -0,0 +1,173 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * mts_samplestore.cpp contains the class method definitions for the          *
+ * MTS_SampleStore class, a memory-mapped store of samples for replay.        *
+ *                                                                            *
+ * This program is free software: you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <opencv2/core/mat.hpp>   // cv::Mat
+
+#include "mts_samplestore.hpp"
+
+using std::string;
+using std::cerr;
+using std::endl;
+
+using cv::Mat;
+
+// SEE mts_samplestore.hpp FOR ALL DOCUMENTATION
+
+MTS_SampleStore::MTS_SampleStore(string path, uint64_t capacity,
+        uint64_t data_size) {
+
+    fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        cerr << "Could not open replay file " << path << "!" << endl;
+        exit(1);
+    }
+
+    // only one process gets to initialize a new file
+    flock(fd, LOCK_EX);
+
+    struct stat st;
+    fstat(fd, &st);
+    if (st.st_size == 0) {
+        MTS_StoreHeader init;
+        memset(&init, 0, sizeof(init));
+        memcpy(init.magic, MTS_STORE_MAGIC, sizeof(init.magic));
+        init.version = MTS_STORE_VERSION;
+        init.capacity = capacity;
+        init.data_size = data_size;
+
+        off_t size = MTS_STORE_HEADER_SIZE
+            + capacity * sizeof(MTS_StoreEntry) + data_size;
+        if (ftruncate(fd, size) != 0
+                || pwrite(fd, &init, sizeof(init), 0) != sizeof(init)) {
+            cerr << "Could not create replay file " << path << "!" << endl;
+            exit(1);
+        }
+    }
+
+    MTS_StoreHeader existing;
+    if (pread(fd, &existing, sizeof(existing), 0) != sizeof(existing)
+            || memcmp(existing.magic, MTS_STORE_MAGIC, 8) != 0
+            || existing.version != MTS_STORE_VERSION) {
+        cerr << "Replay file " << path << " is not a sample store!" << endl;
+        exit(1);
+    }
+
+    flock(fd, LOCK_UN);
+
+    map_size = MTS_STORE_HEADER_SIZE
+        + existing.capacity * sizeof(MTS_StoreEntry) + existing.data_size;
+    map = (char *)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    if (map == MAP_FAILED) {
+        cerr << "Could not map replay file " << path << "!" << endl;
+        exit(1);
+    }
+
+    header = (MTS_StoreHeader *)map;
+    entries = (MTS_StoreEntry *)(map + MTS_STORE_HEADER_SIZE);
+    data = (char *)(entries + header->capacity);
+}
+
+MTS_SampleStore::~MTS_SampleStore() {
+    munmap(map, map_size);
+    close(fd);
+}
+
+uint64_t
+MTS_SampleStore::size() {
+    uint64_t reserved = header->reserved;
+    return reserved < header->capacity ? reserved : header->capacity;
+}
+
+void
+MTS_SampleStore::append(const string &caption, const Mat &sample,
+        int actual_height) {
+
+    // cheap checks first so a full store doesn't keep claiming slots
+    if (header->reserved >= header->capacity
+            || header->data_end >= header->data_size) {
+        return;
+    }
+
+    uint64_t index = __sync_fetch_and_add(&header->reserved, 1);
+    if (index >= header->capacity) {
+        return;
+    }
+
+    uint64_t bytes = caption.size() + (uint64_t)sample.rows * sample.cols;
+    uint64_t offset = __sync_fetch_and_add(&header->data_end, bytes);
+    if (offset + bytes > header->data_size) {
+        // out of data space, this slot is never marked ready
+        return;
+    }
+
+    char *dst = data + offset;
+    memcpy(dst, caption.data(), caption.size());
+    dst += caption.size();
+    for (int row = 0; row < sample.rows; row++) {
+        memcpy(dst, sample.ptr<uchar>(row), sample.cols);
+        dst += sample.cols;
+    }
+
+    MTS_StoreEntry *entry = &entries[index];
+    entry->offset = offset;
+    entry->rows = sample.rows;
+    entry->cols = sample.cols;
+    entry->actual_height = actual_height;
+    entry->caption_len = caption.size();
+
+    // publish only once everything above is visible
+    __sync_synchronize();
+    entry->ready = 1;
+}
+
+bool
+MTS_SampleStore::read(uint64_t index, string &caption, Mat &sample,
+        int &actual_height) {
+
+    MTS_StoreEntry *entry = &entries[index];
+    if (!*(volatile uint32_t *)&entry->ready) {
+        return false;
+    }
+    __sync_synchronize();
+
+    const char *src = data + entry->offset;
+    caption.assign(src, entry->caption_len);
+    src += entry->caption_len;
+
+    // copy out, the caller owns (and may modify) the sample
+    sample.create(entry->rows, entry->cols, CV_8UC1);
+    for (uint32_t row = 0; row < entry->rows; row++) {
+        memcpy(sample.ptr<uchar>(row), src, entry->cols);
+        src += entry->cols;
+    }
+    actual_height = entry->actual_height;
+
+    return true;
+}
@@ -28,6 +28,20 @@
 #include <string>
 #include <sstream>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <fstream>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <strings.h> // strcasecmp
+
+#include <fontconfig/fontconfig.h>
+#include <pango/pangofc-fontmap.h>
 
 #include "mts_texthelper.hpp"
 
@@ -47,7 +61,8 @@ using boost::random::variate_generator;
 // SEE mts_texthelper.hpp FOR ALL DOCUMENTATION
 
 
-MTS_TextHelper::MTS_TextHelper(shared_ptr<MTS_BaseHelper> h, shared_ptr<MTSConfig> c)
+MTS_TextHelper::MTS_TextHelper(shared_ptr<MTS_BaseHelper> h, shared_ptr<MTSConfig> c,
+        const MTS_TextHelper *share)
     :helper(&(*h)),  // initialize fields
     config(&(*c)),
     spacing_dist(c->getParamDouble("spacing_alpha"),c->getParamDouble("spacing_beta")),
@@ -55,9 +70,24 @@ MTS_TextHelper::MTS_TextHelper(shared_ptr<MTS_BaseHelper> h, shared_ptr<MTSConfi
     stretch_dist(c->getParamDouble("stretch_alpha"),c->getParamDouble("stretch_beta")),
     stretch_gen(h->rng2_, stretch_dist),
     digit_len_dist(c->getParamDouble("digit_len_alpha"),c->getParamDouble("digit_len_beta")),
-    digit_len_gen(h->rng2_, digit_len_dist)
+    digit_len_gen(h->rng2_, digit_len_dist),
+    fcconfig_(NULL),
+    fontmap_(NULL),
+    fonts_uniform_(true),
+    font_max_ms(0),
+    font_cost_min_samples(20),
+    caption_table_(std::make_shared<MTS_CaptionTable>()),
+    captions_weighted_(false),
+    caption_epochs_(false),
+    caption_key_((uint64_t)c->getParamDouble("seed")),
+    caption_shard_(0),
+    caption_shards_(1),
+    caption_replay_(-1),
+    caption_max_bytes(0),
+    caption_index(-1),
+    font_index(-1)
 {
-    this->updateFontNameList(this->availableFonts_);
+    buildTables();
 
     if (config->findParam("fonts")) {
         string fontlists_str = config->getParam("fonts");
@@ -66,74 +96,775 @@ MTS_TextHelper::MTS_TextHelper(shared_ptr<MTS_BaseHelper> h, shared_ptr<MTSConfi
             cerr << "fonts parameter does not have any file in it!" << endl;
             exit(1);
         }
+
+        // pango only gets to see the fonts that are asked for
+        vector<vector<string> > font_names;
+        vector<string> families;
         for (int i=0;i<fontlists.size();i++) {
-            addFontlist(fontlists[i]);
+            font_names.push_back(helper->readLines(fontlists[i]));
+            for (size_t k = 0; k < font_names[i].size(); k++) {
+                string name;
+                double weight;
+                parseFontLine(font_names[i][k], name, weight);
+                families.push_back(name);
+            }
+        }
+        if (share != NULL && share->font_families_ == families) {
+            // same fonts, same font map (both are reference counted)
+            fcconfig_ = share->fcconfig_;
+            FcConfigReference(fcconfig_);
+            fontmap_ = share->fontmap_;
+            g_object_ref(fontmap_);
+        } else {
+            createFontMap(families);
+        }
+        font_families_ = families;
+        this->updateFontNameList(this->availableFonts_);
+
+        for (int i=0;i<font_names.size();i++) {
+            addFontlist(font_names[i]);
+        }
+
+        if (config->findParam("font_max_ms")) {
+            font_max_ms = config->getParamDouble("font_max_ms");
+        }
+        if (config->findParam("font_cost_min_samples")) {
+            font_cost_min_samples = config->getParamInt("font_cost_min_samples");
         }
     } else {
         cerr << "config file need a fonts parameter in it!" << endl;
         exit(1);
     }
 
-    if (config->findParam("captions")) {
+    // the captions of a profile with the same caption settings are shared;
+    // the filters are among them, so an adopted caption list or stream is
+    // filtered exactly as this profile would (and a reload can't change
+    // them, see MTSImplementation::reloadConfig)
+    std::ostringstream source;
+    const char *caption_params[] = { "captions", "caption_order",
+        "caption_shm", "caption_stream", "caption_stream_reservoir",
+        "caption_stream_turnover", "charset", "caption_max_bytes" };
+    for (size_t i = 0; i < sizeof(caption_params) / sizeof(char *); i++) {
+        if (config->findParam(caption_params[i])) {
+            source << caption_params[i] << "="
+                << config->getParam(caption_params[i]) << "\n";
+        }
+    }
+    caption_source_ = source.str();
+    bool adopt = share != NULL && share->caption_source_ == caption_source_;
+
+    // optional caption filters, applied while the caption lists load
+    if (adopt) {
+        charset = share->charset;
+    } else if (config->findParam("charset")
+            && config->getParam("charset")!="") {
+        charset = std::make_shared<MTS_Charset>(config->getParam("charset"));
+    }
+    if (charset) {
+        if (config->getParamDouble("digit_prob") > 0
+                && !charset->covers("0123456789")) {
+            cerr << "digit_prob is set but the charset lacks digits!" << endl;
+            exit(1);
+        }
+    }
+    if (config->findParam("caption_max_bytes")) {
+        caption_max_bytes = config->getParamInt("caption_max_bytes");
+        if (caption_max_bytes > 0 && config->getParamDouble("digit_prob") > 0
+                && config->getParamInt("digit_len_max") > caption_max_bytes) {
+            cerr << "digit_len_max is above caption_max_bytes!" << endl;
+            exit(1);
+        }
+    }
+
+    if (adopt) {
+        caption_stream_ = share->caption_stream_;
+        caption_table_ = share->caption_table_;
+        caption_segments_ = share->caption_segments_;
+        segment_cumulative_ = share->segment_cumulative_;
+        captions_weighted_ = share->captions_weighted_;
+        caption_epochs_ = share->caption_epochs_;
+        caption_key_ = share->caption_key_;
+    } else if (config->findParam("caption_stream")
+            && config->getParam("caption_stream") != "") {
+        vector<string> stream_files =
+            helper->tokenize(config->getParam("caption_stream"), ",");
+        size_t reservoir = config->findParam("caption_stream_reservoir") ?
+            config->getParamInt("caption_stream_reservoir") : 100000;
+        double turnover = config->findParam("caption_stream_turnover") ?
+            config->getParamDouble("caption_stream_turnover") : 1;
+        // runs on the reader thread (and may outlive this helper, if the
+        // stream is shared), so it holds its own copy of the filters
+        shared_ptr<MTS_Charset> filter_charset = charset;
+        size_t max_bytes = caption_max_bytes;
+        std::function<bool(const string&)> accept =
+            [filter_charset, max_bytes](const string &caption) {
+                return (max_bytes == 0 || caption.size() <= max_bytes)
+                    && (!filter_charset || filter_charset->covers(caption));
+            };
+        caption_stream_ = std::make_shared<MTS_CaptionStream>(stream_files,
+                reservoir, turnover, accept, helper->rng());
+    } else if (config->findParam("captions")) {
         string caplists_str = config->getParam("captions");
         vector<string> caplists = helper->tokenize(caplists_str,",");
         if (caplists.size()==0) {
             cerr << "captions parameter does not have any file in it!" << endl;
             exit(1);
         }
-        for (int i=0;i<caplists.size();i++) {
-            addCaptionlist(caplists[i]);
+
+        // "file" or "file: weight"; any weight makes draws go by file
+        vector<double> weights(caplists.size());
+        for (size_t i = 0; i < caplists.size(); i++) {
+            string entry = caplists[i];
+            parseFontLine(entry, caplists[i], weights[i]);
+            if (caplists[i] != MTS_BaseHelper::strip(entry)) {
+                captions_weighted_ = true;
+            }
+        }
+        if (config->findParam("caption_order")) {
+            string order = config->getParam("caption_order");
+            if (order == "epoch") {
+                caption_epochs_ = true;
+            } else if (order != "random") {
+                cerr << "caption_order must be random or epoch!" << endl;
+                exit(1);
+            }
+        }
+
+        if (config->findParam("caption_shm")
+                && config->getParam("caption_shm") != "") {
+            addSharedCaptionlists(caplists, weights,
+                    config->getParam("caption_shm"));
+        } else {
+            for (int i=0;i<caplists.size();i++) {
+                addCaptionlist(caplists[i], weights[i]);
+            }
+        }
+        if (numCaptions()==0 && (charset || caption_max_bytes > 0)) {
+            cerr << "No caption passed the charset and length filters!"
+                << endl;
+            exit(1);
         }
     } else {
-        cerr << "config file need a captions parameter in it!" << endl;
+        cerr << "config file need a captions or caption_stream parameter in it!"
+            << endl;
         exit(1);
     }
+
+    if (config->findParam("warmup") && config->getParamInt("warmup") != 0) {
+        warmup();
+    }
+}
+
+double
+MTS_TextHelper::residentMb() {
+    std::ifstream statm("/proc/self/statm");
+    long pages_total, pages_resident;
+    if (!(statm >> pages_total >> pages_resident)) {
+        return 0;
+    }
+    return pages_resident * (double)sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+/* Escapes the characters pango markup would choke on */
+static string escapeMarkup(const string &text) {
+    string escaped;
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] == '&') escaped += "&amp;";
+        else if (text[i] == '<') escaped += "&lt;";
+        else if (text[i] == '>') escaped += "&gt;";
+        else escaped += text[i];
+    }
+    return escaped;
+}
+
+void
+MTS_TextHelper::warmup() {
+
+    uint64_t start_ns = nowNs();
+    double start_mb = residentMb();
+    double max_mb = config->findParam("warmup_max_mb") ?
+        config->getParamDouble("warmup_max_mb") : 0;
+
+    // every character a caption, digit or distractor can contain
+    std::set<string> chars;
+    string extra = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ.,'";
+    for (size_t i = 0; i < extra.size(); i++) {
+        chars.insert(extra.substr(i, 1));
+    }
+    string caption;
+    for (size_t i = 0; i < numCaptions(); i++) {
+        captionAt(i, caption);
+        size_t pos = 0;
+        while (pos < caption.size()) {
+            size_t begin = pos;
+            if (MTS_Charset::decode(caption, pos) >= 0) {
+                chars.insert(caption.substr(begin, pos - begin));
+            }
+        }
+    }
+    string alphabet;
+    for (std::set<string>::iterator it = chars.begin(); it != chars.end();
+            ++it) {
+        alphabet += *it;
+    }
+    alphabet = escapeMarkup(alphabet);
+
+    // samples are drawn at the size that fits a caption's ink to the
+    // height, so a few captions spread over the list pick the sizes
+    vector<string> captions;
+    size_t num_captions = numCaptions();
+    size_t samples = min(num_captions, (size_t)4);
+    for (size_t i = 0; i < samples; i++) {
+        captionAt(i * num_captions / samples, caption);
+        captions.push_back(escapeMarkup(caption));
+    }
+    if (captions.empty()) {
+        captions.push_back(escapeMarkup(extra));
+    }
+
+    // the heights samples get rendered at, spread over the range
+    vector<int> heights;
+    if (config->findParam("output_height")
+            && config->getParamInt("output_height") > 0
+            && (!config->findParam("output_direct")
+                || config->getParamInt("output_direct") != 0)) {
+        heights.push_back(config->getParamInt("output_height"));
+    } else {
+        int height_min = config->getParamInt("height_min");
+        int height_max = config->getParamInt("height_max");
+        int buckets = config->findParam("warmup_sizes") ?
+            config->getParamInt("warmup_sizes") : 4;
+        for (int i = 0; i < buckets; i++) {
+            int height = buckets == 1 ? height_min :
+                height_min + (height_max - height_min) * i / (buckets - 1);
+            if (heights.empty() || heights.back() != height) {
+                heights.push_back(height);
+            }
+        }
+    }
+
+    // only the styles that can actually be drawn
+    vector<bool> italics(1, false);
+    if (config->getParamDouble("italic_prob") > 0) italics.push_back(true);
+    vector<int> weights;
+    double light_prob = config->getParamDouble("weight_light_prob");
+    double normal_prob = config->getParamDouble("weight_normal_prob");
+    if (light_prob > 0) weights.push_back(0);
+    if (normal_prob > 0) weights.push_back(1);
+    if (light_prob + normal_prob < 1) weights.push_back(2);
+
+    MTSTextPlan plan;
+    plan.spacing_deg = 0;
+    size_t warmed = 0;
+    for (size_t f = 0; f < fonts_.size(); f++) {
+        if (font_weights_[f] <= 0) {
+            continue;
+        }
+        if (max_mb > 0 && residentMb() - start_mb > max_mb) {
+            cerr << "Warmup stopped at warmup_max_mb after " << warmed
+                << " of " << fonts_.size() << " fonts" << endl;
+            break;
+        }
+        plan.font_index = f;
+        for (size_t i = 0; i < italics.size(); i++) {
+            plan.italic = italics[i];
+            for (size_t w = 0; w < weights.size(); w++) {
+                plan.weight = weights[w];
+                for (size_t h = 0; h < heights.size(); h++) {
+                    warmupFont(plan, alphabet, captions, heights[h]);
+                }
+            }
+        }
+        warmed++;
+    }
+
+    cerr << "Warmed up " << warmed << " fonts at " << heights.size()
+        << " sizes in " << (nowNs() - start_ns) / 1e9 << " s" << endl;
+}
+
+void
+MTS_TextHelper::warmupFont(const MTSTextPlan &plan, const string &alphabet,
+        const vector<string> &captions, int height) {
+
+    PangoFontDescription *desc;
+    double spacing;
+    applyTextPlan(plan, spacing, desc, height);
+    int nominal = pango_font_description_get_size(desc);
+
+    // the sizes generateTextPatch ends up with for these captions
+    cairo_surface_t *surface;
+    surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+    cairo_t *cr = cairo_create(surface);
+    PangoLayout *layout = createLayout(cr);
+    std::set<int> sizes;
+    int x, y, w, h, size;
+    for (size_t i = 0; i < captions.size(); i++) {
+        pango_font_description_set_size(desc, nominal);
+        pango_layout_set_font_description(layout, desc);
+        pango_layout_set_markup(layout, captions[i].c_str(), -1);
+        fitTextExtents(layout, desc, height, x, y, w, h, size);
+        sizes.insert(size);
+    }
+    g_object_unref(layout);
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+
+    for (std::set<int>::iterator it = sizes.begin(); it != sizes.end(); ++it) {
+        pango_font_description_set_size(desc, *it);
+
+        // shape first to learn how large the drawing has to be
+        surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+        cr = cairo_create(surface);
+        layout = createLayout(cr);
+        pango_layout_set_font_description(layout, desc);
+        pango_layout_set_width(layout, 40 * height * PANGO_SCALE);
+        pango_layout_set_wrap(layout, PANGO_WRAP_CHAR);
+        pango_layout_set_markup(layout, alphabet.c_str(), -1);
+        getTextExtents(layout, desc, x, y, w, h, size);
+        g_object_unref(layout);
+        cairo_destroy(cr);
+        cairo_surface_destroy(surface);
+
+        // then draw every glyph so they land in the glyph cache
+        surface = cairo_image_surface_create(CAIRO_FORMAT_A8,
+                max(1, x + w), max(1, y + h));
+        cr = cairo_create(surface);
+        layout = createLayout(cr);
+        pango_layout_set_font_description(layout, desc);
+        pango_layout_set_width(layout, 40 * height * PANGO_SCALE);
+        pango_layout_set_wrap(layout, PANGO_WRAP_CHAR);
+        pango_layout_set_markup(layout, alphabet.c_str(), -1);
+        pango_cairo_show_layout(cr, layout);
+        g_object_unref(layout);
+        cairo_destroy(cr);
+        cairo_surface_destroy(surface);
+    }
+
+    pango_font_description_free(desc);
 }
 
 MTS_TextHelper::~MTS_TextHelper(){
+    if (fontmap_ != NULL) {
+        g_object_unref(fontmap_);
+    }
+    if (fcconfig_ != NULL) {
+        FcConfigDestroy(fcconfig_);
+    }
+}
+
+void
+MTS_TextHelper::reseed() {
+    spacing_gen.engine().seed(helper->rng());
+    stretch_gen.engine().seed(helper->rng());
+    digit_len_gen.engine().seed(helper->rng());
+}
+
+void
+MTS_TextHelper::updateParams() {
+    spacing_dist = beta_distribution<>(config->getParamDouble("spacing_alpha"),
+            config->getParamDouble("spacing_beta"));
+    spacing_gen.distribution() = spacing_dist;
+    stretch_dist = beta_distribution<>(config->getParamDouble("stretch_alpha"),
+            config->getParamDouble("stretch_beta"));
+    stretch_gen.distribution() = stretch_dist;
+    digit_len_dist = gamma_distribution<>(
+            config->getParamDouble("digit_len_alpha"),
+            config->getParamDouble("digit_len_beta"));
+    digit_len_gen.distribution() = digit_len_dist;
+
+    font_max_ms = config->findParam("font_max_ms") ?
+        config->getParamDouble("font_max_ms") : 0;
+    font_cost_min_samples = config->findParam("font_cost_min_samples") ?
+        config->getParamInt("font_cost_min_samples") : 20;
+
+    buildTables();
+}
+
+void
+MTS_TextHelper::buildTables() {
+    if (config->findParam("sampler_tables")
+            && config->getParamInt("sampler_tables") != 0) {
+        spacing_table.build(spacing_dist);
+        stretch_table.build(stretch_dist);
+        digit_len_table.build(digit_len_dist);
+    } else {
+        spacing_table.clear();
+        stretch_table.clear();
+        digit_len_table.clear();
+    }
 }
 
 // SEE mts_texthelper.hpp FOR ALL DOCUMENTATION
 
+bool
+MTS_TextHelper::readFontCache(string path, const vector<string> &families,
+        unordered_map<string, vector<string> > &files) {
+
+    std::ifstream infile(path);
+    if (!infile.is_open()) {
+        return false;
+    }
+
+    string line;
+    if (!std::getline(infile, line) || line != FONT_CACHE_MAGIC) {
+        return false;
+    }
+    while (std::getline(infile, line)) {
+        // "family<TAB>file", or "family<TAB>" for a family without files
+        size_t tab = line.find('\t');
+        if (tab != string::npos) {
+            vector<string> &family_files = files[line.substr(0, tab)];
+            if (tab + 1 < line.size()) {
+                family_files.push_back(line.substr(tab + 1));
+            }
+        }
+    }
+
+    // stale if a family is missing or a file has gone away
+    for (size_t i = 0; i < families.size(); i++) {
+        unordered_map<string, vector<string> >::iterator it =
+            files.find(families[i]);
+        if (it == files.end()) {
+            return false;
+        }
+        for (size_t k = 0; k < it->second.size(); k++) {
+            struct stat st;
+            if (stat(it->second[k].c_str(), &st) != 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void
+MTS_TextHelper::writeFontCache(string path,
+        const unordered_map<string, vector<string> > &files) {
+
+    // ~/.cache may not exist yet
+    for (size_t slash = path.find('/', 1); slash != string::npos;
+            slash = path.find('/', slash + 1)) {
+        mkdir(path.substr(0, slash).c_str(), 0755);
+    }
+
+    // written aside and renamed, so readers never see half a file
+    string tmp = path + ".tmp" + std::to_string(getpid());
+    std::ofstream out(tmp);
+    if (!out.is_open()) {
+        return;
+    }
+    out << FONT_CACHE_MAGIC << "\n";
+    unordered_map<string, vector<string> >::const_iterator it;
+    for (it = files.begin(); it != files.end(); ++it) {
+        if (it->second.empty()) {
+            out << it->first << "\t\n";
+        }
+        for (size_t k = 0; k < it->second.size(); k++) {
+            out << it->first << "\t" << it->second[k] << "\n";
+        }
+    }
+    out.close();
+    if (!out || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+    }
+}
+
+/* The files fontconfig lists for a family name (all its styles) */
+static void listFontFiles(FcConfig *system, const char *family,
+        vector<string> &files) {
+    FcObjectSet *os = FcObjectSetBuild(FC_FILE, (char *)NULL);
+    FcPattern *pat = FcPatternCreate();
+    FcPatternAddString(pat, FC_FAMILY, (const FcChar8 *)family);
+    FcFontSet *set = FcFontList(system, pat, os);
+    for (int k = 0; set != NULL && k < set->nfont; k++) {
+        FcChar8 *file;
+        if (FcPatternGetString(set->fonts[k], FC_FILE, 0, &file)
+                == FcResultMatch) {
+            files.push_back((const char *)file);
+        }
+    }
+    if (set != NULL) {
+        FcFontSetDestroy(set);
+    }
+    FcPatternDestroy(pat);
+    FcObjectSetDestroy(os);
+}
+
+void
+MTS_TextHelper::findFontFiles(FcConfig *system, const string &family,
+        vector<string> &files) {
+    files.clear();
+    listFontFiles(system, family.c_str(), files);
+    if (!files.empty()) {
+        return;
+    }
+
+    // generic names are only aliases; anything else without files is
+    // missing (fontconfig would match it to some default font, too)
+    const char *generic[] = { "serif", "sans", "sans-serif", "monospace",
+        "mono", "cursive", "fantasy", "system-ui", "emoji" };
+    bool is_generic = false;
+    for (size_t i = 0; i < sizeof(generic) / sizeof(char *); i++) {
+        is_generic = is_generic || strcasecmp(family.c_str(), generic[i]) == 0;
+    }
+    if (!is_generic) {
+        return;
+    }
+
+    // the family the alias resolves to, as pango would ask for it
+    FcPattern *pat = FcPatternCreate();
+    FcPatternAddString(pat, FC_FAMILY, (const FcChar8 *)family.c_str());
+    FcConfigSubstitute(system, pat, FcMatchPattern);
+    FcDefaultSubstitute(pat);
+    FcResult result;
+    FcPattern *match = FcFontMatch(system, pat, &result);
+    FcChar8 *name;
+    if (match != NULL
+            && FcPatternGetString(match, FC_FAMILY, 0, &name) == FcResultMatch) {
+        listFontFiles(system, (const char *)name, files);
+    }
+    if (match != NULL) {
+        FcPatternDestroy(match);
+    }
+    FcPatternDestroy(pat);
+}
+
+void
+MTS_TextHelper::createFontMap(const vector<string> &families) {
+
+    // where resolved font files are remembered between runs
+    string cache_path;
+    if (config->findParam("font_cache")) {
+        cache_path = config->getParam("font_cache");
+    } else if (getenv("HOME") != NULL) {
+        cache_path = string(getenv("HOME")) + "/.cache/mtsynth-fonts.idx";
+    }
+
+    unordered_map<string, vector<string> > files;
+    bool cached = cache_path != "" && readFontCache(cache_path, families, files);
+
+    // a family cached without files may have been installed since
+    for (size_t i = 0; cached && i < families.size(); i++) {
+        cached = !files[families[i]].empty();
+    }
+
+    if (!cached) {
+        // cold start: one full fontconfig scan to find the files
+        FcConfig *system = FcInitLoadConfigAndFonts();
+        for (size_t i = 0; i < families.size(); i++) {
+            findFontFiles(system, families[i], files[families[i]]);
+        }
+        FcConfigDestroy(system);
+
+        if (cache_path != "") {
+            writeFontCache(cache_path, files);
+        }
+    }
+
+    // otherwise pango would quietly render them in some fallback font
+    for (size_t i = 0; i < families.size(); i++) {
+        if (files[families[i]].empty()) {
+            cerr << "No font files found for font family " << families[i]
+                << "!" << endl;
+            exit(1);
+        }
+    }
+
+    // the usual rules (aliases, synthetic italics, ...), but of all the
+    // fonts only the files of the configured families
+    fcconfig_ = FcConfigCreate();
+    FcConfigParseAndLoad(fcconfig_, NULL, FcTrue);
+    for (size_t i = 0; i < families.size(); i++) {
+        const vector<string> &family_files = files[families[i]];
+        for (size_t k = 0; k < family_files.size(); k++) {
+            FcConfigAppFontAddFile(fcconfig_,
+                    (const FcChar8 *)family_files[k].c_str());
+        }
+    }
+
+    fontmap_ = pango_cairo_font_map_new_for_font_type(CAIRO_FONT_TYPE_FT);
+    if (fontmap_ == NULL) {
+        cerr << "pango has no fontconfig backend!" << endl;
+        exit(1);
+    }
+    pango_fc_font_map_set_config(PANGO_FC_FONT_MAP(fontmap_), fcconfig_);
+}
+
+PangoLayout *
+MTS_TextHelper::createLayout(cairo_t *cr) {
+    // like pango_cairo_create_layout, with this helper's font map
+    PangoContext *context = pango_font_map_create_context(fontmap_);
+    pango_cairo_update_context(cr, context);
+    PangoLayout *layout = pango_layout_new(context);
+    g_object_unref(context);
+    return layout;
+}
+
 void 
-MTS_TextHelper::updateFontNameList(vector<string>& font_list) {
+MTS_TextHelper::updateFontNameList(unordered_set<string>& font_list) {
     // clear existing fonts for a fresh load of available fonts
     font_list.clear(); 
 
     PangoFontFamily ** families;
     int num_families;
-    PangoFontMap * fontmap;
 
-    fontmap = pango_cairo_font_map_get_default();
-    pango_font_map_list_families (fontmap, &families, &num_families);
+    pango_font_map_list_families (fontmap_, &families, &num_families);
 
     // iterativly add all available fonts to font_list
     for (int k = 0; k < num_families; k++) {
         PangoFontFamily * family = families[k];
         const char * family_name;
         family_name = pango_font_family_get_name (family);
-        font_list.push_back(string(family_name));
+        font_list.insert(string(family_name));
     }   
     // clean up
-    free (families);
+    g_free (families);
 }
 
 void
 MTS_TextHelper::addFontlist(vector<string>& font_list){
-    vector<string> availableList=this->availableFonts_;
-
     // loop through fonts in availableFonts_ to check if the system 
     // contains every font in the font_list
     for(size_t k = 0; k < font_list.size(); k++){
-        if(std::find(availableList.begin(), availableList.end(), font_list[k])
-                == availableList.end()){
+        string name;
+        double weight;
+        parseFontLine(font_list[k], name, weight);
+        if(availableFonts_.count(name) == 0){
             cerr << "The fonts list must only contain fonts in your system"
-                << "\n" << font_list[k] << " is not in your system\n";
+                << "\n" << name << " is not in your system\n";
             exit(1);
         }
+        // add the available font into fonts_
+        this->fonts_.push_back(name);
+        this->font_weights_.push_back(weight);
+        this->font_costs_.push_back(MTS_FontCost());
+        if (weight != 1) {
+            fonts_uniform_ = false;
+        }
+    }
+    updateFontCumulative();
+}
+
+void
+MTS_TextHelper::parseFontLine(const string &line, string &name,
+        double &weight) {
+    // "Family Name" or "Family Name: weight"
+    weight = 1;
+    name = MTS_BaseHelper::strip(line);
+    size_t colon = name.rfind(':');
+    if (colon == string::npos) {
+        return;
+    }
+    string number = MTS_BaseHelper::strip(name.substr(colon + 1));
+    char *end;
+    double value = strtod(number.c_str(), &end);
+    if (number.empty() || *end != '\0') {
+        return; // a colon in the family name
+    }
+    if (value < 0) {
+        cerr << "Negative weight for " << name << "!" << endl;
+        exit(1);
+    }
+    weight = value;
+    name = MTS_BaseHelper::strip(name.substr(0, colon));
+}
+
+void
+MTS_TextHelper::updateFontCumulative() {
+    font_cumulative_.resize(fonts_.size());
+    double total = 0;
+    for (size_t i = 0; i < fonts_.size(); i++) {
+        total += font_weights_[i];
+        font_cumulative_[i] = total;
+    }
+}
+
+int
+MTS_TextHelper::pickFont() {
+    if (fonts_uniform_) {
+        return helper->rng()%fonts_.size();
+    }
+
+    double total = font_cumulative_.back();
+    if (total <= 0) {
+        cerr << "Every font has weight 0!" << endl;
+        exit(1);
+    }
+    // first font whose cumulative weight passes a uniform draw
+    double u = helper->rng() / 4294967296.0 * total;
+    size_t index = std::upper_bound(font_cumulative_.begin(),
+            font_cumulative_.end(), u) - font_cumulative_.begin();
+    return min(index, fonts_.size() - 1);
+}
+
+uint64_t
+MTS_TextHelper::nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+MTS_TextHelper::recordFontCost(int index, uint64_t layout_ns,
+        uint64_t raster_ns) {
+
+    MTS_FontCost &cost = font_costs_.at(index);
+    double total_ms = (layout_ns + raster_ns) / 1e6;
+    cost.samples++;
+    cost.layout_ms += layout_ns / 1e6;
+    cost.raster_ms += raster_ns / 1e6;
+    if (total_ms > cost.max_ms) {
+        cost.max_ms = total_ms;
+    }
+
+    // drop a font from the draw once it is reliably over the cap, unless
+    // nothing else would be left
+    if (font_max_ms > 0 && !cost.excluded
+            && cost.samples >= font_cost_min_samples
+            && (cost.layout_ms + cost.raster_ms) / cost.samples > font_max_ms
+            && font_cumulative_.back() > font_weights_[index]) {
+        cost.excluded = true;
+        font_weights_[index] = 0;
+        fonts_uniform_ = false;
+        updateFontCumulative();
+        cerr << "Excluding font " << fonts_[index] << " (over "
+            << font_max_ms << " ms per sample)" << endl;
+    }
+}
+
+string
+MTS_TextHelper::fontCostReport() {
+
+    vector<size_t> order;
+    for (size_t i = 0; i < fonts_.size(); i++) {
+        if (font_costs_[i].samples > 0) {
+            order.push_back(i);
+        }
     }
-    // add the available fonts into fonts_
-    this->fonts_.insert(this->fonts_.end(),font_list.begin(),font_list.end());
+    // slowest first, by mean time per sample
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+        const MTS_FontCost &x = font_costs_[a], &y = font_costs_[b];
+        return (x.layout_ms + x.raster_ms) / x.samples
+            > (y.layout_ms + y.raster_ms) / y.samples;
+    });
+
+    std::ostringstream report;
+    report << "rank\tsamples\tlayout_ms\traster_ms\tmean_ms\tmax_ms\tweight"
+        << "\tfont" << endl;
+    report.setf(std::ios::fixed);
+    report.precision(3);
+    for (size_t r = 0; r < order.size(); r++) {
+        const MTS_FontCost &cost = font_costs_[order[r]];
+        report << r + 1 << "\t" << cost.samples
+            << "\t" << cost.layout_ms / cost.samples
+            << "\t" << cost.raster_ms / cost.samples
+            << "\t" << (cost.layout_ms + cost.raster_ms) / cost.samples
+            << "\t" << cost.max_ms
+            << "\t" << font_weights_[order[r]]
+            << "\t" << fonts_[order[r]]
+            << (cost.excluded ? " (excluded)" : "") << endl;
+    }
+    return report.str();
 }
 
 void
@@ -143,14 +874,329 @@ MTS_TextHelper::addFontlist(string font_file){
 }
 
 void
-MTS_TextHelper::addCaptionlist(vector<string>& words) {
-    this->captions_.insert(this->captions_.end(),words.begin(),words.end());
+MTS_TextHelper::addCaptionlist(vector<string>& words, double weight) {
+
+    // drop what could never be used, before anything gets rendered
+    vector<string> &captions = caption_table_->captions;
+    size_t begin = captions.size();
+    size_t dropped = 0;
+    for (size_t i = 0; i < words.size(); i++) {
+        if ((caption_max_bytes > 0 && words[i].size() > caption_max_bytes)
+                || (charset && !charset->covers(words[i]))) {
+            dropped++;
+        } else {
+            captions.push_back(words[i]);
+        }
+    }
+    if (dropped > 0) {
+        cerr << "Dropped " << dropped << " of " << words.size()
+            << " captions (too long or outside the charset)" << endl;
+    }
+
+    addCaptionSegment(-1, begin, captions.size() - begin, weight);
 }
 
 void
-MTS_TextHelper::addCaptionlist(string caption_file){
+MTS_TextHelper::addCaptionlist(string caption_file, double weight){
+    if (MTS_CaptionStore::isStore(caption_file)) {
+        if (charset || caption_max_bytes > 0) {
+            // filtered into a store of its own, named after what it holds
+            std::ostringstream path;
+            path << "/dev/shm/mtsynth-captions-" << std::hex
+                << captionSourceKey(caption_file);
+            addFilteredStore(caption_file, path.str(), weight);
+        } else {
+            addCaptionStore(caption_file, weight);
+        }
+        return;
+    }
     vector<string> captions = helper->readLines(caption_file);
-    addCaptionlist(captions);
+    addCaptionlist(captions, weight);
+}
+
+void
+MTS_TextHelper::addCaptionStore(string store_file, double weight) {
+    shared_ptr<MTS_CaptionStore> store =
+        std::make_shared<MTS_CaptionStore>(store_file);
+    caption_table_->stores.push_back(store);
+    addCaptionSegment(caption_table_->stores.size() - 1, 0, store->size(),
+            weight);
+}
+
+uint64_t
+MTS_TextHelper::captionSourceKey(const string &caption_file) {
+
+    // anything that changes what the filtered list holds changes the key
+    std::ostringstream source;
+    source << caption_max_bytes;
+    struct stat st;
+    if (charset && stat(config->getParam("charset").c_str(), &st) == 0) {
+        source << "\n" << config->getParam("charset") << "\t" << st.st_size
+            << "\t" << st.st_mtime;
+    }
+    if (stat(caption_file.c_str(), &st) != 0) {
+        cerr << "Could not open " << caption_file << endl;
+        exit(1);
+    }
+    source << "\n" << caption_file << "\t" << st.st_size << "\t"
+        << st.st_mtime;
+
+    // FNV-1a, never 0 (the key of stores built by mts-captions)
+    string text = source.str();
+    uint64_t key = 14695981039346656037ULL;
+    for (size_t k = 0; k < text.size(); k++) {
+        key = (key ^ (unsigned char)text[k]) * 1099511628211ULL;
+    }
+    return key != 0 ? key : 1;
+}
+
+void
+MTS_TextHelper::addFilteredStore(const string &caption_file,
+        const string &path, double weight) {
+
+    uint64_t key = captionSourceKey(caption_file);
+
+    // the first process in builds the store, the others wait and map it
+    string lock_path = path + ".lock";
+    int lock = open(lock_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (lock == -1) {
+        cerr << "Could not open " << lock_path << "!" << endl;
+        exit(1);
+    }
+    flock(lock, LOCK_EX);
+
+    bool current = false;
+    if (MTS_CaptionStore::isStore(path)) {
+        MTS_CaptionStore existing(path);
+        current = existing.key() == key;
+    }
+    if (!current) {
+        // filtered as addCaptionlist would, but only the store is kept
+        vector<string> words;
+        if (MTS_CaptionStore::isStore(caption_file)) {
+            MTS_CaptionStore source(caption_file);
+            words.resize(source.size());
+            for (uint64_t k = 0; k < source.size(); k++) {
+                uint32_t length;
+                const char *text = source.get(k, length);
+                words[k].assign(text, length);
+            }
+        } else {
+            words = helper->readLines(caption_file);
+        }
+        vector<string> kept;
+        for (size_t k = 0; k < words.size(); k++) {
+            if ((caption_max_bytes == 0
+                        || words[k].size() <= caption_max_bytes)
+                    && (!charset || charset->covers(words[k]))) {
+                kept.push_back(words[k]);
+            }
+        }
+        if (kept.size() < words.size()) {
+            cerr << "Dropped " << words.size() - kept.size() << " of "
+                << words.size()
+                << " captions (too long or outside the charset)" << endl;
+        }
+        if (MTS_CaptionStore::build(path, kept, key) < 0) {
+            cerr << "Could not write caption table " << path << "!" << endl;
+            exit(1);
+        }
+    }
+    addCaptionStore(path, weight);
+
+    flock(lock, LOCK_UN);
+    close(lock);
+}
+
+void
+MTS_TextHelper::addSharedCaptionlists(const vector<string> &caption_files,
+        const vector<double> &weights, string shm_name) {
+
+    while (shm_name.size() > 0 && shm_name[0] == '/') {
+        shm_name.erase(0, 1);
+    }
+
+    for (size_t i = 0; i < caption_files.size(); i++) {
+        if (MTS_CaptionStore::isStore(caption_files[i])
+                && !charset && caption_max_bytes == 0) {
+            // already shared
+            addCaptionStore(caption_files[i], weights[i]);
+            continue;
+        }
+        std::ostringstream path;
+        path << "/dev/shm/" << shm_name << "-" << i;
+        addFilteredStore(caption_files[i], path.str(), weights[i]);
+    }
+}
+
+void
+MTS_TextHelper::addCaptionSegment(int store, size_t begin, size_t count,
+        double weight) {
+    if (count == 0) {
+        return;
+    }
+
+    MTS_CaptionSegment segment;
+    segment.store = store;
+    segment.begin = begin;
+    segment.count = count;
+    segment.first = numCaptions();
+    segment.weight = weight;
+    caption_segments_.push_back(segment);
+    caption_table_->epoch_positions.assign(caption_segments_.size() + 1, 0);
+
+    segment_cumulative_.push_back((segment_cumulative_.empty() ? 0 :
+                segment_cumulative_.back()) + weight);
+
+    // rebuilt on next use
+    this->captions_by_length_.clear();
+}
+
+size_t
+MTS_TextHelper::numCaptions() const {
+    if (caption_segments_.empty()) {
+        return 0;
+    }
+    const MTS_CaptionSegment &last = caption_segments_.back();
+    return last.first + last.count;
+}
+
+const MTS_CaptionSegment &
+MTS_TextHelper::segmentOf(size_t index) const {
+    // the last segment starting at or before index
+    vector<MTS_CaptionSegment>::const_iterator it = std::upper_bound(
+            caption_segments_.begin(), caption_segments_.end(), index,
+            [](size_t i, const MTS_CaptionSegment &segment) {
+                return i < segment.first;
+            });
+    return *(it - 1);
+}
+
+void
+MTS_TextHelper::captionAt(size_t index, string &caption) const {
+    const MTS_CaptionSegment &segment = segmentOf(index);
+    size_t local = index - segment.first;
+    if (segment.store < 0) {
+        caption = caption_table_->captions[segment.begin + local];
+        return;
+    }
+    uint32_t length;
+    const char *text = caption_table_->stores[segment.store]->get(local,
+            length);
+    // reuses the caption's buffer when it is big enough
+    caption.assign(text, length);
+}
+
+int
+MTS_TextHelper::captionChars(size_t index) const {
+    const MTS_CaptionSegment &segment = segmentOf(index);
+    size_t local = index - segment.first;
+    if (segment.store < 0) {
+        return charCount(caption_table_->captions[segment.begin + local]);
+    }
+    return caption_table_->stores[segment.store]->charCount(local);
+}
+
+size_t
+MTS_TextHelper::pickSegment() {
+    double total = segment_cumulative_.back();
+    if (total <= 0) {
+        cerr << "Every caption file has weight 0!" << endl;
+        exit(1);
+    }
+    // first segment whose cumulative weight passes a uniform draw
+    double u = helper->rng() / 4294967296.0 * total;
+    size_t index = std::upper_bound(segment_cumulative_.begin(),
+            segment_cumulative_.end(), u) - segment_cumulative_.begin();
+    return min(index, caption_segments_.size() - 1);
+}
+
+size_t
+MTS_TextHelper::pickCaption() {
+    if (!captions_weighted_) {
+        size_t num_captions = numCaptions();
+        if (!caption_epochs_) {
+            return helper->rng() % num_captions;
+        }
+        if (caption_replay_ >= 0 && (size_t)caption_replay_ < num_captions) {
+            return caption_replay_;
+        }
+        uint64_t position = caption_table_->epoch_positions[0]++
+            * caption_shards_ + caption_shard_;
+        return epochIndex(caption_key_, position, num_captions, 0);
+    }
+
+    size_t index = pickSegment();
+    const MTS_CaptionSegment &segment = caption_segments_[index];
+    if (!caption_epochs_) {
+        return segment.first + helper->rng() % segment.count;
+    }
+    // the segment is still drawn, so the rest of the sample is the same
+    if (caption_replay_ >= 0 && (size_t)caption_replay_ < numCaptions()) {
+        return caption_replay_;
+    }
+    uint64_t position = caption_table_->epoch_positions[index + 1]++
+        * caption_shards_ + caption_shard_;
+    return segment.first
+        + epochIndex(caption_key_, position, segment.count, index + 1);
+}
+
+size_t
+MTS_TextHelper::epochIndex(uint64_t key, uint64_t position, size_t n,
+        uint64_t stream) {
+    // a fresh permutation every epoch, and one per segment
+    uint64_t epoch = position / n;
+    uint64_t epoch_key = key ^ (stream * 0x9E3779B97F4A7C15ULL)
+        ^ (epoch * 0xD1B54A32D192ED03ULL);
+    return permuteIndex(position % n, n, epoch_key);
+}
+
+uint64_t
+MTS_TextHelper::permuteIndex(uint64_t index, uint64_t n, uint64_t key) {
+    if (n <= 1) {
+        return 0;
+    }
+
+    int bits = 0;
+    while (bits < 64 && (1ULL << bits) < n) bits++;
+    int half = (bits + 1) / 2;
+    uint64_t mask = (1ULL << half) - 1;
+
+    // the domain is under 4n, so only a few walks are needed on average
+    uint64_t x = index;
+    do {
+        uint64_t left = x >> half, right = x & mask;
+        for (uint64_t round = 0; round < 4; round++) {
+            // splitmix64 of (right, key, round) as the round function
+            uint64_t z = right + key + (round + 1) * 0x9E3779B97F4A7C15ULL;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            z ^= z >> 31;
+            uint64_t next = left ^ (z & mask);
+            left = right;
+            right = next;
+        }
+        x = (left << half) | right;
+    } while (x >= n);
+    return x;
+}
+
+void
+MTS_TextHelper::setEpochShard(uint32_t shard, uint32_t shards) {
+    if (shards == 0 || shard >= shards) {
+        cerr << "Epoch shard " << shard << " of " << shards
+            << " doesn't exist!" << endl;
+        exit(1);
+    }
+    caption_shard_ = shard;
+    caption_shards_ = shards;
+    vector<uint64_t> &positions = caption_table_->epoch_positions;
+    std::fill(positions.begin(), positions.end(), 0);
+}
+
+void
+MTS_TextHelper::replayCaption(int index) {
+    caption_replay_ = index;
 }
 
 void 
@@ -158,7 +1204,7 @@ MTS_TextHelper::generateFont(char *font, int fontsize){
 
     // Select the font to use for the sample
     const char *font_name;
-    font_name = fonts_.at(helper->rng()%fonts_.size()).c_str();
+    font_name = fonts_.at(pickFont()).c_str();
     strcpy(font,font_name);
 
     //set probability of being Italic
@@ -175,11 +1221,7 @@ MTS_TextHelper::generateFont(char *font, int fontsize){
 }
 
 void
-MTS_TextHelper::generateFeatures(double &rotated_angle, bool &curved,
-        double &spacing_deg, double &spacing,
-        double &stretch_deg, int &x_pad, int &y_pad,
-        double &scale, PangoFontDescription *&desc,
-        int height) {
+MTS_TextHelper::planText(MTSTextPlan &plan) {
 
     // if determined by probability of rotation, set rotated angle
     if (helper->rndProbUnder(config->getParamDouble("rotate_prob"))){
@@ -187,31 +1229,15 @@ MTS_TextHelper::generateFeatures(double &rotated_angle, bool &curved,
         int max_deg = config->getParamInt("rotate_degree_max");
         int degree = helper->rndBetween(min_deg, max_deg);
         // set the angle based on the user config params
-        rotated_angle=((double)degree / 180) * M_PI;
+        plan.rotated_angle=((double)degree / 180) * M_PI;
     } else {
-        rotated_angle= 0;
+        plan.rotated_angle= 0;
     }
 
     double curvingProb=config->getParamDouble("curve_prob");
 
     // set probability of being curved
-    if(helper->rndProbUnder(curvingProb)){
-        curved = true;
-    }
-
-    // get pango's default font map to get the resolution
-    PangoCairoFontMap *fontmap;
-    fontmap = (PangoCairoFontMap *)pango_cairo_font_map_get_default();
-    //dpi unit : pixel / inch
-    double dpi = pango_cairo_font_map_get_resolution(fontmap);
-
-    //ppi (point per inch) unit : point / inch
-    double ppi = 72.0;
-
-    //height unit : pixel
-    //font_size unit : point
-    //point = pixel / (pixel/inch) * (point/inch)
-    double font_size = (double)height / dpi * ppi;
+    plan.curved = helper->rndProbUnder(curvingProb);
 
     double spacingProb=config->getParamDouble("spacing_prob");
     double stretchProb=config->getParamDouble("stretch_prob");
@@ -224,41 +1250,35 @@ MTS_TextHelper::generateFeatures(double &rotated_angle, bool &curved,
 
         // get and set spacing between characters
         // spacing_deg unit : null, pure number factor
-        spacing_deg = round((spacing_scale*spacing_gen()+spacing_shift)*100)/100;
-
-        //spacing unit : point
-        //point = point * pure number 
-        spacing = font_size * spacing_deg;
+        plan.spacing_deg = round((spacing_scale*spacing_table.draw(spacing_gen)+spacing_shift)*100)/100;
     } else {
-        spacing_deg = 0;
-        spacing = 0;
+        plan.spacing_deg = 0;
     }
 
     // set probability of stretch 
     if(helper->rndProbUnder(stretchProb)){
         double stretch_scale = config->getParamDouble("stretch_scale");
         double stretch_shift = config->getParamDouble("stretch_shift");
-        stretch_deg = round((stretch_scale*stretch_gen()+stretch_shift)*100)/100;
+        plan.stretch_deg = round((stretch_scale*stretch_table.draw(stretch_gen)+stretch_shift)*100)/100;
     } else {
-        stretch_deg = 1;
+        plan.stretch_deg = 1;
     }
 
     // set up text padding based on user config params
     double pad_max = config->getParamDouble("pad_max");
     double pad_min = config->getParamDouble("pad_min");
 
-    x_pad = helper->rndBetween(pad_min,pad_max);
-    y_pad = helper->rndBetween(pad_min,pad_max);
+    plan.x_pad = helper->rndBetween(pad_min,pad_max);
+    plan.y_pad = helper->rndBetween(pad_min,pad_max);
 
     // scale the text
     double scale_max = config->getParamDouble("scale_max");
     double scale_min = config->getParamDouble("scale_min");
-    scale = helper->rndBetween(scale_min,scale_max); 
-    char font[50];
-    generateFont(font,(int)font_size);
+    plan.scale = helper->rndBetween(scale_min,scale_max); 
 
-    //set font destcription
-    desc = pango_font_description_from_string(font);
+    // Select the font to use for the sample
+    plan.font_index = pickFont();
+    plan.italic = helper->rndProbUnder(config->getParamDouble("italic_prob"));
 
     //set text weight
     double light_prob = config->getParamDouble("weight_light_prob");
@@ -266,13 +1286,52 @@ MTS_TextHelper::generateFeatures(double &rotated_angle, bool &curved,
     int weight_prob = helper->rng()%10000;
 
     if(weight_prob < 10000*light_prob){
-        pango_font_description_set_weight(desc, PANGO_WEIGHT_LIGHT);
+        plan.weight = 0;
     } else if(weight_prob < 10000*(light_prob+normal_prob)){
-        pango_font_description_set_weight(desc, PANGO_WEIGHT_NORMAL);
+        plan.weight = 1;
     } else {
-        pango_font_description_set_weight(desc, PANGO_WEIGHT_BOLD);
+        plan.weight = 2;
     }
+}
 
+void
+MTS_TextHelper::applyTextPlan(const MTSTextPlan &plan, double &spacing,
+        PangoFontDescription *&desc, int height) {
+
+    // get pango's default font map to get the resolution
+    PangoCairoFontMap *fontmap;
+    fontmap = PANGO_CAIRO_FONT_MAP(fontmap_);
+    //dpi unit : pixel / inch
+    double dpi = pango_cairo_font_map_get_resolution(fontmap);
+
+    //ppi (point per inch) unit : point / inch
+    double ppi = 72.0;
+
+    //height unit : pixel
+    //font_size unit : point
+    //point = pixel / (pixel/inch) * (point/inch)
+    double font_size = (double)height / dpi * ppi;
+
+    //spacing unit : point
+    //point = point * pure number 
+    spacing = font_size * plan.spacing_deg;
+
+    // font + italic + size, e.g. "Serif Italic 24"
+    std::ostringstream font;
+    font << fonts_.at(plan.font_index);
+    if (plan.italic) {
+        font << " Italic";
+    }
+    font << " " << (int)font_size;
+    font_index = plan.font_index;
+
+    //set font destcription
+    desc = pango_font_description_from_string(font.str().c_str());
+
+    //set text weight
+    PangoWeight weights[3] = {PANGO_WEIGHT_LIGHT, PANGO_WEIGHT_NORMAL,
+        PANGO_WEIGHT_BOLD};
+    pango_font_description_set_weight(desc, weights[plan.weight]);
 }
 
 void
@@ -291,6 +1350,23 @@ MTS_TextHelper::getTextExtents(PangoLayout *layout, PangoFontDescription *desc,
     size = pango_font_description_get_size(desc);
 }
 
+void
+MTS_TextHelper::fitTextExtents(PangoLayout *layout, PangoFontDescription *desc,
+        int height, int &x, int &y, int &w, int &h, int &size) {
+    getTextExtents(layout, desc, x, y, w, h, size);
+    if (h <= 0) {
+        return;
+    }
+
+    //adjust the font size according to image height and text ink height
+    //point = point / pixel * pixel
+    size = (int)((double)size/h*height);
+    pango_font_description_set_size(desc, size);
+    pango_layout_set_font_description (layout, desc);
+
+    getTextExtents(layout, desc, x, y, w, h, size);
+}
+
 void get_normal_vector(cairo_path_t *path, double x_exp, double &x, double &y, double &rad) {
 
     cairo_path_data_t *data;
@@ -421,6 +1497,7 @@ MTS_TextHelper::create_curved_text(cairo_t *cr, PangoLayout *layout,
     cairo_translate(cr,-4*height,0);
     cairo_append_path(cr,path);
     cairo_translate(cr,4*height,0);
+    cairo_path_destroy(path);
     path = cairo_copy_path_flat(cr);
     cairo_new_path(cr);
 
@@ -469,6 +1546,7 @@ MTS_TextHelper::create_curved_text(cairo_t *cr, PangoLayout *layout,
         cairo_restore(cr);
         if (path_so_far != NULL) {
             cairo_append_path(cr, path_so_far);
+            cairo_path_destroy(path_so_far);
         }
         path_so_far = cairo_copy_path(cr);
         cairo_path_destroy(tmp_path);
@@ -522,15 +1600,17 @@ MTS_TextHelper::create_curved_text_deformed(cairo_t *cr,
     //clean up
     cairo_path_destroy(path_tmp);
     cairo_restore(cr);
+    cairo_path_destroy(path);
     path = NULL;
 }
 
 
 void 
 MTS_TextHelper::generateTextPatch(cairo_surface_t *&text_surface,
-        string caption,int height,int &width,
+        string caption, const MTSTextPlan &plan, int height, int &width,
         int text_color, bool distract){
 
+    uint64_t start_ns = nowNs();
 
     int len = caption.length();
 
@@ -545,18 +1625,17 @@ MTS_TextHelper::generateTextPatch(cairo_surface_t *&text_surface,
     PangoLayout *layout;
     PangoFontDescription *desc;
 
-    layout = pango_cairo_create_layout (cr);
+    layout = createLayout(cr);
 
     // text attributes
-    double rotated_angle;
-    bool curved;
+    double rotated_angle = plan.rotated_angle;
+    bool curved = plan.curved;
     //units: pure number, point, pure number
-    double spacing_deg, spacing, stretch_deg;
-    int x_pad, y_pad;
-    double scale;
+    double spacing_deg = plan.spacing_deg, spacing, stretch_deg = plan.stretch_deg;
+    int x_pad = plan.x_pad, y_pad = plan.y_pad;
+    double scale = plan.scale;
 
-    generateFeatures(rotated_angle, curved, spacing_deg, spacing, stretch_deg,
-            x_pad, y_pad, scale, desc, height);
+    applyTextPlan(plan, spacing, desc, height);
 
     int point_num_max=len / config->getParamInt("curve_min_char_num_per_point");
     if (point_num_max < 2) {
@@ -582,16 +1661,8 @@ MTS_TextHelper::generateTextPatch(cairo_surface_t *&text_surface,
     // units : pixel, pixel, pixel, pixel, point 
     int text_x, text_y, text_w, text_h, size; 
 
-    getTextExtents(layout, desc, text_x, text_y, text_w, text_h, size);
-
-    //adjust the font size according to image height and text ink height
-    //point = point / pixel * pixel
-    size = (int)((double)size/text_h*height);
-
-    pango_font_description_set_size(desc, size);
-    pango_layout_set_font_description (layout, desc);
-
-    getTextExtents(layout, desc, text_x, text_y, text_w, text_h, size);
+    fitTextExtents(layout, desc, height, text_x, text_y, text_w, text_h, size);
+    uint64_t layout_ns = nowNs() - start_ns;
 
     // pixel = pure number * pixel
     text_w = stretch_deg * (text_w);
@@ -693,6 +1764,7 @@ MTS_TextHelper::generateTextPatch(cairo_surface_t *&text_surface,
         cairo_append_path(cr, path_n);
         cairo_translate(cr, x1, y1);
         // copy the path out
+        cairo_path_destroy(path_n);
         path_n=cairo_copy_path(cr);
 
         if (path != NULL) {
@@ -701,6 +1773,7 @@ MTS_TextHelper::generateTextPatch(cairo_surface_t *&text_surface,
             cairo_append_path(cr, path);
             cairo_translate(cr, x1, y1);
             // copy the path out
+            cairo_path_destroy(path);
             path=cairo_copy_path(cr);
 
             cairo_new_path(cr);
@@ -730,6 +1803,7 @@ MTS_TextHelper::generateTextPatch(cairo_surface_t *&text_surface,
         if (path != NULL) {
             cairo_append_path(cr,path);
             cairo_restore(cr);
+            cairo_path_destroy(path);
             path=cairo_copy_path(cr);
             cairo_new_path(cr);
             cairo_scale(cr,height_ratio,height_ratio);
@@ -781,14 +1855,14 @@ MTS_TextHelper::generateTextPatch(cairo_surface_t *&text_surface,
         cairo_append_path(cr_n,path);
         double cx1,cy1,cx2,cy2;
         cairo_path_extents(cr_n, &cx1, &cy1, &cx2, &cy2);
-        path = cairo_copy_path(cr_n);
+        cairo_path_t *line_path = cairo_copy_path(cr_n);
         cairo_new_path(cr_n);
 
         double curve_y = helper->rndBetween(0.0,height+(cy2-cy1));
         cairo_translate(cr_n,0,curve_y);
         cairo_translate(cr_n,0,-cy2);
 
-        cairo_append_path(cr_n,path);
+        cairo_append_path(cr_n,line_path);
 
         double width_min = config->getParamDouble("curve_line_width_min");
         double width_max = config->getParamDouble("curve_line_width_max");
@@ -796,6 +1870,9 @@ MTS_TextHelper::generateTextPatch(cairo_surface_t *&text_surface,
         cairo_set_line_width(cr_n, linewidth);
         cairo_stroke(cr_n);
         cairo_restore(cr_n);
+        cairo_path_destroy(line_path);
+    }
+    if (path != NULL) {
         cairo_path_destroy(path);
     }
 
@@ -805,6 +1882,9 @@ MTS_TextHelper::generateTextPatch(cairo_surface_t *&text_surface,
     cairo_fill(cr_n);
     cairo_surface_destroy(surface);
 
+    // the main text is done, the rest doesn't depend on its font
+    recordFontCost(plan.font_index, layout_ns, nowNs() - start_ns - layout_ns);
+
     // set drawing color to the grey-scale text color
     double grey_scale = text_color/255.0;
     cairo_set_source_rgb(cr_n, grey_scale, grey_scale, grey_scale);
@@ -848,17 +1928,17 @@ MTS_TextHelper::generateTextPatch(cairo_surface_t *&text_surface,
 }
 
 
-void 
-MTS_TextHelper::generateTextSample (string &caption,
-        cairo_surface_t *&text_surface, int height, 
-        int &width, int text_color, bool distract) {
+void
+MTS_TextHelper::planCaption (string &caption) {
+
+    caption_index = -1;
 
     // determine if the text generated will be a string of digits 
     if (helper->rndProbUnder(config->getParamDouble("digit_prob"))) {
         // generate digits
         caption = "";
         // set the max length of the digit string
-        int digit_len = (int)ceil(1/digit_len_gen());
+        int digit_len = (int)ceil(1/digit_len_table.draw(digit_len_gen));
         int max_len = config->getParamInt("digit_len_max");
         if (digit_len > max_len) digit_len = max_len; // verify len is below max
 
@@ -867,17 +1947,148 @@ MTS_TextHelper::generateTextSample (string &caption,
             caption+=randomDigit();
         }
     } else {
-        if(captions_.size() != 0){
-            // if sample captions provided select one randomly and generate text
-            caption = captions_.at(helper->rng() % captions_.size());
+        size_t num_captions = numCaptions();
+        if (caption_stream_) {
+            caption_stream_->draw(helper->rng(), caption);
+            caption_index = MTS_CAPTION_STREAMED;
+        } else if(num_captions != 0){
+            // if sample captions provided select one and generate text
+            caption_index = pickCaption();
+            captionAt(caption_index, caption);
         } else {
             // if no sample captions, generate generic text
             caption = "MapTextSynthesizer";
         }
     }
+}
+
+int
+MTS_TextHelper::charCount(const string &text) {
+    // count everything but utf-8 continuation bytes
+    int count = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        if (((unsigned char)text[i] & 0xC0) != 0x80) count++;
+    }
+    return count;
+}
+
+void
+MTS_TextHelper::planCaptionNear(string &caption, double length) {
+
+    // swapping captions would break the once-per-epoch coverage, so the
+    // planned caption stays (only its stretch gets adjusted)
+    if (caption_epochs_) {
+        return;
+    }
+
+    caption_index = -1;
+    int len = max(1, (int)round(length));
+
+    // keep the usual share of digit captions
+    if (helper->rndProbUnder(config->getParamDouble("digit_prob"))) {
+        caption = "";
+        int digit_len = min(len, config->getParamInt("digit_len_max"));
+        for (int i = 0; i < digit_len; i++) {
+            caption+=randomDigit();
+        }
+        return;
+    }
+
+    if (caption_stream_) {
+        caption_stream_->drawNear(helper->rng(), len, caption);
+        caption_index = MTS_CAPTION_STREAMED;
+        return;
+    }
+
+    size_t num_captions = numCaptions();
+    if (num_captions == 0) {
+        caption = "MapTextSynthesizer";
+        return;
+    }
+
+    // weighted files keep their share of draws
+    size_t group = captions_weighted_ ? pickSegment() : 0;
+    if (captions_by_length_.empty()) {
+        captions_by_length_.resize(captions_weighted_ ?
+                caption_segments_.size() : 1);
+    }
+    std::map<int, vector<int> > &by_length = captions_by_length_[group];
+    if (by_length.empty()) {
+        size_t first = 0, count = num_captions;
+        if (captions_weighted_) {
+            first = caption_segments_[group].first;
+            count = caption_segments_[group].count;
+        }
+        for (size_t i = first; i < first + count; i++) {
+            by_length[captionChars(i)].push_back(i);
+        }
+    }
+
+    // the closest length present in the list (the shorter one on a tie)
+    std::map<int, vector<int> >::iterator it = by_length.lower_bound(len);
+    if (it == by_length.end() ||
+            (it != by_length.begin() &&
+             len - std::prev(it)->first <= it->first - len)) {
+        --it;
+    }
+
+    const vector<int> &same = it->second;
+    caption_index = same[helper->rng() % same.size()];
+    captionAt(caption_index, caption);
+}
+
+int
+MTS_TextHelper::measureText(const MTSTextPlan &plan, const string &caption,
+        int height) {
+
+    // the layout only needs a context, nothing is drawn on it
+    cairo_surface_t *surface;
+    surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+    cairo_t *cr = cairo_create(surface);
+    PangoLayout *layout = createLayout(cr);
+    PangoFontDescription *desc;
+    double spacing;
+
+    // same steps as generateTextPatch, up to the patch width
+    applyTextPlan(plan, spacing, desc, height);
+    pango_layout_set_font_description (layout, desc);
+
+    std::ostringstream stm;
+    stm << (int)(PANGO_SCALE*spacing);
+    string mark = "<span letter_spacing='"+stm.str()+"'>"+caption+"</span>";
+    pango_layout_set_markup(layout, mark.c_str(), -1);
+
+    int text_x, text_y, text_w, text_h, size;
+    fitTextExtents(layout, desc, height, text_x, text_y, text_w, text_h, size);
+
+    int patch_width = (int)(plan.stretch_deg * text_w);
+
+    if (plan.rotated_angle != 0 && patch_width > 0) {
+        double sine = std::abs(sin(plan.rotated_angle));
+        double cosine = std::abs(cos(plan.rotated_angle));
+        double ratio = text_h/(double)patch_width;
+        double text_width = (height/(cosine*ratio+sine));
+        double text_height = (ratio*text_width);
+        patch_width = (int)ceil(cosine*text_width+sine*text_height);
+    }
+    // curved text is refit to the height after curving, so for it this
+    // is only an estimate
+
+    g_object_unref(layout);
+    pango_font_description_free(desc);
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+
+    return max(config->getParamInt("width_min"), patch_width);
+}
+
+void 
+MTS_TextHelper::generateTextSample (const MTSTextPlan &plan,
+        const string &caption, cairo_surface_t *&text_surface, int height,
+        int &width, int text_color, bool distract) {
 
     // generate the text using pango for the caption string
-    generateTextPatch(text_surface,caption,height,width,text_color,distract);
+    generateTextPatch(text_surface,caption,plan,height,width,text_color,distract);
 }
 
 
@@ -913,7 +2124,7 @@ MTS_TextHelper::distractText (cairo_t *cr, int width, int height, char *font) {
     // use pango to turn cstring into vector text
     PangoLayout *layout;
     PangoFontDescription *desc;
-    layout = pango_cairo_create_layout(cr);
+    layout = createLayout(cr);
 
     desc = pango_font_description_from_string(font);
     pango_layout_set_font_description(layout, desc);
@@ -21,6 +21,21 @@ import ctypes as c
 import cv2
 import time
 import os
+import socket
+import struct
+
+# Must match MTSI_API_VERSION in mtsi.h
+MTSI_API_VERSION = 1
+
+# Must match ipc_synth/mts_server.h
+MTS_SERVER_MAGIC = 0x3153544d
+MTS_SERVER_SOCKET = "/tmp/mts-server.sock"
+
+try:
+    # Boost.Python extension (make mtspy), preferred when built
+    import mtspy
+except ImportError:
+    mtspy = None
 
 def get_mts_interface_lib():
     """ Prep and return lib for mts interfacing """
@@ -32,6 +47,12 @@ def get_mts_interface_lib():
     
     lib = c.cdll.LoadLibrary(lib_path_complete)
 
+    lib.mts_api_version.argtypes = []
+    lib.mts_api_version.restype = c.c_int
+    if lib.mts_api_version() != MTSI_API_VERSION:
+        raise ImportError("libmtsi.so API version %d, expected %d"
+                          % (lib.mts_api_version(), MTSI_API_VERSION))
+
     # get_sample takes no args, returns void*
     lib.get_sample.argtypes = [c.c_void_p]
     lib.get_sample.restype = c.c_void_p 
@@ -65,17 +86,20 @@ def get_mts_interface_lib():
     # in: void* to MTS_Buff, out: void
     lib.mts_cleanup.argtypes = [c.c_void_p]
     lib.mts_cleanup.restype = None
+
+    # in: MTS_Buff, n, images, max_height, max_width, heights, widths,
+    # labels, label_size; out: n or -1 (see mtsi.h)
+    lib.mts_get_batch.argtypes = [c.c_void_p, c.c_int, c.c_void_p,
+                                  c.c_size_t, c.c_size_t, c.c_void_p,
+                                  c.c_void_p, c.c_void_p, c.c_size_t]
+    lib.mts_get_batch.restype = c.c_int
     
     return lib
 
 def format_sample(lib, ptr):
     """ Transform raw data ptr into usable data """
-    # For c array -> numpy conversion
-    buffer_from_memory = c.pythonapi.PyBuffer_FromMemory
-    buffer_from_memory.restype = c.py_object
-
     if not ptr:
-        print "No sample produced."
+        print("No sample produced.")
         exit()
 
     # Trivial extraction for 'simple' args
@@ -84,22 +108,16 @@ def format_sample(lib, ptr):
     caption = lib.get_caption(ptr)
     width = lib.get_width(ptr)
     raw_data_ptr = c.cast(raw_data, c.POINTER(c.c_ubyte))
-    # https://stackoverflow.com/questions/4355524/getting-data-from-ctypes-array-into-numpy
-    # Above link used as reference for c array -> numpy conversion
-    buffer = buffer_from_memory(raw_data_ptr, width*height)
-    img_flat = np.frombuffer(buffer, np.uint8)
+    # View (not copy) the c array, shaped [height, width, 1]
+    img_shaped = np.ctypeslib.as_array(raw_data_ptr, shape=(height, width, 1))
 
-    # Convert to [height, width, 1] shape
-    img_shaped = np.reshape(img_flat, (height, width, 1))
-    
-    return (caption, img_shaped)
+    return (caption.decode('utf-8'), img_shaped)
 
         
 def multithreaded_data_generator(config_file, num_producers):
     """ Generator to be used in tensorflow """
     mtsi_lib = get_mts_interface_lib()
     config_file_b = config_file.encode('utf-8')
-    config_file_p = c.create_string_buffer(config_file)
     mts_buff = mtsi_lib.mts_init(config_file_b, num_producers)
 
     while True:
@@ -115,6 +133,62 @@ def data_generator(config_file):
     while True:
         yield next(iter)
 
+
+def fixed_batch_data_generator(config_file, batch_size, max_height,
+                               max_width, num_producers=0, label_size=64):
+    """ Generator of whole batches through the C API (no mtspy needed).
+        Yields (images, heights, widths, captions), images being a
+        [batch_size, max_height, max_width, 1] uint8 array; samples are
+        cropped/zero padded to it. Arrays are fresh for every batch. """
+    mtsi_lib = get_mts_interface_lib()
+    mts_buff = mtsi_lib.mts_init(config_file.encode('utf-8'), num_producers)
+
+    while True:
+        images = np.empty((batch_size, max_height, max_width, 1), np.uint8)
+        heights = np.empty(batch_size, np.intc)
+        widths = np.empty(batch_size, np.intc)
+        labels = np.empty((batch_size, label_size), np.uint8)
+        got = mtsi_lib.mts_get_batch(mts_buff, batch_size,
+                                     images.ctypes.data, max_height,
+                                     max_width, heights.ctypes.data,
+                                     widths.ctypes.data, labels.ctypes.data,
+                                     label_size)
+        if got != batch_size:
+            raise RuntimeError("mts_get_batch returned %d for a batch of %d"
+                               % (got, batch_size))
+        captions = [bytes(l).split(b'\0', 1)[0].decode('utf-8')
+                    for l in labels]
+        yield images, heights, widths, captions
+
+
+def batch_data_generator(config_file, batch_size, num_producers=0):
+    """ Generator of whole batches, for tf.data without a per-sample
+        Python hop. Yields (images, heights, widths, captions), images being
+        a zero padded [batch_size, max_height, max_width, 1] uint8 array.
+        The GIL is released while the batch is synthesized. """
+    if mtspy is None:
+        raise ImportError("mtspy not built (run make mtspy)")
+    mts = mtspy.Synthesizer(config_file, num_producers)
+    while True:
+        yield mts.get_batch(batch_size)
+
+
+def labeled_data_generator(config_file, charset_file, num_producers=0,
+                           batch_size=64):
+    """ Generator of single samples whose labels were encoded in C++ with
+        charset_file (one class per character of the file, see
+        inc/mts_charset.hpp). Yields (caption, image, label), label being
+        an int32 array of class indices. Needs mtspy. """
+    if mtspy is None:
+        raise ImportError("mtspy not built (run make mtspy)")
+    mts = mtspy.Synthesizer(config_file, num_producers, charset_file)
+    while True:
+        images, heights, widths, labels, lengths, captions = \
+            mts.get_labeled_batch(batch_size)
+        for i in range(batch_size):
+            yield (captions[i], images[i, :heights[i], :widths[i]],
+                   labels[i, :lengths[i]])
+
         
 def test_generator(num_values=10, show_images=False,
                    log_time=False, buffered=False, num_producers=0):
@@ -141,4 +215,60 @@ def test_generator(num_values=10, show_images=False,
     
     if log_time:
         end_time = time.time()
-        print "Time: ", end_time-start_time
+        print("Time: ", end_time-start_time)
+
+
+def _recv_exactly(sock, n):
+    """ Read exactly n bytes from sock """
+    buf = bytearray(n)
+    view = memoryview(buf)
+    while n:
+        got = sock.recv_into(view, n)
+        if not got:
+            raise ConnectionError("mts-server closed the connection")
+        view = view[got:]
+        n -= got
+    return buf
+
+
+def server_batch_generator(config_file, batch_size,
+                           socket_path=MTS_SERVER_SOCKET, tcp_port=None):
+    """ Generator of whole batches from a running mts-server (see
+        ipc_synth/mts_server.h). Yields the same (images, heights, widths,
+        captions) as batch_data_generator. One request is kept in flight
+        so the next batch streams in while this one is used. """
+    if tcp_port is None:
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.connect(socket_path)
+    else:
+        sock = socket.create_connection(("127.0.0.1", tcp_port))
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+    config = os.path.abspath(config_file).encode('utf-8')
+    request = struct.pack("=I", batch_size)
+    sock.sendall(struct.pack("=II", MTS_SERVER_MAGIC, len(config))
+                 + config + request)
+
+    while True:
+        sock.sendall(request)
+        length, = struct.unpack("=Q", _recv_exactly(sock, 8))
+        reply = _recv_exactly(sock, length)
+        count, = struct.unpack_from("=I", reply, 0)
+
+        records = []
+        pos = 4
+        for _ in range(count):
+            height, width, caption_len = struct.unpack_from("=III", reply, pos)
+            pos += 12
+            caption = bytes(reply[pos:pos + caption_len]).decode('utf-8')
+            pos += caption_len
+            pixels = np.frombuffer(reply, np.uint8, height * width, pos)
+            pos += height * width
+            records.append((caption, pixels.reshape(height, width)))
+
+        heights = np.array([r[1].shape[0] for r in records], np.int32)
+        widths = np.array([r[1].shape[1] for r in records], np.int32)
+        images = np.zeros((count, heights.max(), widths.max(), 1), np.uint8)
+        for i, (_, pixels) in enumerate(records):
+            images[i, :pixels.shape[0], :pixels.shape[1], 0] = pixels
+        yield images, heights, widths, [r[0] for r in records]
@@ -16,20 +16,29 @@ int main(int argc, char *argv[]) {
   int mode;
 
   // Verify argc
-  if(argc > 2) {
-    fprintf(stderr, "usage: shmdemo [data_to_write]\n");
+  if(argc > 3) {
+    fprintf(stderr, "usage: base [ring [numa_node]]\n");
     exit(1);
   }
+  int ring = argc > 1 ? atoi(argv[1]) : 0;
   
   // Init shared memory segment (create)
-  void* buff = get_shared_buff(1);
+  void* buff = get_shared_buff_ring(1, ring);
 
   // Get and init semaphores (create)
-  get_semaphores(1);
+  get_semaphores_ring(1, ring);
+
+  // Keep the ring's pages on the requested NUMA node (before touching them)
+  if(argc > 2) {
+    bind_to_node(buff, SHM_SIZE, atoi(argv[2]));
+  }
   
   // Clear out old memory for debugging purposes
   memset(buff, 1, SHM_SIZE);
 
+  // Zero the ring header so all telemetry counters start from scratch
+  memset(buff, 0, sizeof(ring_header_t));
+
   // Set initial producer and consumer offset
   *(uint64_t*)buff = START_BUFF_OFFSET;
   *(uint64_t*)(buff+sizeof(uint64_t)) = START_BUFF_OFFSET;
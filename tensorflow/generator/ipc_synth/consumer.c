@@ -11,9 +11,19 @@
 #include "prod_cons.h"
 #include "ipc_consumer.h"
 
-/* Consume next available sample and return pointer to heap allocated sample */
-sample_t* consume(intptr_t buff, uint64_t* consume_offset,
-		  int semid, uint32_t* have_buff_lock) {
+/* One produced chunk, still sitting in the ring */
+typedef struct chunk {
+  uint32_t height;
+  uint32_t slot;
+  char* label;
+  uint64_t sz;
+  unsigned char* img;
+  intptr_t end;
+} chunk_t;
+
+/* Locate the next available chunk without copying anything out of it.
+ * Returns 0 if there is nothing to consume */
+int peek_chunk(intptr_t buff, uint64_t* consume_offset, chunk_t* chunk) {
 
   /* For wrapping -- test to see if producer wrapped */
   if(*consume_offset + BASE_CHUNK_SIZE >= SHM_SIZE
@@ -21,79 +31,152 @@ sample_t* consume(intptr_t buff, uint64_t* consume_offset,
     *consume_offset = START_BUFF_OFFSET;
   }
 
-  /* Nothing available to consume, return NULL */
+  /* Nothing available to consume */
   if(*(uint64_t*)(buff + *consume_offset) != SHOULD_CONSUME) {
-    return NULL;
+    return 0;
   }
-  
-  /* Cache initial buff value */
-  intptr_t start_buff = buff;
-  
+
   /* Jump to the next available element (8 is to skip past `ABLE_TO_CONSUME`) */
   buff += *consume_offset + sizeof(uint64_t);
-  
+
+  // Stored as 64 bit int; low half is the height, high half the producer slot
+  uint64_t height_word = *((uint64_t*)buff);
+  chunk->height = CHUNK_HEIGHT(height_word);
+  chunk->slot = CHUNK_SLOT(height_word);
+  buff += sizeof(uint64_t);
+
+  // Label is hardcoded to be max MAX_WORD_LENGTH chars
+  chunk->label = (char*)buff;
+  buff += (MAX_WORD_LENGTH + 1)*sizeof(char);
+
+  // Extract size and update buff
+  chunk->sz = *((uint64_t*)buff);
+  buff += sizeof(uint64_t);
+
+  chunk->img = (unsigned char*)buff;
+  buff += chunk->sz*sizeof(unsigned char);
+  chunk->end = buff;
+
+  // Ensure no funny business with image height/img_size relationship
+  if(chunk->sz % chunk->height != 0) {
+    fprintf(stderr,
+	    "invalid image dimensions. size=%lu, height=%u\n",
+	    chunk->sz, chunk->height);
+  }
+
+  return 1;
+}
+
+/* Hand a chunk found by peek_chunk back to the producers */
+void release_chunk(intptr_t buff, uint64_t* consume_offset, chunk_t* chunk) {
+  // Buff is now consumed!
+  *(uint64_t*)(buff+*consume_offset) = (uint64_t)ALREADY_CONSUMED;
+
+  // Update consume_offset (local)
+  *consume_offset = chunk->end - buff;
+
+  // Update the consume_offset (visible to producers)
+  *((uint64_t*)(buff+sizeof(uint64_t))) = *consume_offset;
+
+  // Telemetry, attributed to the producer that wrote this chunk
+  ring_header_t* hdr = (ring_header_t*)buff;
+  STAT_ADD(hdr->samples_consumed, 1);
+  STAT_ADD(hdr->bytes_consumed, BASE_CHUNK_SIZE + chunk->sz);
+  if(chunk->slot < MAX_PRODUCERS) {
+    STAT_ADD(hdr->producers[chunk->slot].samples_consumed, 1);
+    STAT_ADD(hdr->producers[chunk->slot].bytes_consumed,
+	     BASE_CHUNK_SIZE + chunk->sz);
+  }
+}
+
+/* Consume next available sample and return pointer to heap allocated sample */
+sample_t* consume(intptr_t buff, uint64_t* consume_offset,
+		  int semid, uint32_t* have_buff_lock) {
+  chunk_t chunk;
+
+  /* Nothing available to consume, return NULL */
+  if(!peek_chunk(buff, consume_offset, &chunk)) {
+    return NULL;
+  }
+
   sample_t* spl = (sample_t*)malloc(sizeof(sample_t));
   if(spl == NULL) {
     perror("malloc");
     exit(1);
   }
 
-  // Stored as 64 bit int for mem alignment's sake, but don't need 64 bits
-  uint32_t height = (uint32_t)*((uint64_t*)buff);
-  buff += sizeof(uint64_t);
-
   // Extract label from data chunk
-  char* label = strdup((char*)buff);
+  char* label = strdup(chunk.label);
   if(label == NULL) {
     perror("strdup");
     exit(1);
   }
 
-  // Label is hardcoded to be max MAX_WORD_LENGTH chars
-  buff += (MAX_WORD_LENGTH + 1)*sizeof(char);
-
-  // Extract size and update buff
-  uint64_t sz = *((uint64_t*)buff);
-  buff += sizeof(uint64_t);
-
   // Allocate enough space to store flat image
-  unsigned char* img_flat = (unsigned char*)malloc(sz);
+  unsigned char* img_flat = (unsigned char*)malloc(chunk.sz);
   if(img_flat == NULL) {
     perror("malloc");
-    fprintf(stderr, "Requested %lu bytes.\n", sz);
+    fprintf(stderr, "Requested %lu bytes.\n", chunk.sz);
     exit(1);
   }
 
   // Copy image data into img_flat
-  memcpy(img_flat, (void*)buff, sz);
-  buff += sz*sizeof(unsigned char);
+  memcpy(img_flat, chunk.img, chunk.sz);
 
   // Instantiate spl according to extracted values
-  spl->height = height;
-
-  // Ensure no funny business with image height/img_size relationship
-  if(sz % height != 0) {
-    fprintf(stderr,
-	    "invalid image dimensions. size=%lu, height=%u\n",
-	    sz, height);
-  }
-  
-  spl->width = sz/height; //should be evenly divisible
+  spl->height = chunk.height;
+  spl->width = chunk.sz/chunk.height; //should be evenly divisible
   spl->caption = label;
   spl->img_data = img_flat;
 
-  // Buff is now consumed!
-  *(uint64_t*)(start_buff+*consume_offset) = (uint64_t)ALREADY_CONSUMED;
-
-  // Update consume_offset (local)
-  *consume_offset = buff - start_buff;
-  
-  // Update the consume_offset (visible to producers)
-  *((uint64_t*)(start_buff+sizeof(uint64_t))) = *consume_offset;
+  release_chunk(buff, consume_offset, &chunk);
 
   return spl;
 }
 
+/* Exposed via ipc_consumer.h -- copy a sample into caller memory */
+void sample_dest_fill(sample_dest_t* dst, const unsigned char* img,
+		      size_t height, size_t width, const char* caption) {
+  // Crop to the destination, zero pad whatever the sample doesn't cover
+  dst->height = height < dst->max_height ? height : dst->max_height;
+  dst->width = width < dst->max_width ? width : dst->max_width;
+
+  for(size_t row = 0; row < dst->height; row++) {
+    unsigned char* out = dst->img_data + row * dst->max_width;
+    memcpy(out, img + row * width, dst->width);
+    memset(out + dst->width, 0, dst->max_width - dst->width);
+  }
+  memset(dst->img_data + dst->height * dst->max_width, 0,
+	 (dst->max_height - dst->height) * dst->max_width);
+
+  strncpy(dst->caption, caption, dst->caption_size - 1);
+  dst->caption[dst->caption_size - 1] = '\0';
+}
+
+/* Exposed via ipc_consumer.h -- get sample straight into caller memory */
+int ipc_get_sample_into(void* buff, uint64_t* consume_offset,
+			int semid, uint32_t* have_buff_lock,
+			sample_dest_t* dst) {
+  chunk_t chunk;
+
+  if(!peek_chunk((intptr_t)buff, consume_offset, &chunk)) {
+    return 0;
+  }
+
+  // Copy straight out of the ring, no intermediate allocation
+  sample_dest_fill(dst, chunk.img, chunk.height, chunk.sz/chunk.height,
+		   chunk.label);
+  release_chunk((intptr_t)buff, consume_offset, &chunk);
+
+  // If this happens, then something broke
+  if(*consume_offset >= SHM_SIZE) {
+    fprintf(stderr, "Consumer did not wrap appropriately.\n");
+    exit(1);
+  }
+
+  return 1;
+}
+
 /* Exposed via mts_ipc.h -- get sample */
 sample_t* ipc_get_sample(void* buff, uint64_t* consume_offset,
 		 int semid, uint32_t* have_buff_lock) {
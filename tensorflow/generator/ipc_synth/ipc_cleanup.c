@@ -7,13 +7,17 @@
 
 int main(void) {
 
-  // Get and remove semaphore by ID
-  int semid = get_semaphores(0);
-  semctl(semid, 0, IPC_RMID);
+  // Every ring has its own semaphore and segment
+  int num_rings = count_rings();
+  for(int ring = 0; ring < num_rings; ring++) {
+    // Get and remove semaphore by ID
+    int semid = get_semaphores_ring(0, ring);
+    semctl(semid, 0, IPC_RMID);
 
-  // Get and remove shared memory by ID
-  int shmid = get_shmid(0);
-  shmctl(shmid, IPC_RMID, NULL);
+    // Get and remove shared memory by ID
+    int shmid = get_shmid_ring(0, ring);
+    shmctl(shmid, IPC_RMID, NULL);
+  }
   
   return 0;
 }
@@ -11,7 +11,29 @@ typedef struct sample {
   char* caption;
 } sample_t;
 
+// Caller-owned memory to copy one sample into (see sample_dest_fill)
+typedef struct sample_dest {
+  unsigned char* img_data;  // max_height rows of max_width bytes
+  size_t max_height;
+  size_t max_width;
+  char* caption;            // caption_size bytes, always null terminated
+  size_t caption_size;
+  size_t height;            // out: rows actually copied
+  size_t width;             // out: columns actually copied
+} sample_dest_t;
+
 sample_t* ipc_get_sample(void* buff, uint64_t* consume_offset,
 			 int semid, uint32_t* have_buff_lock);
 
+/* Copies img (height x width) into dst, cropped to dst's maximum size and
+ * zero padded to it; the caption is truncated to fit */
+void sample_dest_fill(sample_dest_t* dst, const unsigned char* img,
+		      size_t height, size_t width, const char* caption);
+
+/* Like ipc_get_sample, but copies the sample straight from the ring into
+ * dst. Returns 0 if nothing was available */
+int ipc_get_sample_into(void* buff, uint64_t* consume_offset,
+			int semid, uint32_t* have_buff_lock,
+			sample_dest_t* dst);
+
 #endif
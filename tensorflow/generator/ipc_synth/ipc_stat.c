@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/shm.h>
+
+#include "prod_cons.h"
+
+// A producer is considered stalled if it hasn't checked in for this long
+#define STALE_NS (30ULL * 1000000000ULL)
+
+/* Print the usage string and bail */
+void usage(void) {
+  fprintf(stderr, "usage: ipc_stat [-p] [interval [count]]\n"
+	  "  -p        also print a per-producer table each interval\n"
+	  "  interval  seconds between reports (default 1)\n"
+	  "  count     number of reports (default: forever)\n");
+  exit(1);
+}
+
+/* Copy out the header so that a report is based on one coherent-ish view */
+void snapshot(void* buff, ring_header_t* snap) {
+  memcpy(snap, buff, sizeof(ring_header_t));
+}
+
+/* Producer is alive if it has a pid that still exists */
+int producer_alive(producer_stats_t* p) {
+  return p->pid != 0 && (kill(p->pid, 0) == 0 || errno != ESRCH);
+}
+
+/* Bytes currently sitting in the ring, waiting for the consumer */
+uint64_t in_flight_bytes(ring_header_t* h) {
+  return h->bytes_produced > h->bytes_consumed ?
+    h->bytes_produced - h->bytes_consumed : 0;
+}
+
+void print_header(void) {
+  printf("%4s %5s %10s %10s %10s %7s %11s %9s %11s\n",
+	 "ring", "procs", "prod/s", "cons/s", "flight_MB", "fill%",
+	 "blocked_ms", "wait_ms", "cons_idle_s");
+}
+
+/* One vmstat-style line: rates are over the last interval */
+void print_summary(int ring, ring_header_t* prev, ring_header_t* cur,
+		   double secs, uint64_t now) {
+  int alive = 0;
+  uint64_t blocked = 0;
+
+  for(int i = 0; i < MAX_PRODUCERS; i++) {
+    if(producer_alive(&cur->producers[i])) {
+      alive++;
+    }
+    // Slots get reset when reclaimed, so don't let a reset look negative
+    if(cur->producers[i].pid == prev->producers[i].pid
+       && cur->producers[i].blocked_full_ns
+       >= prev->producers[i].blocked_full_ns) {
+      blocked += cur->producers[i].blocked_full_ns
+	- prev->producers[i].blocked_full_ns;
+    }
+  }
+
+  uint64_t flight = in_flight_bytes(cur);
+  double idle = cur->consumer_heartbeat_ns ?
+    (now - cur->consumer_heartbeat_ns) / 1e9 : -1.0;
+
+  printf("%4d %5d %10.1f %10.1f %10.1f %7.1f %11.1f %9.1f %11.1f\n",
+	 ring, alive,
+	 (cur->samples_produced - prev->samples_produced) / secs,
+	 (cur->samples_consumed - prev->samples_consumed) / secs,
+	 flight / (1024.0 * 1024.0),
+	 100.0 * flight / (SHM_SIZE - START_BUFF_OFFSET),
+	 blocked / 1e6 / secs,
+	 (cur->consumer_wait_ns - prev->consumer_wait_ns) / 1e6 / secs,
+	 idle);
+}
+
+/* Per-producer table (lifetime totals, since each slot was claimed) */
+void print_producers(int ring, ring_header_t* cur, uint64_t now) {
+  printf("  %4s %4s %8s %12s %12s %10s %12s %9s %6s\n",
+	 "ring", "slot", "pid", "produced", "consumed", "flight_KB",
+	 "blocked_s", "beat_s", "state");
+  for(int i = 0; i < MAX_PRODUCERS; i++) {
+    producer_stats_t* p = &cur->producers[i];
+    if(p->pid == 0) {
+      continue;
+    }
+    double beat = (now - p->heartbeat_ns) / 1e9;
+    const char* state = !producer_alive(p) ? "dead"
+      : (now - p->heartbeat_ns > STALE_NS ? "stall" : "ok");
+    uint64_t flight = p->bytes_produced > p->bytes_consumed ?
+      p->bytes_produced - p->bytes_consumed : 0;
+
+    printf("  %4d %4d %8d %12lu %12lu %10.1f %12.1f %9.1f %6s\n",
+	   ring, i, p->pid, p->samples_produced, p->samples_consumed,
+	   flight / 1024.0, p->blocked_full_ns / 1e9, beat, state);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int per_producer = 0;
+  int interval = 1;
+  long count = -1;
+
+  int argi = 1;
+  if(argi < argc && strcmp(argv[argi], "-p") == 0) {
+    per_producer = 1;
+    argi++;
+  }
+  if(argi < argc) {
+    interval = atoi(argv[argi++]);
+    if(interval <= 0) {
+      usage();
+    }
+  }
+  if(argi < argc) {
+    count = atol(argv[argi++]);
+    if(count <= 0) {
+      usage();
+    }
+  }
+  if(argi < argc) {
+    usage();
+  }
+
+  // Attach to every ring without creating (base must have been run)
+  int num_rings = count_rings();
+  if(num_rings == 0) {
+    fprintf(stderr, "No rings found (has base been run?).\n");
+    exit(1);
+  }
+
+  void* buffs[MAX_RINGS];
+  ring_header_t prev[MAX_RINGS], cur[MAX_RINGS];
+  for(int r = 0; r < num_rings; r++) {
+    buffs[r] = get_shared_buff_ring(0, r);
+    snapshot(buffs[r], &prev[r]);
+  }
+  uint64_t prev_ns = now_ns();
+
+  for(long n = 0; count < 0 || n < count; n++) {
+    if(n % 20 == 0 || per_producer) {
+      print_header();
+    }
+
+    sleep(interval);
+
+    for(int r = 0; r < num_rings; r++) {
+      snapshot(buffs[r], &cur[r]);
+    }
+    uint64_t cur_ns = now_ns();
+
+    for(int r = 0; r < num_rings; r++) {
+      print_summary(r, &prev[r], &cur[r], (cur_ns - prev_ns) / 1e9, cur_ns);
+    }
+    if(per_producer) {
+      for(int r = 0; r < num_rings; r++) {
+	print_producers(r, &cur[r], cur_ns);
+      }
+    }
+    fflush(stdout);
+
+    memcpy(prev, cur, sizeof(ring_header_t) * num_rings);
+    prev_ns = cur_ns;
+  }
+
+  /* detach from segments */
+  for(int r = 0; r < num_rings; r++) {
+    if(shmdt(buffs[r]) == -1) {
+      perror("shmdt");
+      exit(1);
+    }
+  }
+
+  return 0;
+}
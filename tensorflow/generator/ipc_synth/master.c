@@ -9,25 +9,80 @@
 
 #include <sys/wait.h>
 #include <sys/prctl.h>
-#include <sys/resource.h>
 
 #include "prod_cons.h"
 #include "ipc_consumer.h"
 #include "mts_ipc.h"
 
 /* Necessary if we(I) don't want to make another class... */
-void* g_buff;
-int  g_semid;
+/* (one entry per ring; there is more than one only with numa-rings) */
+void* g_buffs[MAX_RINGS];
+int  g_semids[MAX_RINGS];
 uint32_t  g_have_buff_lock;
-uint64_t  g_consume_offset;
+uint64_t  g_consume_offsets[MAX_RINGS];
+int g_num_rings;
+int g_next_ring; // where the merging consumer looks first
+
+/* Placement policy and the node the consumer lives on */
+int g_placement;
+int g_consumer_node;
 
 /* For respawning producers via signal handler */
 char* g_config_file; 
 int g_num_producers;
 
-/* Fork & exec a single producer */
-void fork_and_exec_producer(const char* config_file) {
-  int fstatus = fork();
+/* Producer bookkeeping (touched by the SIGCHLD handler, so only modify
+ * it from elsewhere with SIGCHLD blocked) */
+pid_t g_producer_pids[MAX_PRODUCERS];
+int g_producer_retired[MAX_PRODUCERS]; // 1 if we asked it to exit
+
+/* Fork-server mode: one producer process per ring builds the synthesizer
+ * once and forks workers from it; we track servers and their worker count */
+int g_fork_server;
+pid_t g_server_pids[MAX_RINGS];
+int g_server_workers[MAX_RINGS];
+
+/* Autoscaling state */
+int g_autoscale;
+int g_min_producers;
+int g_max_producers;
+uint64_t g_scale_last_ns;
+uint64_t g_scale_last_wait_ns;
+int g_scale_full_windows;
+
+/* Pin a freshly forked producer (in the child) to a core according to
+ * the placement policy, and return the ring it should write to. `slot` is
+ * the producer's bookkeeping slot, so respawns land in the same place. */
+int place_producer(int slot) {
+  int node = -1;
+  int index = slot;
+  int ring = 0;
+
+  switch(g_placement) {
+  case PLACEMENT_NONE:
+    return ring;
+  case PLACEMENT_PIN:
+    break;
+  case PLACEMENT_NUMA:
+    node = g_consumer_node;
+    break;
+  case PLACEMENT_NUMA_RINGS:
+    // Deal producers out over the nodes; each node has its own ring
+    ring = node = slot % g_num_rings;
+    index = slot / g_num_rings;
+    break;
+  }
+
+  int cpu = numa_pick_cpu(node, index);
+  if(cpu >= 0) {
+    pin_to_cpu(cpu);
+  }
+  return ring;
+}
+
+/* Fork & exec a single producer, returning its pid */
+pid_t fork_and_exec_producer(const char* config_file, int slot) {
+  pid_t fstatus = fork();
   if(fstatus == -1) {
     fprintf(stderr, "Fork failed!");
     exit(1);
@@ -36,41 +91,227 @@ void fork_and_exec_producer(const char* config_file) {
     // Send SIGHUP to this process when parent dies
     prctl(PR_SET_PDEATHSIG, SIGHUP);
 
-    // Producer leaks memory, so make it crash by limiting heap
-    // (and saving the rest of the system processes)
-    struct rlimit data_limit;
-    data_limit.rlim_cur = PRODUCER_DATA_LIMIT;
-    data_limit.rlim_max = PRODUCER_DATA_LIMIT;
-    if(setrlimit(RLIMIT_DATA, &data_limit)) {
-      perror("setrlimit");
+    // Affinity survives the exec
+    char ring[16];
+    snprintf(ring, sizeof(ring), "%d", place_producer(slot));
+
+    // Producers beyond the initial count (autoscaling) double up on a
+    // shard of the epoch order
+    int shards = g_num_producers > 0 ? g_num_producers : 1;
+    char shard_arg[16], shards_arg[16];
+    snprintf(shard_arg, sizeof(shard_arg), "%d", slot % shards);
+    snprintf(shards_arg, sizeof(shards_arg), "%d", shards);
+
+    // Exec a new producer
+    char* args[8];
+    args[0] = "producer";
+    args[1] = "-s";
+    args[2] = shard_arg;
+    args[3] = "-S";
+    args[4] = shards_arg;
+    args[5] = (char*)config_file;
+    args[6] = ring;
+    args[7] = NULL;
+
+    if(execvp(args[0], args)) {
+      perror("producer exec");
       exit(1);
     }
-    
-    // Exec a new producer
-    char* args[3];
+  }
+  return fstatus;
+}
+
+/* NUMA node a ring's producers should run on (-1 for anywhere) */
+int ring_node(int ring) {
+  if(g_placement == PLACEMENT_NUMA) {
+    return g_consumer_node;
+  } else if(g_placement == PLACEMENT_NUMA_RINGS) {
+    return ring;
+  }
+  return -1;
+}
+
+/* First epoch shard of a ring's workers: the rings' initial workers
+ * (see fork_and_exec_producers) are numbered one after the other */
+int ring_first_shard(int ring) {
+  int first = 0;
+  for(int r = 0; r < ring; r++) {
+    first += g_num_producers / g_num_rings + (r < g_num_producers % g_num_rings);
+  }
+  return first;
+}
+
+/* Fork & exec a fork-server producer for a ring, returning its pid */
+pid_t fork_and_exec_server(const char* config_file, int ring, int workers) {
+  pid_t fstatus = fork();
+  if(fstatus == -1) {
+    fprintf(stderr, "Fork failed!");
+    exit(1);
+  } else if(fstatus == 0) {
+
+    // Send SIGHUP to this process when parent dies
+    prctl(PR_SET_PDEATHSIG, SIGHUP);
+
+    // Keep the server (and so the pages it shares with its workers) on
+    // the ring's node; the workers pin themselves
+    int node = ring_node(ring);
+    if(node >= 0) {
+      int cpu = numa_pick_cpu(node, 0);
+      if(cpu >= 0) {
+	pin_to_cpu(cpu);
+      }
+    }
+
+    char workers_arg[16], node_arg[16], ring_arg[16];
+    char shard_arg[16], shards_arg[16];
+    snprintf(workers_arg, sizeof(workers_arg), "%d", workers);
+    snprintf(node_arg, sizeof(node_arg), "%d", node);
+    snprintf(ring_arg, sizeof(ring_arg), "%d", ring);
+    snprintf(shard_arg, sizeof(shard_arg), "%d", ring_first_shard(ring));
+    snprintf(shards_arg, sizeof(shards_arg), "%d",
+	     g_num_producers > 0 ? g_num_producers : 1);
+
+    char* args[12];
     args[0] = "producer";
-    args[1] = (char*)config_file;
-    args[2] = NULL;
+    args[1] = "-w";
+    args[2] = workers_arg;
+    args[3] = "-n";
+    args[4] = node_arg;
+    args[5] = "-s";
+    args[6] = shard_arg;
+    args[7] = "-S";
+    args[8] = shards_arg;
+    args[9] = (char*)config_file;
+    args[10] = ring_arg;
+    args[11] = NULL;
 
     if(execvp(args[0], args)) {
       perror("producer exec");
       exit(1);
     }
   }
+  return fstatus;
+}
+
+/* Spawn a producer into a free bookkeeping slot; 0 if none free.
+ * (In fork-server mode, ask the least loaded server for another worker) */
+pid_t add_producer(const char* config_file) {
+  if(g_fork_server) {
+    int best = 0;
+    for(int r = 1; r < g_num_rings; r++) {
+      if(g_server_workers[r] < g_server_workers[best]) {
+	best = r;
+      }
+    }
+    if(g_server_workers[best] >= MAX_PRODUCERS) {
+      return 0;
+    }
+    g_server_workers[best]++;
+    kill(g_server_pids[best], SIGUSR1);
+    return g_server_pids[best];
+  }
+
+  for(int i = 0; i < MAX_PRODUCERS; i++) {
+    if(g_producer_pids[i] == 0) {
+      g_producer_retired[i] = 0;
+      g_producer_pids[i] = fork_and_exec_producer(config_file, i);
+      return g_producer_pids[i];
+    }
+  }
+  return 0;
 }
 
-/* Spawn producers */
+/* Spawn producers (default seeds mix in the pid, so no need to stagger) */
 void fork_and_exec_producers(int num_producers, const char* config_file) {
+  if(g_fork_server) {
+    // Deal the workers out over the rings, one server per ring
+    for(int r = 0; r < g_num_rings; r++) {
+      g_server_workers[r] = num_producers / g_num_rings
+	+ (r < num_producers % g_num_rings);
+      g_server_pids[r] = fork_and_exec_server(config_file, r,
+					      g_server_workers[r]);
+    }
+    return;
+  }
+
   for(int i = 0; i < num_producers; i++) {
-    fork_and_exec_producer(config_file);
-    // Sleep for a hot sec to avoid identically-seeded synthesizers
-    // (default seeds based on time in seconds, which is kinda lame)
-    sleep(1);
+    add_producer(config_file);
+  }
+}
+
+/* Number of producers that are running and not on their way out */
+int count_live_producers(void) {
+  int n = 0;
+  if(g_fork_server) {
+    for(int r = 0; r < g_num_rings; r++) {
+      n += g_server_workers[r];
+    }
+    return n;
+  }
+  for(int i = 0; i < MAX_PRODUCERS; i++) {
+    if(g_producer_pids[i] != 0 && !g_producer_retired[i]) {
+      n++;
+    }
   }
+  return n;
 }
 
-/* Fork & exec base */
-void fork_and_exec_base(int* pid) {
+/* Number of our producers that haven't written their first sample yet
+ * (still loading captions/fonts), judging by the telemetry slots */
+int count_warming_producers(void) {
+  int ready = 0;
+  for(int r = 0; r < g_num_rings; r++) {
+    ring_header_t* hdr = (ring_header_t*)g_buffs[r];
+    for(int i = 0; i < MAX_PRODUCERS; i++) {
+      if(hdr->producers[i].pid == 0
+	 || hdr->producers[i].samples_produced == 0) {
+	continue;
+      }
+      // Workers of a fork-server are its children, not ours
+      if(g_fork_server) {
+	ready += kill(hdr->producers[i].pid, 0) == 0;
+	continue;
+      }
+      for(int j = 0; j < MAX_PRODUCERS; j++) {
+	if(g_producer_pids[j] == hdr->producers[i].pid
+	   && !g_producer_retired[j]) {
+	  ready++;
+	  break;
+	}
+      }
+    }
+  }
+  return count_live_producers() - ready;
+}
+
+/* Ask the most recently added producer to finish its write and exit */
+void retire_producer(void) {
+  if(g_fork_server) {
+    // Take it from the most loaded server
+    int best = 0;
+    for(int r = 1; r < g_num_rings; r++) {
+      if(g_server_workers[r] > g_server_workers[best]) {
+	best = r;
+      }
+    }
+    if(g_server_workers[best] > 0) {
+      g_server_workers[best]--;
+      kill(g_server_pids[best], SIGUSR2);
+    }
+    return;
+  }
+
+  for(int i = MAX_PRODUCERS - 1; i >= 0; i--) {
+    if(g_producer_pids[i] != 0 && !g_producer_retired[i]) {
+      g_producer_retired[i] = 1;
+      kill(g_producer_pids[i], SIGTERM);
+      return;
+    }
+  }
+}
+
+/* Fork & exec base for one ring (binding it to `node` if node >= 0) */
+void fork_and_exec_base(int* pid, int ring, int node) {
   *pid = fork();
   if(*pid == -1) {
     // Failed
@@ -83,10 +324,15 @@ void fork_and_exec_base(int* pid) {
     // (Shouldn't be necessary because this dies on its own pretty fast)
     prctl(PR_SET_PDEATHSIG, SIGHUP);
 
-    // Prep args and exec `base`
-    char* args[2];
+    // Prep args (which ring to set up, and where to put it) and exec `base`
+    char ring_arg[16], node_arg[16];
+    snprintf(ring_arg, sizeof(ring_arg), "%d", ring);
+    snprintf(node_arg, sizeof(node_arg), "%d", node);
+    char* args[4];
     args[0] = "base";
-    args[1] = NULL;
+    args[1] = ring_arg;
+    args[2] = node >= 0 ? node_arg : NULL;
+    args[3] = NULL;
     if(execvp(args[0], args)) {
       perror("exec base");
       exit(1);
@@ -97,10 +343,112 @@ void fork_and_exec_base(int* pid) {
 /* NOTE: This assumes the only child processes are producers */
 void dead_child_handler(int signo) {
   int wstatus;
-  while(waitpid(0, &wstatus, WNOHANG || WEXITED || WUNTRACED) > 0) {
-    /* Not sure where to get this config file from?? */
-    fork_and_exec_producer(g_config_file);
+  pid_t pid;
+  while((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+    // A crashed fork-server comes back with as many workers as it had
+    for(int r = 0; g_fork_server && r < g_num_rings; r++) {
+      if(g_server_pids[r] == pid) {
+	g_server_pids[r] = fork_and_exec_server(g_config_file, r,
+						g_server_workers[r]);
+      }
+    }
+    for(int i = 0; i < MAX_PRODUCERS; i++) {
+      if(g_producer_pids[i] != pid) {
+	continue;
+      }
+      if(g_producer_retired[i]) {
+	// Retired by the autoscaler, let it go
+	g_producer_pids[i] = 0;
+	g_producer_retired[i] = 0;
+      } else {
+	// Crashed, so replace it in the same slot
+	g_producer_pids[i] = fork_and_exec_producer(g_config_file, i);
+      }
+      break;
+    }
+  }
+}
+
+/* Read autoscaling settings from the environment */
+void init_autoscale(int num_producers) {
+  const char* env = getenv("MTS_IPC_AUTOSCALE");
+  g_autoscale = env != NULL && atoi(env) != 0;
+
+  // Leave a core for the training process by default
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  g_max_producers = ncpu > 1 ? (int)ncpu - 1 : 1;
+  env = getenv("MTS_IPC_MAX_PRODUCERS");
+  if(env != NULL && atoi(env) > 0) {
+    g_max_producers = atoi(env);
+  }
+  if(g_max_producers > MAX_PRODUCERS) {
+    g_max_producers = MAX_PRODUCERS;
+  }
+
+  g_min_producers = 1;
+  if(num_producers > g_max_producers) {
+    g_max_producers = num_producers;
+  }
+
+  g_scale_last_ns = now_ns();
+  g_scale_last_wait_ns = 0;
+  g_scale_full_windows = 0;
+}
+
+/* Called from the consumer side every so often: add a producer if the
+ * consumer spent a good part of the last window starved, retire one if
+ * the ring has been (nearly) full for several windows in a row */
+void autoscale_producers(void) {
+  uint64_t now = now_ns();
+  uint64_t elapsed = now - g_scale_last_ns;
+
+  if(elapsed < AUTOSCALE_INTERVAL_NS) {
+    return;
+  }
+
+  // Consumer wait is recorded in every ring, so any one will do
+  uint64_t wait_ns = ((ring_header_t*)g_buffs[0])->consumer_wait_ns;
+  double wait_frac = (double)(wait_ns - g_scale_last_wait_ns) / elapsed;
+
+  // Fill level across all rings
+  uint64_t flight = 0;
+  for(int r = 0; r < g_num_rings; r++) {
+    ring_header_t* hdr = (ring_header_t*)g_buffs[r];
+    if(hdr->bytes_produced > hdr->bytes_consumed) {
+      flight += hdr->bytes_produced - hdr->bytes_consumed;
+    }
+  }
+  double fill = (double)flight / (g_num_rings * (SHM_SIZE - START_BUFF_OFFSET));
+
+  g_scale_last_ns = now;
+  g_scale_last_wait_ns = wait_ns;
+
+  // Keep the handler from touching the pid table while we do
+  sigset_t mask, old_mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, &old_mask);
+
+  int live = count_live_producers();
+
+  if(fill >= AUTOSCALE_FULL_FILL) {
+    g_scale_full_windows++;
+  } else {
+    g_scale_full_windows = 0;
+  }
+
+  // Only grow once earlier additions are up and running, otherwise the
+  // startup wait of a new producer would trigger yet another one
+  if(wait_frac >= AUTOSCALE_STARVED_WAIT && live < g_max_producers
+     && count_warming_producers() == 0) {
+    add_producer(g_config_file);
+  } else if(g_scale_full_windows >= AUTOSCALE_FULL_WINDOWS
+	    && live > g_min_producers) {
+    retire_producer();
+    g_scale_full_windows = 0;
   }
+
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
 }
 
 /* Set up signal handler to spawn a producer when SIGCHLD is received */
@@ -114,42 +462,98 @@ void init_producer_respawn(void) {
 
 /* Perform necessary operations for prepping IPC */
 void mts_ipc_init(int num_producers, const char* config_file) {
-  /* Prepare shared memory and semaphores */
-  pid_t pid;
-  int wstatus;
-  fork_and_exec_base(&pid);
+  /* Decide where rings and producers go */
+  g_placement = get_placement_policy();
+  g_consumer_node = numa_current_node();
+  g_num_rings = 1;
+  if(g_placement == PLACEMENT_NUMA_RINGS) {
+    g_num_rings = numa_num_nodes();
+    if(g_num_rings > MAX_RINGS) {
+      g_num_rings = MAX_RINGS;
+    }
+  }
+
+  /* Prepare shared memory and semaphores (one base run per ring) */
+  for(int r = 0; r < g_num_rings; r++) {
+    pid_t pid;
+    int wstatus;
+    fork_and_exec_base(&pid, r, ring_node(r));
+
+    // Wait until base terminates
+    waitpid(pid, &wstatus, WUNTRACED);
+  }
 
-  // Wait until base terminates
-  waitpid(pid, &wstatus, WUNTRACED);
+  /* Prepare for consumption */
+  for(int r = 0; r < g_num_rings; r++) {
+    g_buffs[r] = get_shared_buff_ring(0, r);
+    g_semids[r] = get_semaphores_ring(0, r);
+    g_consume_offsets[r] = START_BUFF_OFFSET;
+  }
+  g_have_buff_lock = 0;
+  g_next_ring = 0;
+
+  /* Fork-server mode (MTS_IPC_FORK_SERVER=1): initialize once per ring */
+  const char* env = getenv("MTS_IPC_FORK_SERVER");
+  g_fork_server = env != NULL && atoi(env) != 0;
 
-  /* Deal with the inevitable crashing of producers */
+  /* Respawn producers that crash (they no longer leak, so this is only a
+   * safety net) and set up autoscaling */
   g_config_file = (char*)config_file;
   g_num_producers = num_producers;
+  init_autoscale(num_producers);
   init_producer_respawn();
   
   /* Start producers */
   fork_and_exec_producers(num_producers, config_file);
-
-  /* Prepare for consumption */
-  g_buff = (void*)((intptr_t)get_shared_buff(0));
-  g_semid = get_semaphores(0);
-  g_have_buff_lock = 0;
-  g_consume_offset = START_BUFF_OFFSET;
-
 }
 
 /* Get a sample from shared memory */
-void* mts_ipc_get_sample(void) {
-  sample_t* spl;
+/* Poll the rings until one yields a sample, either heap allocated (into
+ * *spl) or copied into dst when dst is given */
+void poll_rings(sample_t** spl, sample_dest_t* dst) {
+  uint64_t wait_start = 0;
+  int r = g_next_ring;
 
-  // Poll until you get a non-null sample
-  while(!(spl = (void*)ipc_get_sample(g_buff, &g_consume_offset,
-				      g_semid, &g_have_buff_lock))) {
+  // Poll (round-robin over the rings) until you get a sample
+  while(dst ? !ipc_get_sample_into(g_buffs[r], &g_consume_offsets[r],
+				   g_semids[r], &g_have_buff_lock, dst)
+	: !(*spl = ipc_get_sample(g_buffs[r], &g_consume_offsets[r],
+				  g_semids[r], &g_have_buff_lock))) {
     /* tryin2consume */
+    r = (r + 1) % g_num_rings;
+    if(!wait_start && r == g_next_ring) {
+      wait_start = now_ns();
+    }
+  }
+
+  // Next time start from the ring after this one, so none is favored
+  g_next_ring = (r + 1) % g_num_rings;
+
+  // Mark the consumer alive, and account for time spent starved
+  uint64_t now = now_ns();
+  for(int i = 0; i < g_num_rings; i++) {
+    ring_header_t* hdr = (ring_header_t*)g_buffs[i];
+    hdr->consumer_heartbeat_ns = now;
+    if(wait_start) {
+      STAT_ADD(hdr->consumer_wait_ns, now - wait_start);
+    }
   }
+
+  if(g_autoscale) {
+    autoscale_producers();
+  }
+}
+
+void* mts_ipc_get_sample(void) {
+  sample_t* spl;
+  poll_rings(&spl, NULL);
   return spl;
 }
 
+void mts_ipc_get_sample_into(struct sample_dest* dst) {
+  poll_rings(NULL, dst);
+}
+
 /* Currently unused -- retained for potential future use */
 void mts_ipc_cleanup(void) {
   printf("cleanin up!\n");
@@ -1,12 +1,28 @@
 #ifndef MTS_IPC_H
 #define MTS_IPC_H
 
-// Fix producer to cap its data to this value
-// Producer will die & respawn at this value
-#define PRODUCER_DATA_LIMIT (uint64_t)2*1073741824
+/* Autoscaling (enabled by setting MTS_IPC_AUTOSCALE=1 in the environment;
+ * MTS_IPC_MAX_PRODUCERS caps the count, default is online CPUs - 1) */
+
+// How often the consumer re-evaluates the number of producers
+#define AUTOSCALE_INTERVAL_NS (5ULL * 1000000000ULL)
+
+// Add a producer if the consumer waited this fraction of the interval
+#define AUTOSCALE_STARVED_WAIT 0.10
+
+// Retire a producer if the ring is this full ...
+#define AUTOSCALE_FULL_FILL 0.90
+
+// ... for this many intervals in a row
+#define AUTOSCALE_FULL_WINDOWS 3
 
 void mts_ipc_init(int num_producers, const char* config_file);
 void* mts_ipc_get_sample(void);
+
+/* Blocks until a sample is available and copies it into dst (a
+ * sample_dest_t, see ipc_consumer.h) without allocating */
+struct sample_dest;
+void mts_ipc_get_sample_into(struct sample_dest* dst);
 void mts_ipc_cleanup(void);
 
 
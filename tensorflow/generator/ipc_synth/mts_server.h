@@ -0,0 +1,36 @@
+#ifndef MTS_SERVER_H
+#define MTS_SERVER_H
+
+#include <stdint.h>
+
+/* Wire protocol of mts-server (all integers little endian, as on the host)
+ *
+ * client -> server, once after connecting:
+ *   uint32 MTS_SERVER_MAGIC, uint32 config_len, config path (config_len
+ *   bytes, no terminator). The path is resolved by the server.
+ *
+ * client -> server, any number of times (requests are served in order):
+ *   uint32 n, the number of samples wanted (1..MTS_SERVER_MAX_BATCH)
+ *
+ * server -> client, one reply per request:
+ *   uint64 len, then len bytes: uint32 count, then count records
+ *
+ * record:
+ *   mts_record_header_t, caption (caption_len bytes, no terminator),
+ *   height*width grayscale pixels (row major)
+ *
+ * A bad hello or request gets the connection closed. */
+
+#define MTS_SERVER_MAGIC 0x3153544d /* "MTS1" */
+
+#define MTS_SERVER_SOCKET "/tmp/mts-server.sock"
+
+#define MTS_SERVER_MAX_BATCH 4096
+
+typedef struct mts_record_header {
+  uint32_t height;
+  uint32_t width;
+  uint32_t caption_len;
+} mts_record_header_t;
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // sched_getcpu, CPU_* macros
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/sem.h>
@@ -5,6 +6,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
 #include "prod_cons.h"
 
@@ -24,11 +31,20 @@ void set_key(key_t* key, char uniq) {
 }
 
 int get_shmid(int create) {
+  return get_shmid_ring(create, 0);
+}
+
+int get_shmid_ring(int create, int ring) {
   key_t key;
   int shmid;
 
-  /* Get key */
-  set_key(&key, 'B');
+  if(ring < 0 || ring >= MAX_RINGS) {
+    fprintf(stderr, "Ring must be between 0 and %d.\n", MAX_RINGS - 1);
+    exit(1);
+  }
+
+  /* Get key (one per ring) */
+  set_key(&key, RING_KEY_CHAR(ring));
   
   /* get or create shared memory segment */
   int shmflags = create ? (0666 | IPC_CREAT) : 0666;
@@ -41,9 +57,13 @@ int get_shmid(int create) {
 }
 
 void* get_shared_buff(int create) {
+  return get_shared_buff_ring(create, 0);
+}
+
+void* get_shared_buff_ring(int create, int ring) {
   char* data;
 
-  int shmid = get_shmid(create);
+  int shmid = get_shmid_ring(create, ring);
 
   /* attach to the segment to get a ptr */
   data = shmat(shmid, (void*)0, 0);
@@ -57,13 +77,16 @@ void* get_shared_buff(int create) {
 
 /* Really get semid for semaphores */
 int get_semaphores(int create) {
+  return get_semaphores_ring(create, 0);
+}
+
+int get_semaphores_ring(int create, int ring) {
   key_t key;
-  struct semid_ds buf;
   struct sembuf sb;
   int semid;
   
-  /* Get key */
-  set_key(&key, 'B');
+  /* Get key (one per ring) */
+  set_key(&key, RING_KEY_CHAR(ring));
 
   int semflags = create ? 0666 | IPC_CREAT : 0666;
   semid = semget(key, 1, semflags);
@@ -115,3 +138,185 @@ void unlock_buff(int semid) {
   // apply sop to semaphore `semid`
   semop(semid, &sop, 1); 
 }
+
+/* Monotonic clock in nanoseconds (shared by all processes on the machine) */
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Find a free slot in the ring header (or one left behind by a dead
+ * producer) and mark it as ours */
+int claim_producer_slot(void* buff, pid_t pid) {
+  ring_header_t* hdr = (ring_header_t*)buff;
+
+  for(int i = 0; i < MAX_PRODUCERS; i++) {
+    producer_stats_t* slot = &hdr->producers[i];
+    int32_t owner = slot->pid;
+
+    // Slot is taken by a producer that is still around
+    if(owner != 0 && (kill(owner, 0) == 0 || errno != ESRCH)) {
+      continue;
+    }
+
+    // Someone else may be claiming it at the same time
+    if(!__sync_bool_compare_and_swap(&slot->pid, owner, (int32_t)pid)) {
+      continue;
+    }
+
+    // Fresh counters for the new owner
+    slot->samples_produced = 0;
+    slot->bytes_produced = 0;
+    slot->samples_consumed = 0;
+    slot->bytes_consumed = 0;
+    slot->blocked_full_ns = 0;
+    slot->heartbeat_ns = now_ns();
+    return i;
+  }
+  return -1;
+}
+
+/* Number of rings set up by `base` (they are numbered from 0 up) */
+int count_rings(void) {
+  int n = 0;
+  key_t key;
+  while(n < MAX_RINGS) {
+    set_key(&key, RING_KEY_CHAR(n));
+    if(shmget(key, 0, 0666) == -1) {
+      break;
+    }
+    n++;
+  }
+  return n;
+}
+
+/* Placement policy, as given by MTS_IPC_PLACEMENT */
+int get_placement_policy(void) {
+  char* policy = getenv("MTS_IPC_PLACEMENT");
+  if(policy == NULL || strcmp(policy, "none") == 0) {
+    return PLACEMENT_NONE;
+  } else if(strcmp(policy, "pin") == 0) {
+    return PLACEMENT_PIN;
+  } else if(strcmp(policy, "numa") == 0) {
+    return PLACEMENT_NUMA;
+  } else if(strcmp(policy, "numa-rings") == 0) {
+    return PLACEMENT_NUMA_RINGS;
+  }
+  fprintf(stderr, "Unknown MTS_IPC_PLACEMENT '%s' "
+	  "(expected none, pin, numa or numa-rings).\n", policy);
+  exit(1);
+}
+
+/* Read the cpus of a NUMA node from sysfs; 0 if there is no such node */
+static int read_node_cpus(int node, cpu_set_t* set) {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+  FILE* f = fopen(path, "r");
+  if(f == NULL) {
+    return 0;
+  }
+
+  // Format is e.g. "0-15,32-47"
+  CPU_ZERO(set);
+  int lo, hi;
+  char sep;
+  while(fscanf(f, "%d", &lo) == 1) {
+    hi = lo;
+    if(fscanf(f, "%c", &sep) == 1 && sep == '-') {
+      if(fscanf(f, "%d", &hi) != 1) {
+	break;
+      }
+      if(fscanf(f, "%c", &sep) != 1) {
+	sep = '\n';
+      }
+    }
+    for(int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, set);
+    }
+    if(sep != ',') {
+      break;
+    }
+  }
+  fclose(f);
+  return 1;
+}
+
+/* Number of NUMA nodes (1 on machines/kernels without NUMA info) */
+int numa_num_nodes(void) {
+  cpu_set_t set;
+  int n = 0;
+  while(read_node_cpus(n, &set)) {
+    n++;
+  }
+  return n > 0 ? n : 1;
+}
+
+/* NUMA node of the cpu the caller is currently running on */
+int numa_current_node(void) {
+  int cpu = sched_getcpu();
+  cpu_set_t set;
+  for(int node = 0; cpu >= 0 && read_node_cpus(node, &set); node++) {
+    if(CPU_ISSET(cpu, &set)) {
+      return node;
+    }
+  }
+  return 0;
+}
+
+/* The index-th (wrapping around) cpu the caller may run on, restricted to
+ * `node` if node >= 0; -1 if there is none */
+int numa_pick_cpu(int node, int index) {
+  cpu_set_t allowed, node_set;
+  if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+    perror("sched_getaffinity");
+    return -1;
+  }
+  if(node >= 0 && read_node_cpus(node, &node_set)) {
+    CPU_AND(&allowed, &allowed, &node_set);
+  }
+
+  int count = CPU_COUNT(&allowed);
+  if(count == 0) {
+    return -1;
+  }
+  index %= count;
+  for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if(CPU_ISSET(cpu, &allowed) && index-- == 0) {
+      return cpu;
+    }
+  }
+  return -1;
+}
+
+/* Pin the calling process to a single cpu (inherited across exec) */
+int pin_to_cpu(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if(sched_setaffinity(0, sizeof(set), &set) == -1) {
+    perror("sched_setaffinity");
+    return -1;
+  }
+  return 0;
+}
+
+// From <numaif.h>, spelled out so we don't need libnuma to build
+#define MTS_MPOL_BIND 2
+#define MTS_MPOL_MF_MOVE (1 << 1)
+
+/* Bind (and migrate) the pages of [addr, addr+len) to a NUMA node */
+int bind_to_node(void* addr, uint64_t len, int node) {
+  unsigned long mask = 1UL << node;
+  if(node < 0 || node >= (int)(8 * sizeof(mask))) {
+    fprintf(stderr, "Can't bind to NUMA node %d.\n", node);
+    return -1;
+  }
+  if(syscall(SYS_mbind, addr, len, MTS_MPOL_BIND, &mask,
+	     8 * sizeof(mask) + 1, MTS_MPOL_MF_MOVE) == -1) {
+    perror("mbind");
+    return -1;
+  }
+  return 0;
+}
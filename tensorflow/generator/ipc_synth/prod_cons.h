@@ -1,6 +1,8 @@
 #ifndef PROD_CONS_H
+#define PROD_CONS_H
 
 #include <stdint.h>
+#include <sys/types.h>
 
 // 1 GB
 #define SHM_SIZE 1073741824
@@ -8,8 +10,52 @@
 // Upper limit to word length
 #define MAX_WORD_LENGTH 63
 
+// Upper limit to number of producers tracked in the ring header
+#define MAX_PRODUCERS 64
+
+// Upper limit to number of rings (one per NUMA node with numa-rings)
+#define MAX_RINGS 8
+
+// Character used (with MTS_IPC) to make the IPC key of a ring
+#define RING_KEY_CHAR(ring) ((char)('B' + (ring)))
+
+// Placement policies (MTS_IPC_PLACEMENT=none|pin|numa|numa-rings)
+#define PLACEMENT_NONE 0       // let the scheduler do as it pleases
+#define PLACEMENT_PIN 1        // pin each producer to its own core
+#define PLACEMENT_NUMA 2       // ... on the consumer's node, ring bound there
+#define PLACEMENT_NUMA_RINGS 3 // one ring per node, producers pinned per node
+
+/* Live counters kept by a single producer (one slot per producer pid).
+ * Producers only ever add to their own slot; the consumer adds to the
+ * consumed counters of the slot that wrote the chunk it just ate. */
+typedef struct producer_stats {
+  volatile int32_t pid;          // 0 if the slot is free
+  uint32_t pad;
+  uint64_t samples_produced;
+  uint64_t bytes_produced;
+  uint64_t samples_consumed;
+  uint64_t bytes_consumed;
+  uint64_t blocked_full_ns;      // time spent waiting for the ring to drain
+  uint64_t heartbeat_ns;         // CLOCK_MONOTONIC of last sign of life
+} producer_stats_t;
+
+/* Header at the very start of the shared buffer.
+ * produce_offset and consume_offset MUST stay the first two words, since
+ * producers and consumer address them as buff[0] and buff[1]. */
+typedef struct ring_header {
+  uint64_t produce_offset;
+  uint64_t consume_offset;
+  uint64_t samples_produced;     // ring-wide totals, never reset, so that
+  uint64_t bytes_produced;       // produced - consumed is what's in flight
+  uint64_t samples_consumed;
+  uint64_t bytes_consumed;
+  uint64_t consumer_wait_ns;     // time the consumer spent polling on empty
+  uint64_t consumer_heartbeat_ns;
+  producer_stats_t producers[MAX_PRODUCERS];
+} ring_header_t;
+
 // Offset into buffer where data chunks are stored
-#define START_BUFF_OFFSET (sizeof(uint64_t)*2)
+#define START_BUFF_OFFSET (sizeof(ring_header_t))
 
 // magic num to specify 'able to consume' ("eat!")
 #define SHOULD_CONSUME ((uint64_t)0x21746165)
@@ -18,21 +64,38 @@
 #define ALREADY_CONSUMED ((uint64_t)0x64657375)
 
 // Size of chunk w/o image
-#define BASE_CHUNK_SIZE sizeof(uint64_t) + (MAX_WORD_LENGTH + 1)*sizeof(char) \
-                        + sizeof(uint64_t) + sizeof(uint64_t)
+#define BASE_CHUNK_SIZE (sizeof(uint64_t) + (MAX_WORD_LENGTH + 1)*sizeof(char) \
+                         + sizeof(uint64_t) + sizeof(uint64_t))
 
 // Magic number for producers to write to tell consumer to wrap
 #define NO_SPACE_TO_PRODUCE (uint64_t)0xc001be9
 
+// Chunk height word: low 32 bits are the image height, high 32 bits
+// are the index of the producer slot that wrote the chunk
+#define CHUNK_HEIGHT(word) ((uint32_t)(word))
+#define CHUNK_SLOT(word) ((uint32_t)((word) >> 32))
+#define CHUNK_HEIGHT_WORD(height, slot) \
+  (((uint64_t)(slot) << 32) | (uint32_t)(height))
+
+// Lock-free counter update (cheap enough for the hot path)
+#define STAT_ADD(field, val) __sync_fetch_and_add(&(field), (uint64_t)(val))
+
 /* Exposed functions below -- abstract away the nits grits of UNIX IPC */
+/* The plain versions work on ring 0 (the only one, unless numa-rings) */
 // Get ptr to shared buff
 void* get_shared_buff(int create);
+void* get_shared_buff_ring(int create, int ring);
 
 // Get semid
 int get_semaphores(int create);
+int get_semaphores_ring(int create, int ring);
 
 // Get shmid
 int get_shmid(int create);
+int get_shmid_ring(int create, int ring);
+
+// Number of rings that currently exist
+int count_rings(void);
 
 // Lock buff (by semid)
 void lock_buff(int semid);
@@ -40,4 +103,30 @@ void lock_buff(int semid);
 // Unlock buff (by semid)
 void unlock_buff(int semid);
 
+/* Telemetry helpers */
+// Monotonic clock in nanoseconds
+uint64_t now_ns(void);
+
+// Claim (or reclaim from a dead pid) a producer slot; -1 if all are taken
+int claim_producer_slot(void* buff, pid_t pid);
+
+/* Placement helpers */
+// Policy from MTS_IPC_PLACEMENT
+int get_placement_policy(void);
+
+// Number of NUMA nodes (1 if unknown)
+int numa_num_nodes(void);
+
+// Node the caller is running on
+int numa_current_node(void);
+
+// index-th allowed cpu (on `node`, unless node < 0); -1 if none
+int numa_pick_cpu(int node, int index);
+
+// Pin caller to a cpu
+int pin_to_cpu(int cpu);
+
+// Bind memory to a NUMA node (moving pages already there)
+int bind_to_node(void* addr, uint64_t len, int node);
+
 #endif
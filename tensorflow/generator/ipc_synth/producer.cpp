@@ -8,6 +8,9 @@
 #include <opencv2/opencv.hpp>
 #include <signal.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
 
 #include "map_text_synthesizer.hpp"
 
@@ -18,8 +21,27 @@ extern "C" {
 // Necessary for signal handler
 void* g_buff;
 
+// This producer's telemetry slot in the ring header (NULL if none free)
+producer_stats_t* g_stats;
+uint32_t g_slot;
+
+// Set by SIGTERM: finish the sample in hand, then exit
+volatile sig_atomic_t g_retire = 0;
+
+/* Fork-server state: the server keeps `g_target_workers` workers alive,
+ * SIGUSR1/SIGUSR2 ask for one more/one less */
+volatile sig_atomic_t g_target_workers = 0;
+volatile sig_atomic_t g_children_changed = 0;
+pid_t g_worker_pids[MAX_PRODUCERS];
+int g_worker_retired[MAX_PRODUCERS];
+
+/* Our share of the epoch order: shard g_shard of g_shards (a fork-server's
+ * worker i takes shard g_shard + i) */
+uint32_t g_shard = 0;
+uint32_t g_shards = 1;
+
 /* Write sample data into buff naively */
-void write_data(intptr_t buff, uint32_t height,
+void write_data(intptr_t buff, uint64_t height,
 		const char* label, uint64_t img_sz, unsigned char* img_flat) {
 
   /* Keep track of start to write to later */
@@ -48,19 +70,22 @@ void write_data(intptr_t buff, uint32_t height,
   *start_buff = SHOULD_CONSUME;
 }
 
-/* Create synthesizer and produce until signaled */
-void produce(intptr_t buff, int semid, const char* config_file) {
-
-  // Create mts according to config file
-  cv::Ptr<MapTextSynthesizer> mts = MapTextSynthesizer::create(config_file);
+/* Produce with the given synthesizer until signaled */
+void produce(intptr_t buff, int semid, cv::Ptr<MapTextSynthesizer> mts) {
 
   // Allocate some stack space for MTS data
   std::string label;
   cv::Mat image;
   int height;
 
-  // Produce loop (terminates only by signal)
-  while(1) {
+  ring_header_t* hdr = (ring_header_t*)buff;
+
+  // Produce loop (terminates by signal, or when retired)
+  while(!g_retire) {
+    if(g_stats) {
+      g_stats->heartbeat_ns = now_ns();
+    }
+
     // Fill label, image, height with data from next synth sample
     mts->generateSample(label, image, height);
     
@@ -69,8 +94,12 @@ void produce(intptr_t buff, int semid, const char* config_file) {
       fprintf(stderr, "Nothing generated by synthesizer.\n");
       exit(1);
     }
+    if(image.type() != CV_8UC1) {
+      fprintf(stderr, "IPC_SYNTH_ERROR: samples must be 8 bit (unset output_float in the config).\n");
+      exit(1);
+    }
     if(label.length() > MAX_WORD_LENGTH) {
-      fprintf(stderr, "IPC_SYNTH_ERROR: MTS produced an image larger than MAX_WORD_LENGTH. Update macro in prod_cons.h or remove this word from your caption list.\nOffending word: %s\nSkipping this word!\n", label.c_str());
+      fprintf(stderr, "IPC_SYNTH_ERROR: MTS produced a caption longer than MAX_WORD_LENGTH. Set caption_max_bytes in the config to drop such captions at load time, or update the macro in prod_cons.h.\nOffending word: %s\nSkipping this word!\n", label.c_str());
       continue;
     }
     // Calculate image size w/ 1 channel
@@ -110,6 +139,7 @@ void produce(intptr_t buff, int semid, const char* config_file) {
      * that the producer offset is greater than the consume offset 
      * (ie a write that would corrupt memory)
      */
+    uint64_t blocked_start = now_ns();
     while(write_loc - buff < consume_offset
 	  && *((uint64_t*)buff) >= consume_offset) {
       sleep(5); // 5 is arbitrary
@@ -124,11 +154,23 @@ void produce(intptr_t buff, int semid, const char* config_file) {
 	       (void*)&needle, sizeof(uint64_t))) {
       sleep(5); // 5 is arbitrary
     }
+    uint64_t blocked_ns = now_ns() - blocked_start;
     
     unlock_buff(semid);
 
+    /* Telemetry, counted before the sample is published: the consumer
+       can't count it as consumed before it is counted as produced, so
+       produced - consumed never goes negative */
+    STAT_ADD(hdr->samples_produced, 1);
+    STAT_ADD(hdr->bytes_produced, BASE_CHUNK_SIZE + image_size);
+    if(g_stats) {
+      STAT_ADD(g_stats->samples_produced, 1);
+      STAT_ADD(g_stats->bytes_produced, BASE_CHUNK_SIZE + image_size);
+      STAT_ADD(g_stats->blocked_full_ns, blocked_ns);
+    }
+
     /* Write data into buff */
-    write_data(write_loc, height, label.c_str(),
+    write_data(write_loc, CHUNK_HEIGHT_WORD(height, g_slot), label.c_str(),
 	       image_size, image.data);
   }
 }
@@ -142,23 +184,244 @@ void cleanup(int signo) {
   exit(1);
 }
 
+/* SIGTERM handler (autoscaler retiring this producer) */
+void retire(int signo) {
+  g_retire = 1;
+}
+
+/* Install the handlers of a process that writes to the ring */
+void init_producer_signals(void) {
+  struct sigaction sa;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  sa.sa_handler = cleanup;
+  sigaction(SIGHUP, &sa, NULL);
+
+  // Never bail out in the middle of a write, or the consumer would stall
+  sa.sa_handler = retire;
+  sigaction(SIGTERM, &sa, NULL);
+
+  // Only the fork-server cares about these
+  sa.sa_handler = SIG_DFL;
+  sigaction(SIGCHLD, &sa, NULL);
+  sigaction(SIGUSR1, &sa, NULL);
+  sigaction(SIGUSR2, &sa, NULL);
+}
+
+/* Register for telemetry (keep producing even if all slots are taken) */
+void register_producer(void) {
+  int slot = claim_producer_slot(g_buff, getpid());
+  if(slot < 0) {
+    fprintf(stderr, "No free producer slot in ring header, "
+	    "running without telemetry.\n");
+    g_stats = NULL;
+    g_slot = MAX_PRODUCERS;
+  } else {
+    g_stats = &((ring_header_t*)g_buff)->producers[slot];
+    g_slot = (uint32_t)slot;
+  }
+}
+
+/* Fork-server signal handlers: just note what happened, the server loop
+ * does the forking */
+void server_child_handler(int signo) {
+  g_children_changed = 1;
+}
+
+void server_add_handler(int signo) {
+  if(g_target_workers < MAX_PRODUCERS) {
+    g_target_workers++;
+  }
+}
+
+void server_retire_handler(int signo) {
+  if(g_target_workers > 0) {
+    g_target_workers--;
+  }
+}
+
+/* Fork one worker from the initialized synthesizer (in worker slot i) */
+pid_t fork_worker(int i, int semid, int node,
+		  cv::Ptr<MapTextSynthesizer> mts) {
+  pid_t pid = fork();
+  if(pid == -1) {
+    perror("fork worker");
+    return 0;
+  } else if(pid == 0) {
+    // Die along with the server
+    prctl(PR_SET_PDEATHSIG, SIGHUP);
+    init_producer_signals();
+
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+
+    // Placement is per worker, since they all come from one process
+    if(get_placement_policy() != PLACEMENT_NONE) {
+      int cpu = numa_pick_cpu(node, i);
+      if(cpu >= 0) {
+	pin_to_cpu(cpu);
+      }
+    }
+
+    // Fonts and captions are shared copy-on-write; only the random
+    // streams need to be made our own
+    mts->setSeed(((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL)
+		 ^ ((uint64_t)i << 16));
+    mts->setEpochShard((g_shard + i) % g_shards, g_shards);
+
+    register_producer();
+    produce((intptr_t)g_buff, semid, mts);
+
+    if(shmdt(g_buff) == -1) {
+      perror("shmdt");
+      exit(1);
+    }
+    exit(0);
+  }
+  return pid;
+}
+
+/* Keep g_target_workers workers forked from the (already initialized)
+ * synthesizer, until retired and all of the workers are gone */
+void serve(int semid, int node, cv::Ptr<MapTextSynthesizer> mts) {
+  struct sigaction sa;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  sa.sa_handler = server_child_handler;
+  sigaction(SIGCHLD, &sa, NULL);
+  sa.sa_handler = server_add_handler;
+  sigaction(SIGUSR1, &sa, NULL);
+  sa.sa_handler = server_retire_handler;
+  sigaction(SIGUSR2, &sa, NULL);
+
+  // Handle signals only while waiting, so nothing changes under our feet
+  sigset_t mask, old_mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGUSR2);
+  sigprocmask(SIG_BLOCK, &mask, &old_mask);
+
+  while(1) {
+    // Asked to go away ourselves: let the workers finish their writes first
+    if(g_retire) {
+      g_target_workers = 0;
+    }
+
+    // Reap workers; retired ones are gone for good, crashed ones respawn
+    pid_t pid;
+    int wstatus;
+    while((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+      for(int i = 0; i < MAX_PRODUCERS; i++) {
+	if(g_worker_pids[i] == pid) {
+	  g_worker_pids[i] = 0;
+	  g_worker_retired[i] = 0;
+	  break;
+	}
+      }
+    }
+    g_children_changed = 0;
+
+    int live = 0;
+    for(int i = 0; i < MAX_PRODUCERS; i++) {
+      if(g_worker_pids[i] != 0 && !g_worker_retired[i]) {
+	live++;
+      }
+    }
+
+    // Grow into free slots, shrink from the last slot
+    for(int i = 0; i < MAX_PRODUCERS && live < g_target_workers; i++) {
+      if(g_worker_pids[i] == 0) {
+	g_worker_pids[i] = fork_worker(i, semid, node, mts);
+	if(g_worker_pids[i] != 0) {
+	  live++;
+	}
+      }
+    }
+    for(int i = MAX_PRODUCERS - 1; i >= 0 && live > g_target_workers; i--) {
+      if(g_worker_pids[i] != 0 && !g_worker_retired[i]) {
+	g_worker_retired[i] = 1;
+	kill(g_worker_pids[i], SIGTERM);
+	live--;
+      }
+    }
+
+    if(g_retire) {
+      int remaining = 0;
+      for(int i = 0; i < MAX_PRODUCERS; i++) {
+	remaining += g_worker_pids[i] != 0;
+      }
+      if(remaining == 0) {
+	return;
+      }
+    }
+
+    sigsuspend(&old_mask);
+  }
+}
+
+/* Print usage and bail */
+void usage(void) {
+  fprintf(stderr,"usage: producer [-w workers [-n numa_node]] "
+	  "[-s shard -S shards] \"/path/to/config_file\" [ring]\n");
+  exit(1);
+}
+
 /* main */
 int main(int argc, char *argv[]) {
-  if(argc != 2) {
-    fprintf(stderr,"usage: producer \"/path/to/config_file\"");
-    exit(1);
+  int workers = 0;
+  int node = -1;
+  int opt;
+  int shard = 0;
+  int shards = 1;
+  while((opt = getopt(argc, argv, "w:n:s:S:")) != -1) {
+    switch(opt) {
+    case 'w':
+      workers = atoi(optarg);
+      break;
+    case 'n':
+      node = atoi(optarg);
+      break;
+    case 's':
+      shard = atoi(optarg);
+      break;
+    case 'S':
+      shards = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
   }
+  if(optind >= argc || argc - optind > 2 || workers < 0
+     || shards < 1 || shard < 0 || shard >= shards) {
+    usage();
+  }
+  g_shard = (uint32_t)shard;
+  g_shards = (uint32_t)shards;
+  const char* config_file = argv[optind];
+  int ring = argc - optind == 2 ? atoi(argv[optind + 1]) : 0;
   
-  struct sigaction sa;
-  sa.sa_handler = cleanup;
-  sigaction(SIGHUP, NULL, &sa);
-  
-  g_buff = get_shared_buff(0);
-  int semid = get_semaphores(0);
+  init_producer_signals();
   
-  produce((intptr_t)g_buff, semid, argv[1]);
+  g_buff = get_shared_buff_ring(0, ring);
+  int semid = get_semaphores_ring(0, ring);
+
+  // Create mts according to config file (the expensive part: fonts,
+  // caption files, ...)
+  cv::Ptr<MapTextSynthesizer> mts = MapTextSynthesizer::create(config_file);
+
+  if(workers > 0) {
+    // Fork-server: returns once retired and all workers are gone
+    g_target_workers = workers;
+    serve(semid, node, mts);
+  } else {
+    mts->setEpochShard(g_shard, g_shards);
+    register_producer();
+    produce((intptr_t)g_buff, semid, mts);
+  }
   
-  /* detach from segment (NOTE: program ex really shouldn't reach this...) */
+  /* detach from segment (reached when retired by the autoscaler) */
   if(shmdt(g_buff) == -1) {
     perror("shmdt");
     exit(1);
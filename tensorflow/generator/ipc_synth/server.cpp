@@ -0,0 +1,672 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <opencv2/opencv.hpp>
+
+#include <string>
+#include <vector>
+#include <deque>
+
+#include "map_text_synthesizer.hpp"
+#include "mts_server.h"
+
+// Default number of workers per config
+#define DEFAULT_WORKERS 4
+
+// Default number of finished samples buffered per config
+#define DEFAULT_QUEUE 1024
+
+// Size of the worker -> server socket buffers (more buffering for free)
+#define WORKER_SNDBUF (4 * 1024 * 1024)
+
+#define READ_CHUNK (256 * 1024)
+
+/* A worker process synthesizing for one pool */
+struct worker_t {
+  pid_t pid;
+  int fd;
+  std::string in;
+};
+
+/* Warm workers and finished samples for one config. The synthesizer
+ * lives in a pool process, which loads the config without holding up the
+ * server, forks the workers and hands their sockets over ctl */
+struct pool_t {
+  std::string config;
+  pid_t pid;
+  int ctl;             // -1 once the pool process is gone
+  bool failed;         // the pool process died; its clients are dropped
+  std::vector<worker_t> workers;
+  std::deque<std::string> ready;
+};
+
+/* A connected client */
+struct client_t {
+  int fd;
+  int pool;            // -1 until the hello has been read
+  std::string in;
+  std::deque<uint32_t> requests;
+  uint32_t filled;     // records in batch so far (for requests.front())
+  std::string batch;
+  std::string out;
+  size_t out_pos;
+};
+
+std::vector<pool_t> g_pools;
+std::vector<client_t> g_clients;
+int g_listen_fd = -1;
+int g_num_workers = DEFAULT_WORKERS;
+size_t g_queue = DEFAULT_QUEUE;
+
+volatile sig_atomic_t g_quit = 0;
+
+void quit_handler(int signo) {
+  g_quit = 1;
+}
+
+/* Write all of len bytes (blocking) or die */
+void write_all(int fd, const char* data, size_t len) {
+  while(len > 0) {
+    ssize_t n = write(fd, data, len);
+    if(n < 0) {
+      if(errno == EINTR) {
+	continue;
+      }
+      // Server went away
+      exit(0);
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+/* Worker: synthesize forever, writing records to fd. Blocks (and so stops
+ * synthesizing) whenever the server isn't draining its socket */
+void work(int fd, cv::Ptr<MapTextSynthesizer> mts) {
+  std::string label;
+  cv::Mat image;
+  int height;
+  std::string record;
+
+  while(1) {
+    mts->generateSample(label, image, height);
+    if(image.type() != CV_8UC1) {
+      fprintf(stderr, "mts-server: samples must be 8 bit (unset output_float)\n");
+      exit(1);
+    }
+
+    mts_record_header_t hdr;
+    hdr.height = image.rows;
+    hdr.width = image.cols;
+    hdr.caption_len = label.size();
+
+    record.assign((const char*)&hdr, sizeof(hdr));
+    record.append(label);
+    for(int row = 0; row < image.rows; row++) {
+      record.append((const char*)image.ptr<uchar>(row), image.cols);
+    }
+    write_all(fd, record.data(), record.size());
+  }
+}
+
+/* In a child of the server: close the listening socket, the clients and
+ * every pool's sockets, so that only the server holds them and closing one
+ * gives EOF at the other end */
+void close_server_fds(void) {
+  if(g_listen_fd != -1) {
+    close(g_listen_fd);
+  }
+  for(size_t i = 0; i < g_clients.size(); i++) {
+    close(g_clients[i].fd);
+  }
+  for(size_t p = 0; p < g_pools.size(); p++) {
+    if(g_pools[p].ctl != -1) {
+      close(g_pools[p].ctl);
+    }
+    for(size_t i = 0; i < g_pools[p].workers.size(); i++) {
+      close(g_pools[p].workers[i].fd);
+    }
+  }
+}
+
+/* Pool process: hand a worker's socket (and pid) to the server */
+void send_worker(int ctl, int fd, pid_t pid) {
+  struct msghdr msg;
+  struct iovec iov;
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  memset(&msg, 0, sizeof(msg));
+  memset(cbuf, 0, sizeof(cbuf));
+  iov.iov_base = &pid;
+  iov.iov_len = sizeof(pid);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  while(sendmsg(ctl, &msg, 0) == -1) {
+    if(errno != EINTR) {
+      // Server went away
+      exit(0);
+    }
+  }
+}
+
+/* Pool process: fork worker `slot` from the initialized synthesizer,
+ * returning its pid */
+pid_t spawn_worker(cv::Ptr<MapTextSynthesizer> mts, int ctl, int slot) {
+  int fds[2];
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+    perror("socketpair");
+    exit(1);
+  }
+  int sndbuf = WORKER_SNDBUF;
+  setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+  pid_t pid = fork();
+  if(pid == -1) {
+    perror("fork");
+    exit(1);
+  } else if(pid == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGHUP);
+    close(fds[0]);
+    close(ctl);
+
+    // Fonts and captions are shared copy-on-write with the pool process;
+    // only the random streams need to be made our own
+    mts->setSeed(((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL));
+    mts->setEpochShard(slot, g_num_workers);
+    work(fds[1], mts);
+    exit(0);
+  }
+
+  close(fds[1]);
+  send_worker(ctl, fds[0], pid);
+  close(fds[0]);
+  return pid;
+}
+
+/* Pool process: load the config, then keep g_num_workers workers running.
+ * A bad config makes create exit, which the server sees as EOF on ctl.
+ * A respawned worker takes its predecessor's slot (and epoch shard) */
+void run_pool(const char* config, int ctl) {
+  cv::Ptr<MapTextSynthesizer> mts = MapTextSynthesizer::create(config);
+
+  std::vector<pid_t> slots(g_num_workers, 0);
+  while(1) {
+    for(int i = 0; i < g_num_workers; i++) {
+      if(slots[i] == 0) {
+	slots[i] = spawn_worker(mts, ctl, i);
+      }
+    }
+    pid_t pid = wait(NULL);
+    if(pid == -1) {
+      if(errno == EINTR) {
+	continue;
+      }
+      perror("wait");
+      exit(1);
+    }
+    fprintf(stderr, "mts-server: worker %d died, respawning\n", pid);
+    for(int i = 0; i < g_num_workers; i++) {
+      if(slots[i] == pid) {
+	slots[i] = 0;
+      }
+    }
+  }
+}
+
+/* Find the pool for config, starting its pool process if need be (the
+ * config loads there, while the server carries on). Returns -1 if the
+ * config file can't be resolved */
+int get_pool(const std::string& config) {
+  char resolved[PATH_MAX];
+  if(!realpath(config.c_str(), resolved)) {
+    return -1;
+  }
+  for(size_t p = 0; p < g_pools.size(); p++) {
+    if(g_pools[p].config == resolved && !g_pools[p].failed) {
+      return p;
+    }
+  }
+
+  // Datagrams, so that each worker's socket arrives on its own
+  int ctl[2];
+  if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, ctl) == -1) {
+    perror("socketpair");
+    exit(1);
+  }
+
+  fprintf(stderr, "mts-server: loading %s\n", resolved);
+  pid_t pid = fork();
+  if(pid == -1) {
+    perror("fork");
+    exit(1);
+  } else if(pid == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGHUP);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    close_server_fds();
+    close(ctl[0]);
+    run_pool(resolved, ctl[1]);
+    exit(0);
+  }
+  close(ctl[1]);
+  fcntl(ctl[0], F_SETFL, O_NONBLOCK);
+
+  pool_t pool;
+  pool.config = resolved;
+  pool.pid = pid;
+  pool.ctl = ctl[0];
+  pool.failed = false;
+  g_pools.push_back(pool);
+  return g_pools.size() - 1;
+}
+
+/* Take a worker socket the pool process sent. Returns 0 if the pool
+ * process is gone */
+int read_pool(pool_t& pool) {
+  struct msghdr msg;
+  struct iovec iov;
+  pid_t pid;
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &pid;
+  iov.iov_len = sizeof(pid);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  ssize_t n = recvmsg(pool.ctl, &msg, 0);
+  if(n < 0) {
+    return errno == EAGAIN || errno == EINTR;
+  }
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if(n != sizeof(pid) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+    return 0;
+  }
+
+  worker_t w;
+  w.pid = pid;
+  memcpy(&w.fd, CMSG_DATA(cmsg), sizeof(int));
+  fcntl(w.fd, F_SETFL, O_NONBLOCK);
+  pool.workers.push_back(w);
+  return 1;
+}
+
+/* Move complete records from a worker's input into its pool's queue */
+void parse_records(pool_t& pool, worker_t& w) {
+  size_t pos = 0;
+  while(w.in.size() - pos >= sizeof(mts_record_header_t)) {
+    mts_record_header_t hdr;
+    memcpy(&hdr, w.in.data() + pos, sizeof(hdr));
+    size_t len = sizeof(hdr) + hdr.caption_len
+      + (size_t)hdr.height * hdr.width;
+    if(w.in.size() - pos < len) {
+      break;
+    }
+    pool.ready.push_back(w.in.substr(pos, len));
+    pos += len;
+  }
+  w.in.erase(0, pos);
+}
+
+/* Read what a worker has written. Returns 0 if it died */
+int read_worker(pool_t& pool, worker_t& w) {
+  char buf[READ_CHUNK];
+  ssize_t n = read(w.fd, buf, sizeof(buf));
+  if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    return 0;
+  }
+  if(n > 0) {
+    w.in.append(buf, n);
+    parse_records(pool, w);
+  }
+  return 1;
+}
+
+/* Parse the hello and requests a client has sent. Returns 0 if the client
+ * misbehaved */
+int parse_client(client_t& c) {
+  size_t pos = 0;
+  if(c.pool < 0) {
+    if(c.in.size() < 2 * sizeof(uint32_t)) {
+      return 1;
+    }
+    uint32_t magic, len;
+    memcpy(&magic, c.in.data(), sizeof(magic));
+    memcpy(&len, c.in.data() + sizeof(magic), sizeof(len));
+    if(magic != MTS_SERVER_MAGIC || len == 0 || len >= PATH_MAX) {
+      return 0;
+    }
+    if(c.in.size() < 2 * sizeof(uint32_t) + len) {
+      return 1;
+    }
+    c.pool = get_pool(c.in.substr(2 * sizeof(uint32_t), len));
+    if(c.pool < 0) {
+      return 0;
+    }
+    pos = 2 * sizeof(uint32_t) + len;
+  }
+
+  while(c.in.size() - pos >= sizeof(uint32_t)) {
+    uint32_t n;
+    memcpy(&n, c.in.data() + pos, sizeof(n));
+    if(n == 0 || n > MTS_SERVER_MAX_BATCH) {
+      return 0;
+    }
+    c.requests.push_back(n);
+    pos += sizeof(n);
+  }
+  c.in.erase(0, pos);
+  return 1;
+}
+
+/* Give a client what its pool has ready, and queue up finished replies */
+void fill_client(client_t& c) {
+  if(c.pool < 0) {
+    return;
+  }
+  pool_t& pool = g_pools[c.pool];
+
+  // Only build the next reply once the last one has been sent
+  while(!c.requests.empty() && c.out_pos == c.out.size()) {
+    uint32_t wanted = c.requests.front();
+    while(c.filled < wanted && !pool.ready.empty()) {
+      c.batch.append(pool.ready.front());
+      pool.ready.pop_front();
+      c.filled++;
+    }
+    if(c.filled < wanted) {
+      return;
+    }
+
+    uint64_t len = sizeof(uint32_t) + c.batch.size();
+    c.out.assign((const char*)&len, sizeof(len));
+    c.out.append((const char*)&wanted, sizeof(wanted));
+    c.out.append(c.batch);
+    c.out_pos = 0;
+    c.batch.clear();
+    c.filled = 0;
+    c.requests.pop_front();
+  }
+}
+
+/* Send what we can of a client's reply. Returns 0 if it went away */
+int write_client(client_t& c) {
+  while(c.out_pos < c.out.size()) {
+    ssize_t n = write(c.fd, c.out.data() + c.out_pos,
+		      c.out.size() - c.out_pos);
+    if(n < 0) {
+      return errno == EAGAIN || errno == EINTR;
+    }
+    c.out_pos += n;
+  }
+  c.out.clear();
+  c.out_pos = 0;
+  return 1;
+}
+
+/* Read what a client has sent. Returns 0 if it went away or misbehaved */
+int read_client(client_t& c) {
+  char buf[4096];
+  ssize_t n = read(c.fd, buf, sizeof(buf));
+  if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    return 0;
+  }
+  if(n > 0) {
+    c.in.append(buf, n);
+    return parse_client(c);
+  }
+  return 1;
+}
+
+/* Listen on a unix domain socket */
+int listen_unix(const char* path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd == -1) {
+    perror("socket");
+    exit(1);
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long.\n");
+    exit(1);
+  }
+  strcpy(addr.sun_path, path);
+
+  // A stale socket from a previous server would make bind fail
+  unlink(path);
+  if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    perror("bind");
+    exit(1);
+  }
+  return fd;
+}
+
+/* Listen on a loopback TCP port */
+int listen_tcp(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(fd == -1) {
+    perror("socket");
+    exit(1);
+  }
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    perror("bind");
+    exit(1);
+  }
+  return fd;
+}
+
+/* Print usage and bail */
+void usage(void) {
+  fprintf(stderr, "usage: mts-server [-s socket_path | -p tcp_port] "
+	  "[-w workers] [-q queue] [-c config_file]...\n"
+	  "  -s  unix socket to listen on (default %s)\n"
+	  "  -p  listen on 127.0.0.1:port instead\n"
+	  "  -w  workers per config (default %d)\n"
+	  "  -q  samples buffered per config (default %d)\n"
+	  "  -c  load a config at startup (otherwise on first use)\n",
+	  MTS_SERVER_SOCKET, DEFAULT_WORKERS, DEFAULT_QUEUE);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  const char* socket_path = MTS_SERVER_SOCKET;
+  int port = 0;
+  std::vector<std::string> preload;
+
+  int opt;
+  while((opt = getopt(argc, argv, "s:p:w:q:c:")) != -1) {
+    switch(opt) {
+    case 's':
+      socket_path = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'w':
+      g_num_workers = atoi(optarg);
+      break;
+    case 'q':
+      g_queue = atol(optarg);
+      break;
+    case 'c':
+      preload.push_back(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if(optind != argc || g_num_workers < 1 || g_queue < 1 || port < 0) {
+    usage();
+  }
+
+  struct sigaction sa;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  sa.sa_handler = quit_handler;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  // A client hanging up mid-reply shouldn't take the server down
+  signal(SIGPIPE, SIG_IGN);
+
+  for(size_t i = 0; i < preload.size(); i++) {
+    if(get_pool(preload[i]) < 0) {
+      fprintf(stderr, "Could not find config file %s\n", preload[i].c_str());
+      exit(1);
+    }
+  }
+
+  int listen_fd = port ? listen_tcp(port) : listen_unix(socket_path);
+  g_listen_fd = listen_fd;
+  if(listen(listen_fd, 64) == -1) {
+    perror("listen");
+    exit(1);
+  }
+  fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+
+  std::vector<struct pollfd> fds;
+  while(!g_quit) {
+    // Listening socket, then clients, then each pool's control socket
+    // and workers
+    fds.clear();
+    struct pollfd pfd;
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+    fds.push_back(pfd);
+    for(size_t i = 0; i < g_clients.size(); i++) {
+      pfd.fd = g_clients[i].fd;
+      pfd.events = POLLIN;
+      if(g_clients[i].out_pos < g_clients[i].out.size()) {
+	pfd.events |= POLLOUT;
+      }
+      fds.push_back(pfd);
+    }
+    for(size_t p = 0; p < g_pools.size(); p++) {
+      // The pool process's socket (a negative fd is skipped by poll)
+      pfd.fd = g_pools[p].ctl;
+      pfd.events = POLLIN;
+      fds.push_back(pfd);
+
+      // Backpressure: a full queue leaves the workers blocked in write
+      short events = g_pools[p].ready.size() < g_queue ? POLLIN : 0;
+      for(size_t i = 0; i < g_pools[p].workers.size(); i++) {
+	pfd.fd = g_pools[p].workers[i].fd;
+	pfd.events = events;
+	fds.push_back(pfd);
+      }
+    }
+
+    if(poll(fds.data(), fds.size(), -1) == -1) {
+      if(errno == EINTR) {
+	continue;
+      }
+      perror("poll");
+      exit(1);
+    }
+
+    // Workers first, so freshly read samples go out this round
+    size_t k = 1 + g_clients.size();
+    for(size_t p = 0; p < g_pools.size(); p++) {
+      pool_t& pool = g_pools[p];
+      size_t ctl_k = k++;
+      size_t num_workers = pool.workers.size();
+      for(size_t i = 0, w = 0; i < num_workers; i++, k++) {
+	if(fds[k].revents && !read_worker(pool, pool.workers[w])) {
+	  // Died: the pool process reaps it and sends a replacement
+	  close(pool.workers[w].fd);
+	  pool.workers.erase(pool.workers.begin() + w);
+	  continue;
+	}
+	w++;
+      }
+
+      // New workers go after the ones polled above
+      if(fds[ctl_k].revents && !read_pool(pool)) {
+	fprintf(stderr, "mts-server: pool for %s died\n",
+		pool.config.c_str());
+	close(pool.ctl);
+	pool.ctl = -1;
+	pool.failed = true;
+	waitpid(pool.pid, NULL, 0);
+      }
+    }
+
+    // Clients (walking backwards so that removal is cheap to get right)
+    for(size_t i = g_clients.size(); i-- > 0; ) {
+      client_t& c = g_clients[i];
+      short revents = fds[1 + i].revents;
+      int ok = c.pool < 0 || !g_pools[c.pool].failed;
+      if(ok && (revents & (POLLIN | POLLHUP | POLLERR))) {
+	ok = read_client(c);
+      }
+      if(ok) {
+	fill_client(c);
+	ok = write_client(c);
+      }
+      if(!ok) {
+	close(c.fd);
+	g_clients.erase(g_clients.begin() + i);
+      }
+    }
+
+    // New clients
+    if(fds[0].revents & POLLIN) {
+      int fd;
+      while((fd = accept(listen_fd, NULL, NULL)) != -1) {
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	if(port) {
+	  int one = 1;
+	  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	client_t c;
+	c.fd = fd;
+	c.pool = -1;
+	c.filled = 0;
+	c.out_pos = 0;
+	g_clients.push_back(c);
+      }
+    }
+  }
+
+  // Workers die along with us (PR_SET_PDEATHSIG)
+  if(!port) {
+    unlink(socket_path);
+  }
+  return 0;
+}
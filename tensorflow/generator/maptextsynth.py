@@ -21,6 +21,7 @@ import os
 import tensorflow as tf
 import numpy as np
 from data_synth import multithreaded_data_generator as data_generator
+from data_synth import labeled_data_generator
 import pipeline
 import charset
 
@@ -36,6 +37,9 @@ def get_dataset( args=None ):
         becomes tensors. 
         NOTE: Local to get_dataset for sensible passing of args to generator
         function.  
+        args is [config_path, num_producers] plus, optionally, the path of
+        the model's charset file; with it, labels are encoded in C++ (needs
+        mtspy) instead of by charset.string_to_label.
         Returns:
         caption : ground truth string
         image   : raw mat object image [32, ?, 1] 
@@ -45,6 +49,16 @@ def get_dataset( args=None ):
     
         # Extract args
         [ config_path, num_producers ] = args[0:2]
+        charset_path = args[2] if len( args ) > 2 else None
+
+        if charset_path:
+            # Labels are encoded in C++ against the same charset file the
+            # model uses (captions outside it are dropped at load time)
+            gen = labeled_data_generator( config_path, charset_path,
+                                          num_producers )
+            while True:
+                caption, image, label = next( gen )
+                yield caption, image, label + 1
 
         # TODO/NOTE currently using 0 to get true single threaded synthesis
         gen = data_generator( config_path, num_producers )
@@ -130,6 +144,25 @@ def postbatch_fn( image, width, label, length, text ):
     return features, label
 
 
+def get_bucket_boundaries( config_path ):
+    """
+    Read the width_buckets boundaries from an MTS config file, to pass to
+    bucket_by_sequence_length along with element_length_fn. Returns None
+    when the config does not set any.
+    Note: widths are synthesized at the image height, so the boundaries
+    only line up with element_length_fn after rescaling when height_min
+    equals height_max.
+    """
+    with open( config_path ) as config:
+        for line in config:
+            line = line.split( '//' )[0].strip()
+            if line.startswith( 'width_buckets' ) and '=' in line:
+                value = line.split( '=', 1 )[1].strip()
+                if value:
+                    return [int( bound ) for bound in value.split( ',' )]
+    return None
+
+
 def element_length_fn( image, width, label, length, text ):
     """ 
     Determine element length
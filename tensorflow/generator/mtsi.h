@@ -0,0 +1,74 @@
+/*
+   CNN-LSTM-CTC-OCR
+   C interface to MTS (libmtsi.so), for ctypes and other language bindings
+
+   Copyright (C) 2018 Benjamin Gafford, Ziwen Chen, Liam Niehus-Staab
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MTSI_H
+#define MTSI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bumped whenever a signature below changes. Bindings should compare it
+ * against mts_api_version() before calling anything else */
+#define MTSI_API_VERSION 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* Returns MTSI_API_VERSION as the library was built */
+  int mts_api_version(void);
+
+  /* Create a handle. num_producers < 1 synthesizes in the calling thread,
+   * otherwise samples come from that many ipc_synth producer processes */
+  void* mts_init(const char* config_path, int num_producers);
+
+  /* Destroy a handle made by mts_init */
+  void mts_cleanup(void* mts_buff);
+
+  /* Synthesize n samples into caller-provided arrays, which must be at
+   * least as large as listed (they are written without further checks):
+   *   images - n * max_height * max_width bytes; sample i is a
+   *            max_height x max_width grayscale image at offset
+   *            i * max_height * max_width, top-left aligned, zero padded
+   *            (and cropped if it is larger)
+   *   heights, widths - n entries each; the size actually stored
+   *   labels - n * label_size bytes; label i at offset i * label_size,
+   *            null terminated and truncated to fit
+   * Nothing is allocated per sample. Returns n, or -1 on bad arguments
+   * (a null pointer, a zero size, n < 0, or array sizes that overflow
+   * size_t), in which case nothing is written */
+  int mts_get_batch(void* mts_buff, int n, uint8_t* images,
+                    size_t max_height, size_t max_width,
+                    int* heights, int* widths,
+                    char* labels, size_t label_size);
+
+  /* One heap allocated sample at a time (free with free_sample) */
+  void* get_sample(void* mts_buff);
+  void free_sample(void* spl);
+  unsigned char* get_img_data(void* spl);
+  size_t get_height(void* spl);
+  size_t get_width(void* spl);
+  char* get_caption(void* spl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
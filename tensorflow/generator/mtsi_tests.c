@@ -0,0 +1,133 @@
+/*
+   CNN-LSTM-CTC-OCR
+   Checks of the libmtsi.so C interface that need no synthesizer
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mtsi.h"
+
+#define N 2
+#define HEIGHT 4
+#define WIDTH 8
+#define LABEL_SIZE 16
+
+int g_failures = 0;
+
+/* Arrays for a batch of N samples, and a handle mts_get_batch must
+ * refuse to use (it is never dereferenced when the arguments are bad) */
+uint8_t g_images[N * HEIGHT * WIDTH];
+int g_heights[N];
+int g_widths[N];
+char g_labels[N * LABEL_SIZE];
+int g_not_a_handle;
+
+/* Fill the arrays with a pattern, to tell whether anything was written */
+void fill(void) {
+  memset(g_images, 0xA5, sizeof(g_images));
+  memset(g_heights, 0xA5, sizeof(g_heights));
+  memset(g_widths, 0xA5, sizeof(g_widths));
+  memset(g_labels, 0xA5, sizeof(g_labels));
+}
+
+/* Whether the arrays still hold the pattern */
+int untouched(void) {
+  const unsigned char* arrays[4] = { g_images, (unsigned char*)g_heights,
+				     (unsigned char*)g_widths,
+				     (unsigned char*)g_labels };
+  size_t sizes[4] = { sizeof(g_images), sizeof(g_heights),
+		      sizeof(g_widths), sizeof(g_labels) };
+  for(int a = 0; a < 4; a++) {
+    for(size_t i = 0; i < sizes[a]; i++) {
+      if(arrays[a][i] != 0xA5) {
+	return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/* Check that a call returned what it should, writing nothing */
+void expect(const char* what, int got, int want) {
+  if(got != want || !untouched()) {
+    fprintf(stderr, "FAILED: %s returned %d (expected %d)%s\n", what, got,
+	    want, untouched() ? "" : " and wrote to the arrays");
+    g_failures++;
+  }
+  fill();
+}
+
+/* main */
+int main(void) {
+  void* h = &g_not_a_handle;
+  fill();
+
+  if(mts_api_version() != MTSI_API_VERSION) {
+    fprintf(stderr, "FAILED: library API version %d, header %d\n",
+	    mts_api_version(), MTSI_API_VERSION);
+    g_failures++;
+  }
+
+  // Null pointers
+  expect("null handle", mts_get_batch(NULL, N, g_images, HEIGHT, WIDTH,
+				      g_heights, g_widths, g_labels,
+				      LABEL_SIZE), -1);
+  expect("null images", mts_get_batch(h, N, NULL, HEIGHT, WIDTH, g_heights,
+				      g_widths, g_labels, LABEL_SIZE), -1);
+  expect("null heights", mts_get_batch(h, N, g_images, HEIGHT, WIDTH, NULL,
+				       g_widths, g_labels, LABEL_SIZE), -1);
+  expect("null widths", mts_get_batch(h, N, g_images, HEIGHT, WIDTH,
+				      g_heights, NULL, g_labels, LABEL_SIZE),
+	 -1);
+  expect("null labels", mts_get_batch(h, N, g_images, HEIGHT, WIDTH,
+				      g_heights, g_widths, NULL, LABEL_SIZE),
+	 -1);
+
+  // Bad counts and sizes
+  expect("n < 0", mts_get_batch(h, -1, g_images, HEIGHT, WIDTH, g_heights,
+				g_widths, g_labels, LABEL_SIZE), -1);
+  expect("zero height", mts_get_batch(h, N, g_images, 0, WIDTH, g_heights,
+				      g_widths, g_labels, LABEL_SIZE), -1);
+  expect("zero width", mts_get_batch(h, N, g_images, HEIGHT, 0, g_heights,
+				     g_widths, g_labels, LABEL_SIZE), -1);
+  expect("zero label size", mts_get_batch(h, N, g_images, HEIGHT, WIDTH,
+					  g_heights, g_widths, g_labels, 0),
+	 -1);
+
+  // Array sizes past SIZE_MAX
+  expect("height * width overflow",
+	 mts_get_batch(h, N, g_images, SIZE_MAX / 2 + 1, 3, g_heights,
+		       g_widths, g_labels, LABEL_SIZE), -1);
+  expect("n * image size overflow",
+	 mts_get_batch(h, 3, g_images, SIZE_MAX / 4, 2, g_heights, g_widths,
+		       g_labels, LABEL_SIZE), -1);
+  expect("n * label size overflow",
+	 mts_get_batch(h, 3, g_images, HEIGHT, WIDTH, g_heights, g_widths,
+		       g_labels, SIZE_MAX / 2), -1);
+
+  // An empty batch is fine and never looks at the handle
+  expect("n = 0", mts_get_batch(h, 0, g_images, HEIGHT, WIDTH, g_heights,
+				g_widths, g_labels, LABEL_SIZE), 0);
+
+  if(g_failures > 0) {
+    fprintf(stderr, "%d mtsi check(s) failed\n", g_failures);
+    return 1;
+  }
+  printf("mtsi checks passed\n");
+  return 0;
+}
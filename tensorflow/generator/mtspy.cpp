@@ -0,0 +1,265 @@
+/*
+   CNN-LSTM-CTC-OCR
+   Boost.Python extension module for MTS (batched numpy output)
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <boost/python.hpp>
+#include <boost/python/numpy.hpp>
+
+#include "textsynthinterface.hpp"
+#include "mts_charset.hpp"
+
+namespace bp = boost::python;
+namespace np = boost::python::numpy;
+
+/* Releases the GIL for as long as it is in scope */
+struct ScopedGILRelease {
+  PyThreadState* state;
+  ScopedGILRelease() { state = PyEval_SaveThread(); }
+  ~ScopedGILRelease() { PyEval_RestoreThread(state); }
+};
+
+/* Owns the memory behind the arrays of one batch. numpy arrays made with
+ * from_data keep a reference to it, so the memory lives exactly as long
+ * as the last array viewing it */
+struct MTS_Batch {
+  unsigned char* images;
+  int32_t* heights;
+  int32_t* widths;
+  int32_t* labels;
+  int32_t* lengths;
+
+  MTS_Batch() : images(NULL), heights(NULL), widths(NULL), labels(NULL),
+                lengths(NULL) {}
+  ~MTS_Batch() {
+    free(images);
+    free(heights);
+    free(widths);
+    free(labels);
+    free(lengths);
+  }
+};
+
+/* Python-facing synthesizer */
+class MTS_Python {
+  MTS_Buffer* buff;
+  MTS_Charset* charset;
+  // Neither buffer type is thread safe; taken only without the GIL
+  std::mutex buff_lock;
+
+public:
+  /* num_producers = 0 synthesizes in-process, otherwise uses ipc_synth.
+   * charset_path names the model charset get_labeled_batch encodes with */
+  MTS_Python(std::string config_path, int num_producers = 0,
+             std::string charset_path = "") {
+    if(num_producers >= 1) {
+      buff = new MTS_Multithreaded(config_path.c_str(), num_producers);
+    } else {
+      buff = new MTS_Singlethreaded(config_path.c_str());
+    }
+    charset = charset_path.empty() ? NULL : new MTS_Charset(charset_path);
+  }
+
+  ~MTS_Python() {
+    buff->cleanup();
+    delete buff;
+    delete charset;
+  }
+
+  /* Returns (images, heights, widths, captions), where images is a
+   * [batch_size, max_height, max_width, 1] uint8 array, zero padded on the
+   * bottom and right, heights and widths are int32 arrays of the actual
+   * sizes, and captions is a list of str */
+  bp::tuple get_batch(int batch_size) {
+    if(batch_size < 1) {
+      PyErr_SetString(PyExc_ValueError, "batch_size must be positive");
+      bp::throw_error_already_set();
+    }
+
+    std::vector<sample_t*> samples(batch_size);
+    MTS_Batch* batch = new MTS_Batch();
+    size_t max_h = 0, max_w = 0;
+
+    {
+      // Synthesis and packing don't touch Python objects
+      ScopedGILRelease nogil;
+
+      {
+        // Python threads sharing a Synthesizer take turns
+        std::lock_guard<std::mutex> lock(buff_lock);
+        for(int i = 0; i < batch_size; i++) {
+          samples[i] = buff->get_sample();
+          max_h = std::max(max_h, samples[i]->height);
+          max_w = std::max(max_w, samples[i]->width);
+        }
+      }
+
+      // Pack into one zero padded block (the only copy of the pixels)
+      batch->images = (unsigned char*)calloc(batch_size * max_h * max_w, 1);
+      batch->heights = (int32_t*)malloc(batch_size * sizeof(int32_t));
+      batch->widths = (int32_t*)malloc(batch_size * sizeof(int32_t));
+      if(!batch->images || !batch->heights || !batch->widths) {
+        perror("Failed to allocate batch!\n");
+        exit(1);
+      }
+
+      for(int i = 0; i < batch_size; i++) {
+        sample_t* spl = samples[i];
+        unsigned char* dst = batch->images + i * max_h * max_w;
+        for(size_t row = 0; row < spl->height; row++) {
+          memcpy(dst + row * max_w, spl->img_data + row * spl->width,
+                 spl->width);
+        }
+        batch->heights[i] = (int32_t)spl->height;
+        batch->widths[i] = (int32_t)spl->width;
+      }
+    }
+
+    bp::list captions;
+    for(int i = 0; i < batch_size; i++) {
+      captions.append(bp::str(samples[i]->caption));
+      free_sample(samples[i]);
+    }
+
+    // Hand ownership of the memory to Python
+    bp::object owner(bp::handle<>(
+        bp::manage_new_object::apply<MTS_Batch*>::type()(batch)));
+
+    np::ndarray images = np::from_data(
+        batch->images, np::dtype::get_builtin<unsigned char>(),
+        bp::make_tuple(batch_size, max_h, max_w, 1),
+        bp::make_tuple(max_h * max_w, max_w, 1, 1), owner);
+    np::ndarray heights = np::from_data(
+        batch->heights, np::dtype::get_builtin<int32_t>(),
+        bp::make_tuple(batch_size), bp::make_tuple(sizeof(int32_t)), owner);
+    np::ndarray widths = np::from_data(
+        batch->widths, np::dtype::get_builtin<int32_t>(),
+        bp::make_tuple(batch_size), bp::make_tuple(sizeof(int32_t)), owner);
+
+    return bp::make_tuple(images, heights, widths, captions);
+  }
+
+  /* Like get_batch, but also encodes the captions with the charset.
+   * Returns (images, heights, widths, labels, lengths, captions), where
+   * labels is a [batch_size, max_length] int32 array of class indices
+   * padded with -1 and lengths holds the length of each */
+  bp::tuple get_labeled_batch(int batch_size) {
+    if(!charset) {
+      PyErr_SetString(PyExc_ValueError, "no charset_path was given");
+      bp::throw_error_already_set();
+    }
+
+    bp::tuple batch = get_batch(batch_size);
+    std::vector<std::string> captions(batch_size);
+    for(int i = 0; i < batch_size; i++) {
+      captions[i] = bp::extract<std::string>(batch[3][i]);
+    }
+
+    MTS_Batch* encoded = new MTS_Batch();
+    int bad = -1;
+    size_t max_len = 0;
+
+    {
+      ScopedGILRelease nogil;
+
+      std::vector<std::vector<int32_t> > labels(batch_size);
+      for(int i = 0; i < batch_size; i++) {
+        if(!charset->encode(captions[i], labels[i]) && bad < 0) {
+          bad = i;
+        }
+        max_len = std::max(max_len, labels[i].size());
+      }
+
+      encoded->labels = (int32_t*)malloc(
+          std::max((size_t)1, batch_size * max_len) * sizeof(int32_t));
+      encoded->lengths = (int32_t*)malloc(batch_size * sizeof(int32_t));
+      if(!encoded->labels || !encoded->lengths) {
+        perror("Failed to allocate labels!\n");
+        exit(1);
+      }
+
+      for(int i = 0; i < batch_size; i++) {
+        int32_t* dst = encoded->labels + i * max_len;
+        std::copy(labels[i].begin(), labels[i].end(), dst);
+        std::fill(dst + labels[i].size(), dst + max_len, -1);
+        encoded->lengths[i] = (int32_t)labels[i].size();
+      }
+    }
+
+    bp::object owner(bp::handle<>(
+        bp::manage_new_object::apply<MTS_Batch*>::type()(encoded)));
+
+    if(bad >= 0) {
+      std::string msg = "caption outside the charset: " + captions[bad];
+      PyErr_SetString(PyExc_ValueError, msg.c_str());
+      bp::throw_error_already_set();
+    }
+
+    np::ndarray labels = np::from_data(
+        encoded->labels, np::dtype::get_builtin<int32_t>(),
+        bp::make_tuple(batch_size, max_len),
+        bp::make_tuple(max_len * sizeof(int32_t), sizeof(int32_t)), owner);
+    np::ndarray lengths = np::from_data(
+        encoded->lengths, np::dtype::get_builtin<int32_t>(),
+        bp::make_tuple(batch_size), bp::make_tuple(sizeof(int32_t)), owner);
+
+    return bp::make_tuple(batch[0], batch[1], batch[2], labels, lengths,
+                          batch[3]);
+  }
+
+  /* Returns (caption, image) for a single sample, image being a
+   * [height, width, 1] uint8 array */
+  bp::tuple get_sample() {
+    bp::tuple batch = get_batch(1);
+    np::ndarray images = bp::extract<np::ndarray>(batch[0]);
+    int height = bp::extract<int>(batch[1][0]);
+    int width = bp::extract<int>(batch[2][0]);
+    bp::object image = images[0][bp::make_tuple(bp::slice(0, height),
+                                                bp::slice(0, width))];
+    return bp::make_tuple(batch[3][0], image);
+  }
+};
+
+BOOST_PYTHON_MODULE(mtspy) {
+  Py_Initialize();
+  np::initialize();
+
+  // Only ever created from get_batch, as the owner of a batch's memory
+  bp::class_<MTS_Batch, boost::noncopyable>("Batch", bp::no_init);
+
+  bp::class_<MTS_Python, boost::noncopyable>(
+      "Synthesizer",
+      "MapTextSynthesizer instance (num_producers > 0 uses ipc_synth)",
+      bp::init<std::string, bp::optional<int, std::string> >(
+          bp::args("config_path", "num_producers", "charset_path")))
+    .def("get_batch", &MTS_Python::get_batch, bp::args("batch_size"),
+         "Synthesize batch_size samples (without holding the GIL) and return "
+         "(images, heights, widths, captions)")
+    .def("get_labeled_batch", &MTS_Python::get_labeled_batch,
+         bp::args("batch_size"),
+         "Like get_batch, but also returns the captions encoded with the "
+         "charset: (images, heights, widths, labels, lengths, captions)")
+    .def("get_sample", &MTS_Python::get_sample,
+         "Synthesize one sample and return (caption, image)");
+}
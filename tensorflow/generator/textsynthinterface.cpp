@@ -21,31 +21,18 @@
 #include <string>
 #include <vector>
 #include <fstream>
-#include <mtsynth/map_text_synthesizer.hpp>
 #include <stdio.h>
-extern "C" {
-#include "mts_ipc.h"
-#include "ipc_consumer.h"
-}
-
-struct MTS_Buffer {
-  virtual void cleanup(void) = 0;
-  virtual sample_t* get_sample(void) = 0;
-};
-
-struct MTS_Singlethreaded : MTS_Buffer {
-  cv::Ptr<MapTextSynthesizer> mts;
-  MTS_Singlethreaded(const char* config_path);
-  void cleanup(void);
-  sample_t* get_sample(void);
-};
-
-struct MTS_Multithreaded : MTS_Buffer {
-  int num_producers;
-  MTS_Multithreaded(const char* config_path, int num_producers);
-  void cleanup(void);
-  sample_t* get_sample(void);
-};
+#include <stdint.h> // SIZE_MAX
+
+#include "textsynthinterface.hpp"
+
+/* Samples cross this interface as bytes */
+static void check_8bit(const cv::Mat& image) {
+  if(image.type() != CV_8UC1) {
+    fprintf(stderr, "Samples must be 8 bit (unset output_float in the config)\n");
+    exit(1);
+  }
+}
 
 MTS_Singlethreaded::MTS_Singlethreaded(const char* config_file) {
   this->mts = MapTextSynthesizer::create(config_file);
@@ -66,6 +53,7 @@ sample_t* MTS_Singlethreaded::get_sample(void) {
 
   // Fill in label, image
   mts->generateSample(label, image, height);
+  check_8bit(image);
 
   // Stick the necessary data into sample_t struct
   sample_t* spl;
@@ -99,6 +87,22 @@ sample_t* MTS_Multithreaded::get_sample(void) {
   return (sample_t*)mts_ipc_get_sample();
 }
 
+void MTS_Singlethreaded::get_sample_into(sample_dest_t* dst) {
+  int height;
+
+  // label and image keep their storage between calls
+  this->mts->generateSample(this->label, this->image, height);
+  check_8bit(this->image);
+
+  //NOTE: implied single channel here -- won't work with nongray images!
+  sample_dest_fill(dst, this->image.data, this->image.rows,
+                   this->image.cols, this->label.c_str());
+}
+
+void MTS_Multithreaded::get_sample_into(sample_dest_t* dst) {
+  mts_ipc_get_sample_into(dst);
+}
+
 void MTS_Singlethreaded::cleanup(void) {
   /*Currently does nothing. Retained for potential future use. */
 }
@@ -107,16 +111,10 @@ void MTS_Multithreaded::cleanup(void) {
   mts_ipc_cleanup();
 }
 
-// For ctypes visibility
-extern "C" {
-  unsigned char* get_img_data(void* spl);
-  size_t get_height(void* spl);
-  size_t get_width(void* spl);
-  char* get_caption(void* spl);
-  void* mts_init(const char* config_path, int num_producers);
-  void* get_sample(void* mts_buff);
-  void free_sample(void* spl);
-  void mts_cleanup(void* mts_buff);
+// Exported functions are declared extern "C" in mtsi.h
+
+int mts_api_version(void) {
+  return MTSI_API_VERSION;
 }
 
 void free_sample(void* ptr) {
@@ -155,8 +153,44 @@ void* mts_init(const char* config_path, int num_threads) {
   }
 }
 
+/* Fill caller arrays with n samples (see mtsi.h) */
+int mts_get_batch(void* mts_buff, int n, uint8_t* images,
+                  size_t max_height, size_t max_width,
+                  int* heights, int* widths,
+                  char* labels, size_t label_size) {
+  if(!mts_buff || n < 0 || !images || !heights || !widths || !labels
+     || max_height == 0 || max_width == 0 || label_size == 0) {
+    return -1;
+  }
+
+  // the caller's images array has to span n * max_height * max_width
+  // bytes; refuse sizes whose byte count doesn't fit in a size_t
+  size_t image_size = max_height * max_width;
+  if(image_size / max_height != max_width
+     || (n > 0 && image_size > SIZE_MAX / (size_t)n)
+     || (n > 0 && label_size > SIZE_MAX / (size_t)n)) {
+    return -1;
+  }
+
+  MTS_Buffer* buff = (MTS_Buffer*)mts_buff;
+  sample_dest_t dst;
+  dst.max_height = max_height;
+  dst.max_width = max_width;
+  dst.caption_size = label_size;
+
+  for(int i = 0; i < n; i++) {
+    dst.img_data = images + (size_t)i * image_size;
+    dst.caption = labels + (size_t)i * label_size;
+    buff->get_sample_into(&dst);
+    heights[i] = (int)dst.height;
+    widths[i] = (int)dst.width;
+  }
+
+  return n;
+}
+
 /* Called after using python generator function */
 void mts_cleanup(void* mts) {
   ((MTS_Buffer*)mts)->cleanup();
-  free(mts);
+  delete (MTS_Buffer*)mts;
 }
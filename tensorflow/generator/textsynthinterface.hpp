@@ -0,0 +1,62 @@
+/* 
+   CNN-LSTM-CTC-OCR       
+   Sample sources shared by the ctypes wrapper and the Python extension
+
+   Copyright (C) 2018 Benjamin Gafford, Ziwen Chen, Liam Niehus-Staab
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TEXTSYNTHINTERFACE_HPP
+#define TEXTSYNTHINTERFACE_HPP
+
+#include <string>
+#include <mtsynth/map_text_synthesizer.hpp>
+#include "mtsi.h"
+extern "C" {
+#include "mts_ipc.h"
+#include "ipc_consumer.h"
+}
+
+/* A source of heap allocated samples (free them with free_sample) */
+struct MTS_Buffer {
+  virtual void cleanup(void) = 0;
+  virtual sample_t* get_sample(void) = 0;
+  // Copy the next sample into caller memory, without allocating
+  virtual void get_sample_into(sample_dest_t* dst) = 0;
+  virtual ~MTS_Buffer() {}
+};
+
+/* Synthesizes in the calling thread */
+struct MTS_Singlethreaded : MTS_Buffer {
+  cv::Ptr<MapTextSynthesizer> mts;
+  // Reused between get_sample_into calls
+  std::string label;
+  cv::Mat image;
+  MTS_Singlethreaded(const char* config_path);
+  void cleanup(void);
+  sample_t* get_sample(void);
+  void get_sample_into(sample_dest_t* dst);
+};
+
+/* Consumes samples from producer processes over shared memory */
+struct MTS_Multithreaded : MTS_Buffer {
+  int num_producers;
+  MTS_Multithreaded(const char* config_path, int num_producers);
+  void cleanup(void);
+  sample_t* get_sample(void);
+  void get_sample_into(sample_dest_t* dst);
+};
+
+#endif